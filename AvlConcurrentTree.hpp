@@ -0,0 +1,773 @@
+#pragma once
+
+#include <AvlTree.hpp>
+#include <AvlEpoch.hpp>
+
+#include <atomic>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+
+namespace Avl
+{
+
+// Node of a concurrent tree. Besides links it keeps the height of its subtree, a version
+// that is changed every time the subtree shrinks (readers validate their path against it)
+// and a lock. An erased node with two children stays in the tree as a routing node.
+struct ConcurrentNode
+{
+    std::atomic<ConcurrentNode*> m_Parent; // the tree's holder node for the root
+    std::atomic<ConcurrentNode*> m_Child[2]; // { left-lesser, right-bigger }
+    std::atomic<uint64_t> m_Version; // unlinked << 0 | shrinking << 1 | counter of shrinks << 2
+    std::atomic<int32_t> m_Height;
+    std::atomic<bool> m_Present; // false for routing nodes
+    std::atomic<bool> m_Locked;
+};
+
+// Concurrent AVL tree with optimistic readers and fine-grained locking writers
+// (N. G. Bronson et al., "A Practical Concurrent Binary Search Tree").
+// Searches go hand-over-hand validating versions of the nodes on the path and never lock.
+// Modifications lock only the nodes they change, the balance is restored by rotations
+// over the path to the root, and may be relaxed for a while under concurrent updates.
+// Every thread works through its own Session; nodes unlinked from the tree are retired
+// and handed back by reclaim() when no thread can see them.
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator = Default<Item>>
+class ConcurrentTree
+{
+public:
+    inline ConcurrentTree();
+    ConcurrentTree(const ConcurrentTree&) = delete;
+    ConcurrentTree& operator=(const ConcurrentTree&) = delete;
+
+    // One session per thread. Operations must be done between lock() and unlock(),
+    // the found items stay valid until unlock() even if they are erased meanwhile.
+    class Session
+    {
+    public:
+        explicit Session(ConcurrentTree& aTree) : m_Tree(aTree), m_Slot(aTree.m_Epochs.attach()) {}
+        ~Session() { m_Tree.m_Epochs.detach(m_Slot); }
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        void lock() { m_Tree.m_Epochs.enter(m_Slot); }
+        void unlock() { m_Tree.m_Epochs.leave(m_Slot); }
+
+        template <class Key>
+        Item* find(const Key& aKey) const { return m_Tree.find(aKey); }
+        // false if an item with the same key is in the tree.
+        bool insert(Item& aItem) { return m_Tree.insert(aItem); }
+        // false if the item is not in the tree (e.g. erased by another thread).
+        // The item must not be reused until it's returned by reclaim().
+        bool erase(Item& aItem) { return m_Tree.erase(aItem); }
+
+    private:
+        ConcurrentTree& m_Tree;
+        size_t m_Slot;
+    };
+
+    // Pass the erased items that no thread can access anymore to aDisposer(Item&).
+    template <class Disposer>
+    inline size_t reclaim(Disposer aDisposer);
+    size_t size() const { return m_Size.load(std::memory_order_relaxed); }
+
+    // Debug, only when there are no concurrent modifications.
+    inline int selfCheck() const;
+
+private:
+    static const uint64_t UNLINKED = 1;
+    static const uint64_t SHRINKING = 2;
+    // Results of nodeCondition() other than the new height.
+    static const int32_t NOTHING_REQUIRED = -1;
+    static const int32_t REBALANCE_REQUIRED = -2;
+    static const int32_t UNLINK_REQUIRED = -3;
+    enum Result { RETRY, INSERTED, EXISTS };
+
+    // The holder is never rotated; its right child is the root.
+    ConcurrentNode m_Holder;
+    std::atomic<size_t> m_Size;
+    EpochDomain m_Epochs;
+    std::mutex m_RetiredMutex;
+    Retired<Item> m_Retired;
+
+    class NodeLock
+    {
+    public:
+        explicit NodeLock(ConcurrentNode* aNode) : m_Node(aNode) { lockNode(aNode); }
+        ~NodeLock() { unlockNode(m_Node); }
+        NodeLock(const NodeLock&) = delete;
+        NodeLock& operator=(const NodeLock&) = delete;
+    private:
+        ConcurrentNode* m_Node;
+    };
+
+    using Order = Comparison<Item, Comparator>;
+    static inline const Item* objByNode(const ConcurrentNode* aNode);
+    static inline Item* objByNode(ConcurrentNode* aNode);
+    static ConcurrentNode* getParent(const ConcurrentNode* aNode) { return aNode->m_Parent.load(std::memory_order_acquire); }
+    static void setParent(ConcurrentNode* aNode, ConcurrentNode* aParent) { aNode->m_Parent.store(aParent, std::memory_order_release); }
+    static ConcurrentNode* getChild(const ConcurrentNode* aNode, bool aRight) { return aNode->m_Child[aRight].load(std::memory_order_acquire); }
+    static void setChild(ConcurrentNode* aNode, bool aRight, ConcurrentNode* aChild) { aNode->m_Child[aRight].store(aChild, std::memory_order_release); }
+    static uint64_t getVersion(const ConcurrentNode* aNode) { return aNode->m_Version.load(std::memory_order_acquire); }
+    static void setVersion(ConcurrentNode* aNode, uint64_t aVersion) { aNode->m_Version.store(aVersion, std::memory_order_release); }
+    static bool isShrinkingOrUnlinked(uint64_t aVersion) { return 0 != (aVersion & (SHRINKING | UNLINKED)); }
+    static uint64_t beginShrink(uint64_t aVersion) { return aVersion | SHRINKING; }
+    static uint64_t endShrink(uint64_t aVersion) { return (aVersion | SHRINKING) + SHRINKING; }
+    static int32_t heightOf(const ConcurrentNode* aNode) { return nullptr == aNode ? 0 : aNode->m_Height.load(std::memory_order_relaxed); }
+    static void setHeight(ConcurrentNode* aNode, int32_t aHeight) { aNode->m_Height.store(aHeight, std::memory_order_relaxed); }
+    static bool isPresent(const ConcurrentNode* aNode) { return aNode->m_Present.load(std::memory_order_acquire); }
+    static inline void lockNode(ConcurrentNode* aNode);
+    static void unlockNode(ConcurrentNode* aNode) { aNode->m_Locked.store(false, std::memory_order_release); }
+    static inline void waitUntilNotShrinking(const ConcurrentNode* aNode);
+
+    template <class Key>
+    inline Item* find(const Key& aKey) const;
+    template <class Key>
+    inline bool attemptFind(const Key& aKey, const ConcurrentNode* aNode, bool aRight, uint64_t aVersion, Item*& aRes) const;
+    inline bool insert(Item& aItem);
+    inline Result attemptInsert(Item& aItem, ConcurrentNode* aNode, uint64_t aVersion);
+    inline Result attemptReplaceRouting(ConcurrentNode* aNew, ConcurrentNode* aNode);
+    inline bool erase(Item& aItem);
+    inline void retire(ConcurrentNode* aNode);
+
+    // Rebalancing; methods with _nl suffix are called with the nodes locked.
+    static inline int32_t nodeCondition(const ConcurrentNode* aNode);
+    static inline ConcurrentNode* fixHeight_nl(ConcurrentNode* aNode);
+    inline void fixHeightAndRebalance(ConcurrentNode* aNode);
+    inline ConcurrentNode* rebalance_nl(ConcurrentNode* aParent, ConcurrentNode* aNode);
+    inline ConcurrentNode* rebalanceTo_nl(ConcurrentNode* aParent, ConcurrentNode* aNode, bool aHeavy,
+                                          ConcurrentNode* aChild, int32_t aLightHeight);
+    static inline ConcurrentNode* rotate_nl(ConcurrentNode* aParent, ConcurrentNode* aNode, bool aHeavy, int32_t aLightHeight,
+                                            ConcurrentNode* aChild, int32_t aOuterHeight,
+                                            ConcurrentNode* aInner, int32_t aInnerHeight);
+    static inline ConcurrentNode* rotateOver_nl(ConcurrentNode* aParent, ConcurrentNode* aNode, bool aHeavy, int32_t aLightHeight,
+                                                ConcurrentNode* aChild, int32_t aOuterHeight,
+                                                ConcurrentNode* aInner, int32_t aInnerOuterHeight);
+    inline bool attemptUnlink_nl(ConcurrentNode* aParent, ConcurrentNode* aNode);
+    inline int checkSubTree(const ConcurrentNode* aNode, const ConcurrentNode* aParent, const ConcurrentNode*& aPrev,
+                            int32_t& aHeight, size_t& aSize) const;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////// Implementaion /////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+ConcurrentTree<Item, NodeMember, Comparator>::ConcurrentTree() : m_Size(0)
+{
+    m_Holder.m_Parent.store(nullptr, std::memory_order_relaxed);
+    m_Holder.m_Child[0].store(nullptr, std::memory_order_relaxed);
+    m_Holder.m_Child[1].store(nullptr, std::memory_order_relaxed);
+    m_Holder.m_Version.store(0, std::memory_order_relaxed);
+    m_Holder.m_Height.store(0, std::memory_order_relaxed);
+    m_Holder.m_Present.store(false, std::memory_order_relaxed);
+    m_Holder.m_Locked.store(false, std::memory_order_relaxed);
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+template <class Disposer>
+size_t ConcurrentTree<Item, NodeMember, Comparator>::reclaim(Disposer aDisposer)
+{
+    std::lock_guard<std::mutex> sLock(m_RetiredMutex);
+    return m_Retired.reclaim(m_Epochs.advance(), aDisposer);
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+const Item* ConcurrentTree<Item, NodeMember, Comparator>::objByNode(const ConcurrentNode* aNode)
+{
+    const uintptr_t sOffset = reinterpret_cast<uintptr_t>(&(reinterpret_cast<const Item*>(0)->*NodeMember));
+    return reinterpret_cast<const Item*>(reinterpret_cast<const char*>(aNode) - sOffset);
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+Item* ConcurrentTree<Item, NodeMember, Comparator>::objByNode(ConcurrentNode* aNode)
+{
+    return const_cast<Item*>(objByNode(const_cast<const ConcurrentNode*>(aNode)));
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+void ConcurrentTree<Item, NodeMember, Comparator>::lockNode(ConcurrentNode* aNode)
+{
+    while (aNode->m_Locked.exchange(true, std::memory_order_acquire))
+        while (aNode->m_Locked.load(std::memory_order_relaxed))
+            std::this_thread::yield();
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+void ConcurrentTree<Item, NodeMember, Comparator>::waitUntilNotShrinking(const ConcurrentNode* aNode)
+{
+    uint64_t sVersion = getVersion(aNode);
+    if (0 != (sVersion & SHRINKING))
+        while (getVersion(aNode) == sVersion)
+            std::this_thread::yield();
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+template <class Key>
+Item* ConcurrentTree<Item, NodeMember, Comparator>::find(const Key& aKey) const
+{
+    while (true)
+    {
+        const ConcurrentNode* sRoot = getChild(&m_Holder, 1);
+        if (nullptr == sRoot)
+            return nullptr;
+        uint64_t sVersion = getVersion(sRoot);
+        if (isShrinkingOrUnlinked(sVersion))
+        {
+            waitUntilNotShrinking(sRoot);
+            continue;
+        }
+        if (sRoot != getChild(&m_Holder, 1))
+            continue;
+        int sCmp = Order::compare(*objByNode(sRoot), aKey);
+        if (0 == sCmp)
+        {
+            if (isPresent(sRoot))
+                return const_cast<Item*>(objByNode(sRoot));
+            if (getVersion(sRoot) == sVersion)
+                return nullptr;
+            continue;
+        }
+        Item* sRes;
+        if (attemptFind(aKey, sRoot, sCmp < 0, sVersion, sRes))
+            return sRes;
+    }
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+template <class Key>
+bool ConcurrentTree<Item, NodeMember, Comparator>::attemptFind(const Key& aKey, const ConcurrentNode* aNode, bool aRight,
+                                                               uint64_t aVersion, Item*& aRes) const
+{
+    // aNode was validated with aVersion and aKey is in the aRight subtree of it.
+    // Return false if aNode has shrunk since then, the caller must retry.
+    while (true)
+    {
+        const ConcurrentNode* sChild = getChild(aNode, aRight);
+        if (nullptr == sChild)
+        {
+            if (getVersion(aNode) != aVersion)
+                return false;
+            aRes = nullptr;
+            return true;
+        }
+        uint64_t sChildVersion = getVersion(sChild);
+        if (isShrinkingOrUnlinked(sChildVersion))
+        {
+            waitUntilNotShrinking(sChild);
+            if (getVersion(aNode) != aVersion)
+                return false;
+            continue;
+        }
+        if (sChild != getChild(aNode, aRight) || getVersion(aNode) != aVersion)
+        {
+            if (getVersion(aNode) != aVersion)
+                return false;
+            continue;
+        }
+        // The path to sChild is valid, go on hand-over-hand.
+        int sCmp = Order::compare(*objByNode(sChild), aKey);
+        if (0 == sCmp)
+        {
+            // A present node is never unlinked; an unlinked routing node may have a successor.
+            if (isPresent(sChild))
+            {
+                aRes = const_cast<Item*>(objByNode(sChild));
+                return true;
+            }
+            if (getVersion(sChild) == sChildVersion)
+            {
+                aRes = nullptr;
+                return true;
+            }
+            continue;
+        }
+        if (attemptFind(aKey, sChild, sCmp < 0, sChildVersion, aRes))
+            return true;
+    }
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+bool ConcurrentTree<Item, NodeMember, Comparator>::insert(Item& aItem)
+{
+    ConcurrentNode* sNew = &(aItem.*NodeMember);
+    sNew->m_Parent.store(nullptr, std::memory_order_relaxed);
+    sNew->m_Child[0].store(nullptr, std::memory_order_relaxed);
+    sNew->m_Child[1].store(nullptr, std::memory_order_relaxed);
+    sNew->m_Version.store(0, std::memory_order_relaxed);
+    sNew->m_Height.store(1, std::memory_order_relaxed);
+    sNew->m_Present.store(true, std::memory_order_relaxed);
+    sNew->m_Locked.store(false, std::memory_order_relaxed);
+
+    while (true)
+    {
+        ConcurrentNode* sRoot = getChild(&m_Holder, 1);
+        if (nullptr == sRoot)
+        {
+            NodeLock sLock(&m_Holder);
+            if (nullptr == getChild(&m_Holder, 1))
+            {
+                m_Size.fetch_add(1, std::memory_order_relaxed);
+                setParent(sNew, &m_Holder);
+                setChild(&m_Holder, 1, sNew);
+                return true;
+            }
+            continue;
+        }
+        uint64_t sVersion = getVersion(sRoot);
+        if (isShrinkingOrUnlinked(sVersion))
+        {
+            waitUntilNotShrinking(sRoot);
+            continue;
+        }
+        if (sRoot != getChild(&m_Holder, 1))
+            continue;
+        Result sRes = attemptInsert(aItem, sRoot, sVersion);
+        if (RETRY != sRes)
+            return INSERTED == sRes;
+    }
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+typename ConcurrentTree<Item, NodeMember, Comparator>::Result
+ConcurrentTree<Item, NodeMember, Comparator>::attemptInsert(Item& aItem, ConcurrentNode* aNode, uint64_t aVersion)
+{
+    ConcurrentNode* sNew = &(aItem.*NodeMember);
+    int sCmp = Order::compare(*objByNode(aNode), aItem);
+    if (0 == sCmp)
+        return attemptReplaceRouting(sNew, aNode);
+    bool sRight = sCmp < 0;
+
+    while (true)
+    {
+        ConcurrentNode* sChild = getChild(aNode, sRight);
+        if (getVersion(aNode) != aVersion)
+            return RETRY;
+        if (nullptr == sChild)
+        {
+            ConcurrentNode* sDamaged;
+            {
+                NodeLock sLock(aNode);
+                if (getVersion(aNode) != aVersion)
+                    return RETRY;
+                if (nullptr != getChild(aNode, sRight))
+                    continue;
+                m_Size.fetch_add(1, std::memory_order_relaxed);
+                setParent(sNew, aNode);
+                setChild(aNode, sRight, sNew);
+                sDamaged = fixHeight_nl(aNode);
+            }
+            fixHeightAndRebalance(sDamaged);
+            return INSERTED;
+        }
+        uint64_t sChildVersion = getVersion(sChild);
+        if (isShrinkingOrUnlinked(sChildVersion))
+        {
+            waitUntilNotShrinking(sChild);
+            continue;
+        }
+        if (sChild != getChild(aNode, sRight))
+            continue;
+        if (getVersion(aNode) != aVersion)
+            return RETRY;
+        Result sRes = attemptInsert(aItem, sChild, sChildVersion);
+        if (RETRY != sRes)
+            return sRes;
+    }
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+typename ConcurrentTree<Item, NodeMember, Comparator>::Result
+ConcurrentTree<Item, NodeMember, Comparator>::attemptReplaceRouting(ConcurrentNode* aNew, ConcurrentNode* aNode)
+{
+    // The node with the same key belongs to another item. If it's a routing node,
+    // the new node takes its place.
+    if (isPresent(aNode))
+        return EXISTS;
+    ConcurrentNode* sParent = getParent(aNode);
+    NodeLock sParentLock(sParent);
+    if (0 != (getVersion(sParent) & UNLINKED) || getParent(aNode) != sParent)
+        return RETRY;
+    NodeLock sLock(aNode);
+    if (0 != (getVersion(aNode) & UNLINKED))
+        return RETRY;
+    if (isPresent(aNode))
+        return EXISTS;
+
+    m_Size.fetch_add(1, std::memory_order_relaxed);
+    for (bool sRight : {false, true})
+    {
+        ConcurrentNode* sChild = getChild(aNode, sRight);
+        aNew->m_Child[sRight].store(sChild, std::memory_order_relaxed);
+        if (nullptr != sChild)
+            setParent(sChild, aNew);
+    }
+    setHeight(aNew, heightOf(aNode));
+    setParent(aNew, sParent);
+    setChild(sParent, getChild(sParent, 1) == aNode, aNew);
+    setVersion(aNode, UNLINKED);
+    retire(aNode);
+    return INSERTED;
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+bool ConcurrentTree<Item, NodeMember, Comparator>::erase(Item& aItem)
+{
+    ConcurrentNode* sNode = &(aItem.*NodeMember);
+    while (true)
+    {
+        if (!isPresent(sNode))
+            return false;
+        if (nullptr != getChild(sNode, 0) && nullptr != getChild(sNode, 1))
+        {
+            // Two children: the node just becomes a routing one.
+            NodeLock sLock(sNode);
+            if (!isPresent(sNode))
+                return false;
+            if (nullptr == getChild(sNode, 0) || nullptr == getChild(sNode, 1))
+                continue;
+            sNode->m_Present.store(false, std::memory_order_release);
+            m_Size.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        ConcurrentNode* sDamaged;
+        {
+            ConcurrentNode* sParent = getParent(sNode);
+            NodeLock sParentLock(sParent);
+            if (0 != (getVersion(sParent) & UNLINKED) || getParent(sNode) != sParent)
+                continue;
+            NodeLock sLock(sNode);
+            if (!isPresent(sNode))
+                return false;
+            sNode->m_Present.store(false, std::memory_order_release);
+            m_Size.fetch_sub(1, std::memory_order_relaxed);
+            if (nullptr != getChild(sNode, 0) && nullptr != getChild(sNode, 1))
+                return true;
+            attemptUnlink_nl(sParent, sNode);
+            sDamaged = fixHeight_nl(sParent);
+        }
+        fixHeightAndRebalance(sDamaged);
+        return true;
+    }
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+void ConcurrentTree<Item, NodeMember, Comparator>::retire(ConcurrentNode* aNode)
+{
+    std::lock_guard<std::mutex> sLock(m_RetiredMutex);
+    m_Retired.retire(objByNode(aNode), m_Epochs.current());
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+int32_t ConcurrentTree<Item, NodeMember, Comparator>::nodeCondition(const ConcurrentNode* aNode)
+{
+    // The new height of aNode, or what else must be done with it.
+    const ConcurrentNode* sLeft = getChild(aNode, 0);
+    const ConcurrentNode* sRight = getChild(aNode, 1);
+    if ((nullptr == sLeft || nullptr == sRight) && !isPresent(aNode))
+        return UNLINK_REQUIRED;
+    int32_t sHeight = heightOf(aNode);
+    int32_t sLeftHeight = heightOf(sLeft);
+    int32_t sRightHeight = heightOf(sRight);
+    int32_t sNewHeight = 1 + std::max(sLeftHeight, sRightHeight);
+    int32_t sBalance = sLeftHeight - sRightHeight;
+    if (sBalance < -1 || sBalance > 1)
+        return REBALANCE_REQUIRED;
+    return sHeight != sNewHeight ? sNewHeight : NOTHING_REQUIRED;
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+ConcurrentNode* ConcurrentTree<Item, NodeMember, Comparator>::fixHeight_nl(ConcurrentNode* aNode)
+{
+    // Return the next node to be fixed, or nullptr.
+    if (nullptr == getParent(aNode))
+        return nullptr; // the holder
+    int32_t sCondition = nodeCondition(aNode);
+    switch (sCondition)
+    {
+    case REBALANCE_REQUIRED:
+    case UNLINK_REQUIRED:
+        return aNode;
+    case NOTHING_REQUIRED:
+        return nullptr;
+    default:
+        setHeight(aNode, sCondition);
+        return getParent(aNode);
+    }
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+void ConcurrentTree<Item, NodeMember, Comparator>::fixHeightAndRebalance(ConcurrentNode* aNode)
+{
+    // When a rotation leaves a node below that needs more work, heights above it are not
+    // fixed yet; such places are revisited after the work below is done. Revisits that don't
+    // fit into the array go to the heap, none is dropped, so the tree is balanced again when
+    // modifications stop.
+    const size_t MAX_REVISITS = 64;
+    ConcurrentNode* sRevisits[MAX_REVISITS];
+    size_t sRevisitCount = 0;
+    std::vector<ConcurrentNode*> sMoreRevisits;
+    while (true)
+    {
+        if (nullptr == aNode || nullptr == getParent(aNode))
+        {
+            if (!sMoreRevisits.empty())
+            {
+                aNode = sMoreRevisits.back();
+                sMoreRevisits.pop_back();
+                continue;
+            }
+            if (0 == sRevisitCount)
+                return;
+            aNode = sRevisits[--sRevisitCount];
+            continue;
+        }
+        int32_t sCondition = nodeCondition(aNode);
+        if (NOTHING_REQUIRED == sCondition || 0 != (getVersion(aNode) & UNLINKED))
+        {
+            aNode = nullptr;
+            continue;
+        }
+        if (UNLINK_REQUIRED != sCondition && REBALANCE_REQUIRED != sCondition)
+        {
+            NodeLock sLock(aNode);
+            aNode = fixHeight_nl(aNode);
+            continue;
+        }
+        ConcurrentNode* sParent = getParent(aNode);
+        NodeLock sParentLock(sParent);
+        if (0 == (getVersion(sParent) & UNLINKED) && getParent(aNode) == sParent)
+        {
+            NodeLock sLock(aNode);
+            ConcurrentNode* sNext = rebalance_nl(sParent, aNode);
+            ConcurrentNode* sLast = !sMoreRevisits.empty() ? sMoreRevisits.back() :
+                                    0 != sRevisitCount ? sRevisits[sRevisitCount - 1] : nullptr;
+            if (nullptr != sNext && sNext != sParent && sNext != getParent(sParent) && sLast != sParent)
+            {
+                if (sRevisitCount < MAX_REVISITS)
+                    sRevisits[sRevisitCount++] = sParent;
+                else
+                    sMoreRevisits.push_back(sParent);
+            }
+            aNode = sNext;
+        }
+    }
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+ConcurrentNode* ConcurrentTree<Item, NodeMember, Comparator>::rebalance_nl(ConcurrentNode* aParent, ConcurrentNode* aNode)
+{
+    ConcurrentNode* sLeft = getChild(aNode, 0);
+    ConcurrentNode* sRight = getChild(aNode, 1);
+    if ((nullptr == sLeft || nullptr == sRight) && !isPresent(aNode))
+        return attemptUnlink_nl(aParent, aNode) ? fixHeight_nl(aParent) : aNode;
+
+    int32_t sHeight = heightOf(aNode);
+    int32_t sLeftHeight = heightOf(sLeft);
+    int32_t sRightHeight = heightOf(sRight);
+    int32_t sNewHeight = 1 + std::max(sLeftHeight, sRightHeight);
+    int32_t sBalance = sLeftHeight - sRightHeight;
+    if (sBalance > 1)
+        return rebalanceTo_nl(aParent, aNode, false, sLeft, sRightHeight);
+    if (sBalance < -1)
+        return rebalanceTo_nl(aParent, aNode, true, sRight, sLeftHeight);
+    if (sNewHeight != sHeight)
+    {
+        setHeight(aNode, sNewHeight);
+        return fixHeight_nl(aParent);
+    }
+    return nullptr;
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+ConcurrentNode* ConcurrentTree<Item, NodeMember, Comparator>::rebalanceTo_nl(ConcurrentNode* aParent, ConcurrentNode* aNode, bool aHeavy,
+                                                                             ConcurrentNode* aChild, int32_t aLightHeight)
+{
+    // aChild on aHeavy side of aNode is too high. Let's think that it's the left one,
+    // then (C) - aChild, (O) - its outer (left) child, (I) - inner (right) child:
+    /*
+     *            (N)                  (C)                     (I)
+     *           /   \                /   \                  /     \
+     *         (C)   ...    --->    (O)   (N)    or        (C)     (N)
+     *        /   \                      /   \            /  \     /  \
+     *      (O)   (I)                  (I)   ...        (O)  ..  ..   ...
+     */
+    bool sLight = !aHeavy;
+    NodeLock sLock(aChild);
+    int32_t sChildHeight = heightOf(aChild);
+    if (sChildHeight - aLightHeight <= 1)
+        return aNode; // has changed, retry
+    ConcurrentNode* sInner = getChild(aChild, sLight);
+    int32_t sOuterHeight = heightOf(getChild(aChild, aHeavy));
+    int32_t sInnerHeight = heightOf(sInner);
+    if (sOuterHeight >= sInnerHeight)
+        return rotate_nl(aParent, aNode, aHeavy, aLightHeight, aChild, sOuterHeight, sInner, sInnerHeight);
+    {
+        NodeLock sInnerLock(sInner);
+        sInnerHeight = heightOf(sInner);
+        if (sOuterHeight >= sInnerHeight)
+            return rotate_nl(aParent, aNode, aHeavy, aLightHeight, aChild, sOuterHeight, sInner, sInnerHeight);
+        int32_t sInnerOuterHeight = heightOf(getChild(sInner, aHeavy));
+        int32_t sBalance = sOuterHeight - sInnerOuterHeight;
+        if (sBalance >= -1 && sBalance <= 1)
+            return rotateOver_nl(aParent, aNode, aHeavy, aLightHeight, aChild, sOuterHeight, sInner, sInnerOuterHeight);
+    }
+    // Double rotation would leave aChild unbalanced, rotate aChild first.
+    return rebalanceTo_nl(aNode, aChild, sLight, sInner, sOuterHeight);
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+ConcurrentNode* ConcurrentTree<Item, NodeMember, Comparator>::rotate_nl(ConcurrentNode* aParent, ConcurrentNode* aNode, bool aHeavy,
+                                                                        int32_t aLightHeight, ConcurrentNode* aChild,
+                                                                        int32_t aOuterHeight, ConcurrentNode* aInner, int32_t aInnerHeight)
+{
+    bool sLight = !aHeavy;
+    uint64_t sVersion = getVersion(aNode);
+    bool sNodeIsRight = getChild(aParent, 1) == aNode;
+
+    setVersion(aNode, beginShrink(sVersion));
+    setChild(aNode, aHeavy, aInner);
+    if (nullptr != aInner)
+        setParent(aInner, aNode);
+    setChild(aChild, sLight, aNode);
+    setParent(aNode, aChild);
+    setChild(aParent, sNodeIsRight, aChild);
+    setParent(aChild, aParent);
+
+    int32_t sNodeHeight = 1 + std::max(aInnerHeight, aLightHeight);
+    setHeight(aNode, sNodeHeight);
+    setHeight(aChild, 1 + std::max(aOuterHeight, sNodeHeight));
+    setVersion(aNode, endShrink(sVersion));
+
+    // Return a node that still needs rebalancing, if any.
+    int32_t sNodeBalance = aInnerHeight - aLightHeight;
+    if (sNodeBalance < -1 || sNodeBalance > 1)
+        return aNode;
+    if ((nullptr == aInner || 0 == aLightHeight) && !isPresent(aNode))
+        return aNode;
+    int32_t sChildBalance = aOuterHeight - sNodeHeight;
+    if (sChildBalance < -1 || sChildBalance > 1)
+        return aChild;
+    if (0 == aOuterHeight && !isPresent(aChild))
+        return aChild;
+    return fixHeight_nl(aParent);
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+ConcurrentNode* ConcurrentTree<Item, NodeMember, Comparator>::rotateOver_nl(ConcurrentNode* aParent, ConcurrentNode* aNode, bool aHeavy,
+                                                                            int32_t aLightHeight, ConcurrentNode* aChild,
+                                                                            int32_t aOuterHeight, ConcurrentNode* aInner,
+                                                                            int32_t aInnerOuterHeight)
+{
+    bool sLight = !aHeavy;
+    uint64_t sVersion = getVersion(aNode);
+    uint64_t sChildVersion = getVersion(aChild);
+    bool sNodeIsRight = getChild(aParent, 1) == aNode;
+    ConcurrentNode* sInnerOuter = getChild(aInner, aHeavy);
+    ConcurrentNode* sInnerInner = getChild(aInner, sLight);
+    int32_t sInnerInnerHeight = heightOf(sInnerInner);
+
+    setVersion(aNode, beginShrink(sVersion));
+    setVersion(aChild, beginShrink(sChildVersion));
+    setChild(aNode, aHeavy, sInnerInner);
+    if (nullptr != sInnerInner)
+        setParent(sInnerInner, aNode);
+    setChild(aChild, sLight, sInnerOuter);
+    if (nullptr != sInnerOuter)
+        setParent(sInnerOuter, aChild);
+    setChild(aInner, aHeavy, aChild);
+    setParent(aChild, aInner);
+    setChild(aInner, sLight, aNode);
+    setParent(aNode, aInner);
+    setChild(aParent, sNodeIsRight, aInner);
+    setParent(aInner, aParent);
+
+    int32_t sNodeHeight = 1 + std::max(sInnerInnerHeight, aLightHeight);
+    setHeight(aNode, sNodeHeight);
+    int32_t sChildHeight = 1 + std::max(aOuterHeight, aInnerOuterHeight);
+    setHeight(aChild, sChildHeight);
+    setHeight(aInner, 1 + std::max(sChildHeight, sNodeHeight));
+    setVersion(aNode, endShrink(sVersion));
+    setVersion(aChild, endShrink(sChildVersion));
+
+    int32_t sNodeBalance = sInnerInnerHeight - aLightHeight;
+    if (sNodeBalance < -1 || sNodeBalance > 1)
+        return aNode;
+    if ((nullptr == sInnerInner || 0 == aLightHeight) && !isPresent(aNode))
+        return aNode;
+    if ((nullptr == sInnerOuter || 0 == aOuterHeight) && !isPresent(aChild))
+        return aChild;
+    int32_t sInnerBalance = sChildHeight - sNodeHeight;
+    if (sInnerBalance < -1 || sInnerBalance > 1)
+        return aInner;
+    return fixHeight_nl(aParent);
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+bool ConcurrentTree<Item, NodeMember, Comparator>::attemptUnlink_nl(ConcurrentNode* aParent, ConcurrentNode* aNode)
+{
+    // aNode is not present and has at most one child, splice it out.
+    bool sNodeIsRight = getChild(aParent, 1) == aNode;
+    if (!sNodeIsRight && getChild(aParent, 0) != aNode)
+        return false;
+    ConcurrentNode* sLeft = getChild(aNode, 0);
+    ConcurrentNode* sRight = getChild(aNode, 1);
+    if (nullptr != sLeft && nullptr != sRight)
+        return false;
+    ConcurrentNode* sSplice = nullptr != sLeft ? sLeft : sRight;
+    setChild(aParent, sNodeIsRight, sSplice);
+    if (nullptr != sSplice)
+        setParent(sSplice, aParent);
+    setVersion(aNode, UNLINKED);
+    retire(aNode);
+    return true;
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+int ConcurrentTree<Item, NodeMember, Comparator>::selfCheck() const
+{
+    int32_t sHeight;
+    size_t sSize;
+    const ConcurrentNode* sPrev = nullptr;
+    int sRes = checkSubTree(getChild(&m_Holder, 1), &m_Holder, sPrev, sHeight, sSize);
+    if (nullptr != getChild(&m_Holder, 0))
+        sRes |= 1;
+    if (sSize != size())
+        sRes |= 64;
+    return sRes;
+}
+
+template <class Item, ConcurrentNode Item::*NodeMember, class Comparator>
+int ConcurrentTree<Item, NodeMember, Comparator>::checkSubTree(const ConcurrentNode* aNode, const ConcurrentNode* aParent,
+                                                               const ConcurrentNode*& aPrev, int32_t& aHeight, size_t& aSize) const
+{
+    aHeight = 0;
+    aSize = 0;
+    if (nullptr == aNode)
+        return 0;
+    int sRes = 0;
+    if (getParent(aNode) != aParent)
+        sRes |= 1;
+    if (0 != (getVersion(aNode) & (UNLINKED | SHRINKING)))
+        sRes |= 2;
+    if (aNode->m_Locked.load(std::memory_order_relaxed))
+        sRes |= 4;
+    int32_t sHeights[2];
+    size_t sSizes[2];
+    sRes |= checkSubTree(getChild(aNode, 0), aNode, aPrev, sHeights[0], sSizes[0]);
+    if (nullptr != aPrev && Order::compare(*objByNode(aPrev), *objByNode(aNode)) >= 0)
+        sRes |= 8;
+    aPrev = aNode;
+    sRes |= checkSubTree(getChild(aNode, 1), aNode, aPrev, sHeights[1], sSizes[1]);
+    aHeight = 1 + std::max(sHeights[0], sHeights[1]);
+    aSize = sSizes[0] + sSizes[1] + (isPresent(aNode) ? 1 : 0);
+    if (heightOf(aNode) != aHeight)
+        sRes |= 16;
+    if (sHeights[0] - sHeights[1] < -1 || sHeights[0] - sHeights[1] > 1)
+        sRes |= 32;
+    if (!isPresent(aNode) && (nullptr == getChild(aNode, 0) || nullptr == getChild(aNode, 1)))
+        sRes |= 128;
+    return sRes;
+}
+
+} // namespace Avl
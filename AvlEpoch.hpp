@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <cassert>
+
+namespace Avl
+{
+
+// Epoch based reclamation for trees that are read without locks.
+// Every reading thread attaches to a slot and marks its critical sections with enter()/leave().
+// An object unlinked by a writer is retired with the current epoch and may be disposed when
+// every thread inside a critical section has entered it in a later epoch (see Retired).
+class EpochDomain
+{
+public:
+    static const size_t MAX_THREADS = 64;
+
+    inline EpochDomain();
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    // Reserve a slot for the calling thread; return it with detach().
+    inline size_t attach();
+    void detach(size_t aSlot) { m_Slots[aSlot].m_Used.store(false, std::memory_order_release); }
+
+    inline void enter(size_t aSlot);
+    void leave(size_t aSlot) { m_Slots[aSlot].m_Epoch.store(0, std::memory_order_release); }
+
+    uint64_t current() const { return m_Epoch.load(std::memory_order_acquire); }
+    // Start a new epoch; return the oldest epoch that threads may still be in.
+    // Objects retired before it can be disposed.
+    inline uint64_t advance();
+
+private:
+    // One cache line per slot, no false sharing between readers.
+    struct Slot
+    {
+        std::atomic<uint64_t> m_Epoch; // 0 if not in critical section
+        std::atomic<bool> m_Used;
+        char m_Pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+    };
+    std::atomic<uint64_t> m_Epoch;
+    Slot m_Slots[MAX_THREADS];
+};
+
+// Objects retired by one writer, in the order of retirement.
+template <class T>
+class Retired
+{
+public:
+    void retire(T* aObject, uint64_t aEpoch) { m_List.emplace_back(aObject, aEpoch); }
+    // Pass the objects retired before aSafeEpoch to aDisposer(T&); return their number.
+    template <class Disposer>
+    inline size_t reclaim(uint64_t aSafeEpoch, Disposer& aDisposer);
+    size_t size() const { return m_List.size() - m_Head; }
+
+private:
+    std::vector<std::pair<T*, uint64_t>> m_List;
+    size_t m_Head = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////// Implementaion /////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+EpochDomain::EpochDomain() : m_Epoch(1)
+{
+    for (Slot& sSlot : m_Slots)
+    {
+        sSlot.m_Epoch.store(0, std::memory_order_relaxed);
+        sSlot.m_Used.store(false, std::memory_order_relaxed);
+    }
+}
+
+size_t EpochDomain::attach()
+{
+    for (size_t i = 0; i < MAX_THREADS; i++)
+    {
+        bool sUsed = false;
+        if (!m_Slots[i].m_Used.load(std::memory_order_relaxed) &&
+            m_Slots[i].m_Used.compare_exchange_strong(sUsed, true, std::memory_order_acquire))
+            return i;
+    }
+    assert(false && "too many threads attached to the epoch domain");
+    return MAX_THREADS;
+}
+
+void EpochDomain::enter(size_t aSlot)
+{
+    // The fence pairs with the one in advance(): either the writer sees this slot,
+    // or this thread sees everything unlinked before the epoch was advanced.
+    m_Slots[aSlot].m_Epoch.store(m_Epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+uint64_t EpochDomain::advance()
+{
+    uint64_t sOldest = m_Epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (const Slot& sSlot : m_Slots)
+    {
+        uint64_t sEpoch = sSlot.m_Epoch.load(std::memory_order_acquire);
+        if (0 != sEpoch && sEpoch < sOldest)
+            sOldest = sEpoch;
+    }
+    return sOldest;
+}
+
+template <class T>
+template <class Disposer>
+size_t Retired<T>::reclaim(uint64_t aSafeEpoch, Disposer& aDisposer)
+{
+    size_t sCount = 0;
+    for (; m_Head < m_List.size() && m_List[m_Head].second < aSafeEpoch; m_Head++, sCount++)
+        aDisposer(*m_List[m_Head].first);
+    if (m_Head == m_List.size() || m_Head * 2 > m_List.size())
+    {
+        m_List.erase(m_List.begin(), m_List.begin() + m_Head);
+        m_Head = 0;
+    }
+    return sCount;
+}
+
+} // namespace Avl
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <AvlTree.hpp>
+
+#include <limits>
+#include <memory>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace Avl
+{
+
+// The number of keys in aBlock of one cache line that are less than aKey.
+inline size_t countLess(const int32_t* aBlock, int32_t aKey);
+inline size_t countLess(const int64_t* aBlock, int64_t aKey);
+#if defined(__SSE2__)
+static constexpr bool SIMD_COUNT_LESS_32 = true;
+#else
+static constexpr bool SIMD_COUNT_LESS_32 = false;
+#endif
+#if defined(__AVX2__) || defined(__SSE4_2__)
+static constexpr bool SIMD_COUNT_LESS_64 = true;
+#else
+static constexpr bool SIMD_COUNT_LESS_64 = false;
+#endif
+
+template <class Item, class KeyOf>
+using FrozenKey = typename std::decay<decltype(std::declval<KeyOf&>()(std::declval<const Item&>()))>::type;
+
+// Blocks are used by default for integral keys if countLess() is vectorized for them,
+// the scalar loop is slower than the plain layout.
+template <class Key>
+struct UseFrozenBlocks : std::integral_constant<bool, std::is_integral<Key>::value &&
+                                                      (sizeof(Key) <= sizeof(int32_t) ? SIMD_COUNT_LESS_32 : SIMD_COUNT_LESS_64)> {};
+
+// Read-only snapshot of a tree for lookups of a built once index.
+// Keys are extracted by KeyOf (aKeyOf(const Item&) returns a key with operator<) and stored
+// with pointers to the items in Eytzinger order: the root at index 1, children of node k
+// at 2k and 2k + 1. A search goes down a contiguous array without branches, the top levels
+// stay in cache and the nodes a few levels below are prefetched.
+// The items must stay alive and keep their keys while the snapshot is used.
+// Integral keys have a specialization with blocks of keys searched by SIMD compares, see below.
+template <class Item, class KeyOf, bool Blocks = UseFrozenBlocks<FrozenKey<Item, KeyOf>>::value>
+class FrozenTree
+{
+public:
+    using Key = FrozenKey<Item, KeyOf>;
+
+    // Ordered iteration; the position is an index in Eytzinger order, 0 for end().
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Item;
+        using difference_type = ptrdiff_t;
+        using pointer = const Item*;
+        using reference = const Item&;
+
+        const_iterator() : m_Tree(nullptr), m_Index(0) {}
+        const Item& operator*() const { return *m_Tree->m_Items[m_Index]; }
+        const Item* operator->() const { return m_Tree->m_Items[m_Index]; }
+        bool operator==(const const_iterator& aItr) const { return m_Index == aItr.m_Index; }
+        bool operator!=(const const_iterator& aItr) const { return m_Index != aItr.m_Index; }
+        const_iterator& operator++() { m_Index = m_Tree->next(m_Index); return *this; }
+        const_iterator operator++(int) { const_iterator aTmp = *this; ++(*this); return aTmp; }
+    private:
+        friend class FrozenTree;
+        const_iterator(const FrozenTree* aTree, size_t aIndex) : m_Tree(aTree), m_Index(aIndex) {}
+        const FrozenTree* m_Tree;
+        size_t m_Index;
+    };
+    using iterator = const_iterator;
+
+    FrozenTree() = default;
+    // aCount items with strictly increasing keys starting from aFirst.
+    template <class ItemItr>
+    inline FrozenTree(ItemItr aFirst, size_t aCount, KeyOf aKeyOf = KeyOf());
+
+    const_iterator begin() const { return const_iterator(this, first()); }
+    const_iterator end() const { return const_iterator(this, 0); }
+    size_t size() const { return m_Size; }
+
+    const_iterator find(const Key& aKey) const
+    {
+        size_t sIndex = lookupBound(aKey);
+        return const_iterator(this, 0 != sIndex && !(aKey < m_Keys[sIndex]) ? sIndex : 0);
+    }
+    // First item not less than aKey.
+    const_iterator lower_bound(const Key& aKey) const { return const_iterator(this, lookupBound(aKey)); }
+
+    // Debug
+    inline int selfCheck() const;
+
+private:
+    // Prefetch the node PREFETCH_LEVELS below, its 2^PREFETCH_LEVELS descendants are adjacent.
+    static constexpr size_t PREFETCH_LEVELS = 4;
+
+    size_t m_Size = 0;
+    std::vector<Key> m_Keys; // [0] is unused
+    std::vector<const Item*> m_Items;
+
+    static const Item* itemPtrOf(const Item& aItem) { return &aItem; }
+    static const Item* itemPtrOf(const Item* aItem) { return aItem; }
+    inline size_t first() const;
+    inline size_t next(size_t aIndex) const;
+    inline size_t lookupBound(const Key& aKey) const;
+};
+
+// Integral keys, blocks layout: the snapshot is a static B-tree of blocks of one cache line (B = 16 keys of
+// 32 bits or 8 keys of 64 bits). All the keys of a block are compared with the searched one at
+// once with AVX2 or SSE, that picks the child among B + 1 in one step. Without them a scalar
+// loop is used. Keys are stored as signed numbers of the lane width, unsigned ones with the
+// highest bit flipped, so that the signed compare keeps the order.
+template <class Item, class KeyOf>
+class FrozenTree<Item, KeyOf, true>
+{
+public:
+    using Key = FrozenKey<Item, KeyOf>;
+    static_assert(std::is_integral<Key>::value, "blocks are only for integral keys");
+
+    // Ordered iteration; the position is an index of a key slot, the number of slots for end().
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Item;
+        using difference_type = ptrdiff_t;
+        using pointer = const Item*;
+        using reference = const Item&;
+
+        const_iterator() : m_Tree(nullptr), m_Index(0) {}
+        const Item& operator*() const { return *m_Tree->m_Items[m_Index]; }
+        const Item* operator->() const { return m_Tree->m_Items[m_Index]; }
+        bool operator==(const const_iterator& aItr) const { return m_Index == aItr.m_Index; }
+        bool operator!=(const const_iterator& aItr) const { return m_Index != aItr.m_Index; }
+        const_iterator& operator++() { m_Index = m_Tree->next(m_Index); return *this; }
+        const_iterator operator++(int) { const_iterator aTmp = *this; ++(*this); return aTmp; }
+    private:
+        friend class FrozenTree;
+        const_iterator(const FrozenTree* aTree, size_t aIndex) : m_Tree(aTree), m_Index(aIndex) {}
+        const FrozenTree* m_Tree;
+        size_t m_Index;
+    };
+    using iterator = const_iterator;
+
+    FrozenTree() = default;
+    // aCount items with strictly increasing keys starting from aFirst.
+    template <class ItemItr>
+    inline FrozenTree(ItemItr aFirst, size_t aCount, KeyOf aKeyOf = KeyOf());
+    // Blocks are aligned inside the storage, a copy would not be.
+    FrozenTree(const FrozenTree&) = delete;
+    FrozenTree& operator=(const FrozenTree&) = delete;
+    FrozenTree(FrozenTree&&) = default;
+    FrozenTree& operator=(FrozenTree&&) = default;
+
+    const_iterator begin() const { return const_iterator(this, first()); }
+    const_iterator end() const { return const_iterator(this, m_Items.size()); }
+    size_t size() const { return m_Size; }
+
+    const_iterator find(const Key& aKey) const
+    {
+        size_t sIndex = lookupBound(toLane(aKey));
+        return const_iterator(this, sIndex != m_Items.size() && keys()[sIndex] == toLane(aKey) ? sIndex : m_Items.size());
+    }
+    // First item not less than aKey.
+    const_iterator lower_bound(const Key& aKey) const { return const_iterator(this, lookupBound(toLane(aKey))); }
+
+    // Debug
+    inline int selfCheck() const;
+
+private:
+    using Lane = typename std::conditional<sizeof(Key) <= sizeof(int32_t), int32_t, int64_t>::type;
+    using UnsignedLane = typename std::make_unsigned<Lane>::type;
+    static constexpr size_t CACHE_LINE = 64;
+    static constexpr size_t B = CACHE_LINE / sizeof(Lane);
+
+    size_t m_Size = 0;
+    size_t m_Blocks = 0;
+    std::vector<Lane> m_Storage; // keys, block aligned from m_Offset; the rest of slots is padded with max
+    size_t m_Offset = 0;
+    std::vector<const Item*> m_Items; // nullptr for padding
+
+    static Lane toLane(Key aKey)
+    {
+        return std::is_signed<Key>::value ? static_cast<Lane>(aKey) :
+            static_cast<Lane>(static_cast<UnsignedLane>(aKey) ^ (static_cast<UnsignedLane>(1) << (sizeof(Lane) * 8 - 1)));
+    }
+    static size_t child(size_t aBlock, size_t aIndex) { return aBlock * (B + 1) + aIndex + 1; }
+    const Lane* keys() const { return m_Storage.data() + m_Offset; }
+    static const Item* itemPtrOf(const Item& aItem) { return &aItem; }
+    static const Item* itemPtrOf(const Item* aItem) { return aItem; }
+    template <class ItemItr>
+    inline void build(size_t aBlock, ItemItr& aItr, size_t& aLeft, KeyOf& aKeyOf);
+    size_t slotOrEnd(size_t aIndex) const { return nullptr != m_Items[aIndex] ? aIndex : m_Items.size(); }
+    inline size_t first() const;
+    inline size_t next(size_t aIndex) const;
+    inline size_t lookupBound(Lane aKey) const;
+};
+
+// Snapshot of the current content of aTree.
+template <class KeyOf, class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+FrozenTree<Item, KeyOf> freeze(const BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>& aTree, KeyOf aKeyOf = KeyOf())
+{
+    return FrozenTree<Item, KeyOf>(aTree.begin(), aTree.size(), aKeyOf);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////// Implementaion /////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <class Item, class KeyOf, bool Blocks>
+template <class ItemItr>
+FrozenTree<Item, KeyOf, Blocks>::FrozenTree(ItemItr aFirst, size_t aCount, KeyOf aKeyOf)
+    : m_Size(aCount), m_Keys(aCount + 1), m_Items(aCount + 1, nullptr)
+{
+    // Visit the positions in order and fill them with the sorted items; selfCheck() checks the order.
+    for (size_t sIndex = first(); 0 != sIndex; sIndex = next(sIndex), ++aFirst)
+    {
+        m_Items[sIndex] = itemPtrOf(*aFirst);
+        m_Keys[sIndex] = aKeyOf(*m_Items[sIndex]);
+    }
+}
+
+template <class Item, class KeyOf, bool Blocks>
+size_t FrozenTree<Item, KeyOf, Blocks>::first() const
+{
+    if (0 == m_Size)
+        return 0;
+    size_t sIndex = 1;
+    while (sIndex * 2 <= m_Size)
+        sIndex *= 2;
+    return sIndex;
+}
+
+template <class Item, class KeyOf, bool Blocks>
+size_t FrozenTree<Item, KeyOf, Blocks>::next(size_t aIndex) const
+{
+    // The leftmost node of the right subtree, or the first ancestor reached from a left child.
+    if (aIndex * 2 + 1 <= m_Size)
+    {
+        aIndex = aIndex * 2 + 1;
+        while (aIndex * 2 <= m_Size)
+            aIndex *= 2;
+        return aIndex;
+    }
+    while (0 != (aIndex & 1))
+        aIndex >>= 1;
+    return aIndex >> 1;
+}
+
+template <class Item, class KeyOf, bool Blocks>
+size_t FrozenTree<Item, KeyOf, Blocks>::lookupBound(const Key& aKey) const
+{
+    // Go down to a leaf turning right when the key of the node is less; the bits of the path
+    // after the last left turn are ones, the node of that turn is the bound.
+    const Key* sKeys = m_Keys.data();
+    size_t sIndex = 1;
+    while (sIndex <= m_Size)
+    {
+        prefetch(sKeys + (sIndex << PREFETCH_LEVELS));
+        sIndex = sIndex * 2 + (sKeys[sIndex] < aKey);
+    }
+    while (0 != (sIndex & 1))
+        sIndex >>= 1;
+    return sIndex >> 1;
+}
+
+template <class Item, class KeyOf, bool Blocks>
+int FrozenTree<Item, KeyOf, Blocks>::selfCheck() const
+{
+    int sRes = 0;
+    size_t sCount = 0;
+    for (size_t sIndex = first(), sPrev = 0; 0 != sIndex; sPrev = sIndex, sIndex = next(sIndex), sCount++)
+    {
+        if (0 != sPrev && !(m_Keys[sPrev] < m_Keys[sIndex]))
+            sRes |= 1 << 0;
+        if (nullptr == m_Items[sIndex])
+            sRes |= 1 << 1;
+    }
+    if (sCount != m_Size)
+        sRes |= 1 << 2;
+    return sRes;
+}
+
+size_t countLess(const int32_t* aBlock, int32_t aKey)
+{
+#if defined(__AVX2__)
+    __m256i sKey = _mm256_set1_epi32(aKey);
+    __m256i sLow = _mm256_cmpgt_epi32(sKey, _mm256_load_si256(reinterpret_cast<const __m256i*>(aBlock)));
+    __m256i sHigh = _mm256_cmpgt_epi32(sKey, _mm256_load_si256(reinterpret_cast<const __m256i*>(aBlock + 8)));
+    unsigned sMask = _mm256_movemask_ps(_mm256_castsi256_ps(sLow)) | _mm256_movemask_ps(_mm256_castsi256_ps(sHigh)) << 8;
+    return __builtin_popcount(sMask);
+#elif defined(__SSE2__)
+    __m128i sKey = _mm_set1_epi32(aKey);
+    unsigned sMask = 0;
+    for (size_t i = 0; i < 4; i++)
+    {
+        __m128i sLess = _mm_cmpgt_epi32(sKey, _mm_load_si128(reinterpret_cast<const __m128i*>(aBlock + i * 4)));
+        sMask |= _mm_movemask_ps(_mm_castsi128_ps(sLess)) << (i * 4);
+    }
+    return __builtin_popcount(sMask);
+#else
+    size_t sRes = 0;
+    for (size_t i = 0; i < 16; i++)
+        sRes += aBlock[i] < aKey;
+    return sRes;
+#endif
+}
+
+size_t countLess(const int64_t* aBlock, int64_t aKey)
+{
+#if defined(__AVX2__)
+    __m256i sKey = _mm256_set1_epi64x(aKey);
+    __m256i sLow = _mm256_cmpgt_epi64(sKey, _mm256_load_si256(reinterpret_cast<const __m256i*>(aBlock)));
+    __m256i sHigh = _mm256_cmpgt_epi64(sKey, _mm256_load_si256(reinterpret_cast<const __m256i*>(aBlock + 4)));
+    unsigned sMask = _mm256_movemask_pd(_mm256_castsi256_pd(sLow)) | _mm256_movemask_pd(_mm256_castsi256_pd(sHigh)) << 4;
+    return __builtin_popcount(sMask);
+#elif defined(__SSE4_2__)
+    __m128i sKey = _mm_set1_epi64x(aKey);
+    unsigned sMask = 0;
+    for (size_t i = 0; i < 4; i++)
+    {
+        __m128i sLess = _mm_cmpgt_epi64(sKey, _mm_load_si128(reinterpret_cast<const __m128i*>(aBlock + i * 2)));
+        sMask |= _mm_movemask_pd(_mm_castsi128_pd(sLess)) << (i * 2);
+    }
+    return __builtin_popcount(sMask);
+#else
+    size_t sRes = 0;
+    for (size_t i = 0; i < 8; i++)
+        sRes += aBlock[i] < aKey;
+    return sRes;
+#endif
+}
+
+template <class Item, class KeyOf>
+template <class ItemItr>
+FrozenTree<Item, KeyOf, true>::FrozenTree(ItemItr aFirst, size_t aCount, KeyOf aKeyOf)
+    : m_Size(aCount), m_Blocks((aCount + B - 1) / B)
+{
+    m_Storage.resize(m_Blocks * B + B, std::numeric_limits<Lane>::max());
+    void* sData = m_Storage.data();
+    size_t sSpace = m_Storage.size() * sizeof(Lane);
+    std::align(CACHE_LINE, m_Blocks * CACHE_LINE, sData, sSpace);
+    m_Offset = static_cast<Lane*>(sData) - m_Storage.data();
+    m_Items.resize(m_Blocks * B, nullptr);
+    size_t sLeft = aCount;
+    build(0, aFirst, sLeft, aKeyOf);
+}
+
+template <class Item, class KeyOf>
+template <class ItemItr>
+void FrozenTree<Item, KeyOf, true>::build(size_t aBlock, ItemItr& aItr, size_t& aLeft, KeyOf& aKeyOf)
+{
+    // In order: child 0, key 0, child 1, ..., key B - 1, child B. Slots after the last item are padding.
+    if (aBlock >= m_Blocks)
+        return;
+    Lane* sKeys = m_Storage.data() + m_Offset + aBlock * B;
+    for (size_t i = 0; i < B; i++)
+    {
+        build(child(aBlock, i), aItr, aLeft, aKeyOf);
+        if (0 == aLeft)
+            continue;
+        const Item* sItem = itemPtrOf(*aItr);
+        sKeys[i] = toLane(aKeyOf(*sItem));
+        m_Items[aBlock * B + i] = sItem;
+        ++aItr;
+        aLeft--;
+    }
+    build(child(aBlock, B), aItr, aLeft, aKeyOf);
+}
+
+template <class Item, class KeyOf>
+size_t FrozenTree<Item, KeyOf, true>::first() const
+{
+    if (0 == m_Size)
+        return m_Items.size();
+    size_t sBlock = 0;
+    while (child(sBlock, 0) < m_Blocks)
+        sBlock = child(sBlock, 0);
+    return sBlock * B;
+}
+
+template <class Item, class KeyOf>
+size_t FrozenTree<Item, KeyOf, true>::next(size_t aIndex) const
+{
+    // The leftmost slot of the subtree right of the key, the next key in the block,
+    // or the key of the first ancestor reached not from its last child.
+    size_t sBlock = aIndex / B;
+    size_t sSlot = aIndex % B;
+    size_t sChild = child(sBlock, sSlot + 1);
+    if (sChild < m_Blocks)
+    {
+        while (child(sChild, 0) < m_Blocks)
+            sChild = child(sChild, 0);
+        return slotOrEnd(sChild * B);
+    }
+    if (sSlot + 1 < B)
+        return slotOrEnd(aIndex + 1);
+    while (0 != sBlock)
+    {
+        size_t sFrom = (sBlock - 1) % (B + 1);
+        sBlock = (sBlock - 1) / (B + 1);
+        if (sFrom < B)
+            return slotOrEnd(sBlock * B + sFrom);
+    }
+    return m_Items.size();
+}
+
+template <class Item, class KeyOf>
+size_t FrozenTree<Item, KeyOf, true>::lookupBound(Lane aKey) const
+{
+    // The first key not less than aKey in the last block that has one.
+    const Lane* sKeys = keys();
+    size_t sRes = m_Items.size();
+    for (size_t sBlock = 0; sBlock < m_Blocks;)
+    {
+        size_t sIndex = countLess(sKeys + sBlock * B, aKey);
+        if (sIndex < B)
+            sRes = sBlock * B + sIndex;
+        sBlock = child(sBlock, sIndex);
+    }
+    return sRes == m_Items.size() ? sRes : slotOrEnd(sRes);
+}
+
+template <class Item, class KeyOf>
+int FrozenTree<Item, KeyOf, true>::selfCheck() const
+{
+    int sRes = 0;
+    size_t sCount = 0;
+    for (size_t sIndex = first(), sPrev = m_Items.size(); sIndex != m_Items.size(); sPrev = sIndex, sIndex = next(sIndex), sCount++)
+    {
+        if (sPrev != m_Items.size() && !(keys()[sPrev] < keys()[sIndex]))
+            sRes |= 1 << 0;
+        if (nullptr == m_Items[sIndex])
+            sRes |= 1 << 1;
+    }
+    if (sCount != m_Size)
+        sRes |= 1 << 2;
+    if (0 != reinterpret_cast<uintptr_t>(keys()) % CACHE_LINE)
+        sRes |= 1 << 3;
+    return sRes;
+}
+
+} // namespace Avl
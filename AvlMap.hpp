@@ -0,0 +1,387 @@
+#pragma once
+
+#include <AvlTree.hpp>
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace Avl
+{
+
+// Storage of objects of type T: blocks are cut from slabs of about SLAB_BYTES, freed blocks
+// are reused first. release() frees all the slabs at once. Not thread safe.
+template <class T>
+class Pool
+{
+public:
+    Pool() = default;
+    Pool(Pool&& aOther) : m_Slabs(aOther.m_Slabs), m_Free(aOther.m_Free), m_Used(aOther.m_Used), m_SlabCount(aOther.m_SlabCount)
+    {
+        aOther.m_Slabs = nullptr;
+        aOther.release();
+    }
+    Pool(const Pool&) = delete;
+    inline Pool& operator=(Pool&& aOther);
+    Pool& operator=(const Pool&) = delete;
+    ~Pool() { release(); }
+
+    // Uninitialized memory for a T.
+    inline void* allocate();
+    inline void deallocate(void* aPtr);
+    // Free all the blocks; the objects in them must be destroyed before.
+    inline void release();
+    size_t capacity() const { return m_SlabCount * SLAB_BLOCKS; }
+
+private:
+    union Block
+    {
+        Block* m_Next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type m_Data;
+    };
+    static constexpr size_t SLAB_BYTES = 64 * 1024;
+    static constexpr size_t SLAB_BLOCKS = SLAB_BYTES > sizeof(Block) ? SLAB_BYTES / sizeof(Block) : 1;
+    struct Slab
+    {
+        Slab* m_Next;
+        Block m_Blocks[SLAB_BLOCKS];
+    };
+    static_assert(alignof(Slab) <= alignof(std::max_align_t), "over-aligned objects are not supported");
+
+    Slab* m_Slabs = nullptr; // the newest first
+    Block* m_Free = nullptr;
+    size_t m_Used = SLAB_BLOCKS; // blocks taken from the newest slab
+    size_t m_SlabCount = 0;
+};
+
+// Key of the stored value: the value itself or the first member of a pair.
+struct SelfKey
+{
+    template <class Key>
+    static const Key& of(const Key& aValue) { return aValue; }
+};
+
+struct FirstKey
+{
+    template <class Key, class T>
+    static const Key& of(const std::pair<const Key, T>& aValue) { return aValue.first; }
+};
+
+// Owning ordered container over Tree: values are constructed in place in the nodes of
+// the tree, the nodes are allocated from a Pool of the container.
+// Value - the stored value, KeyOfValue::of(const Value&) - its key, Order - a stateless less of
+// the keys. Small arithmetic keys are compared three-way, the others by Order only.
+template <class Key, class Value, class KeyOfValue, class Order>
+class OwningTree
+{
+    // Defined first, the tree of entries is needed for the iterators.
+    struct Entry
+    {
+        template <class... Args>
+        explicit Entry(Args&&... aArgs) : m_Value(std::forward<Args>(aArgs)...) {}
+
+        Value m_Value;
+        Node m_Node;
+    };
+    static const Key& keyOf(const Entry& aEntry) { return KeyOfValue::of(aEntry.m_Value); }
+    static const Key& keyOf(const Key& aKey) { return aKey; }
+    struct KeyThreeWay
+    {
+        template <class A, class B>
+        static int Compare(const A& a, const B& b) { return Order()(keyOf(a), keyOf(b)) ? -1 : Order()(keyOf(b), keyOf(a)) ? 1 : 0; }
+    };
+    struct KeyLess
+    {
+        template <class A, class B>
+        static bool Less(const A& a, const B& b) { return Order()(keyOf(a), keyOf(b)); }
+    };
+    using Comparator = typename std::conditional<std::is_arithmetic<Key>::value, KeyThreeWay, KeyLess>::type;
+    using EntryTree = Tree<Entry, &Entry::m_Node, Comparator>;
+
+public:
+    using key_type = Key;
+    using value_type = typename std::remove_const<Value>::type;
+    using size_type = size_t;
+
+    template <class TValue, class TItr>
+    class iterator_common
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = typename std::remove_const<TValue>::type;
+        using difference_type = ptrdiff_t;
+        using pointer = TValue*;
+        using reference = TValue&;
+
+        explicit iterator_common(TItr aItr) : m_Itr(aItr) {}
+        template <class TValue2, class TItr2, typename std::enable_if<std::is_convertible<TItr2, TItr>::value>::type* = nullptr>
+        iterator_common(const iterator_common<TValue2, TItr2>& aItr) : m_Itr(aItr.m_Itr) {}
+        TValue& operator*() const { return m_Itr->m_Value; }
+        TValue* operator->() const { return &m_Itr->m_Value; }
+        bool operator==(const iterator_common& aItr) const { return m_Itr == aItr.m_Itr; }
+        bool operator!=(const iterator_common& aItr) const { return m_Itr != aItr.m_Itr; }
+        iterator_common& operator++() { ++m_Itr; return *this; }
+        iterator_common operator++(int) { iterator_common aTmp = *this; ++(*this); return aTmp; }
+        iterator_common& operator--() { --m_Itr; return *this; }
+        iterator_common operator--(int) { iterator_common aTmp = *this; --(*this); return aTmp; }
+    private:
+        template <class TValue2, class TItr2> friend class iterator_common;
+        friend class OwningTree;
+        TItr m_Itr;
+    };
+    using iterator = iterator_common<Value, typename EntryTree::iterator>;
+    using const_iterator = iterator_common<const Value, typename EntryTree::const_iterator>;
+
+    OwningTree() = default;
+    OwningTree(OwningTree&& aOther) : m_Tree(aOther.m_Tree), m_Pool(std::move(aOther.m_Pool)) { aOther.m_Tree.clear(); }
+    OwningTree(const OwningTree&) = delete;
+    inline OwningTree& operator=(OwningTree&& aOther);
+    OwningTree& operator=(const OwningTree&) = delete;
+    ~OwningTree() { clear(); }
+
+    // Access
+    const_iterator begin() const { return const_iterator(m_Tree.begin()); }
+    const_iterator end() const { return const_iterator(m_Tree.end()); }
+    iterator begin() { return iterator(m_Tree.begin()); }
+    iterator end() { return iterator(m_Tree.end()); }
+    size_t size() const { return m_Tree.size(); }
+    bool empty() const { return 0 == m_Tree.size(); }
+    // Number of values that fit the memory taken so far.
+    size_t capacity() const { return m_Pool.capacity(); }
+    const_iterator find(const Key& aKey) const { return const_iterator(m_Tree.find(aKey)); }
+    iterator find(const Key& aKey) { return iterator(m_Tree.find(aKey)); }
+    size_t count(const Key& aKey) const { return m_Tree.count(aKey); }
+    const_iterator lower_bound(const Key& aKey) const { return const_iterator(m_Tree.lower_bound(aKey)); }
+    iterator lower_bound(const Key& aKey) { return iterator(m_Tree.lower_bound(aKey)); }
+    const_iterator upper_bound(const Key& aKey) const { return const_iterator(m_Tree.upper_bound(aKey)); }
+    iterator upper_bound(const Key& aKey) { return iterator(m_Tree.upper_bound(aKey)); }
+
+    // Modification. emplace() constructs the value from aArgs, it's destroyed at once if
+    // the key is already present. emplace_hint() searches from aHint, see Tree::insert().
+    template <class... Args>
+    inline std::pair<iterator, bool> emplace(Args&&... aArgs);
+    template <class... Args>
+    inline iterator emplace_hint(const_iterator aHint, Args&&... aArgs);
+    std::pair<iterator, bool> insert(const value_type& aValue) { return emplace(aValue); }
+    std::pair<iterator, bool> insert(value_type&& aValue) { return emplace(std::move(aValue)); }
+    // Return the iterator following the erased value.
+    inline iterator erase(const_iterator aItr);
+    inline size_t erase(const Key& aKey);
+    // Return aLast; see Tree::erase() of a range.
+    inline iterator erase(const_iterator aFirst, const_iterator aLast);
+    // Destroy the values and free all the memory; without destroying each value if that's
+    // a no-op, so O(1) per slab for trivially destructible values.
+    inline void clear();
+
+    // Debug
+    int selfCheck() const { return m_Tree.selfCheck(); }
+
+private:
+    EntryTree m_Tree;
+    Pool<Entry> m_Pool;
+
+    template <class... Args>
+    inline Entry* create(Args&&... aArgs);
+    inline void dispose(Entry* aEntry);
+};
+
+// Owning map of unique keys to values, values may be move-only.
+template <class Key, class T, class Order = std::less<Key>>
+class Map : public OwningTree<Key, std::pair<const Key, T>, FirstKey, Order>
+{
+public:
+    using Base = OwningTree<Key, std::pair<const Key, T>, FirstKey, Order>;
+    using mapped_type = T;
+    using typename Base::iterator;
+
+    // Construct the value from aArgs if aKey is missing, otherwise don't touch the arguments.
+    template <class KeyArg, class... Args>
+    inline std::pair<iterator, bool> try_emplace(KeyArg&& aKey, Args&&... aArgs);
+    T& operator[](const Key& aKey) { return try_emplace(aKey).first->second; }
+    T& operator[](Key&& aKey) { return try_emplace(std::move(aKey)).first->second; }
+};
+
+// Owning set of unique keys.
+template <class Key, class Order = std::less<Key>>
+using Set = OwningTree<Key, const Key, SelfKey, Order>;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////// Implementaion /////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+void* Pool<T>::allocate()
+{
+    if (nullptr != m_Free)
+    {
+        Block* sBlock = m_Free;
+        m_Free = sBlock->m_Next;
+        return sBlock;
+    }
+    if (SLAB_BLOCKS == m_Used)
+    {
+        Slab* sSlab = static_cast<Slab*>(::operator new(sizeof(Slab)));
+        sSlab->m_Next = m_Slabs;
+        m_Slabs = sSlab;
+        m_Used = 0;
+        m_SlabCount++;
+    }
+    return &m_Slabs->m_Blocks[m_Used++];
+}
+
+template <class T>
+void Pool<T>::deallocate(void* aPtr)
+{
+    Block* sBlock = static_cast<Block*>(aPtr);
+    sBlock->m_Next = m_Free;
+    m_Free = sBlock;
+}
+
+template <class T>
+Pool<T>& Pool<T>::operator=(Pool&& aOther)
+{
+    if (this != &aOther)
+    {
+        release();
+        std::swap(m_Slabs, aOther.m_Slabs);
+        m_Free = aOther.m_Free;
+        m_Used = aOther.m_Used;
+        m_SlabCount = aOther.m_SlabCount;
+        aOther.release();
+    }
+    return *this;
+}
+
+template <class T>
+void Pool<T>::release()
+{
+    while (nullptr != m_Slabs)
+    {
+        Slab* sSlab = m_Slabs;
+        m_Slabs = sSlab->m_Next;
+        ::operator delete(sSlab);
+    }
+    m_Free = nullptr;
+    m_Used = SLAB_BLOCKS;
+    m_SlabCount = 0;
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+OwningTree<Key, Value, KeyOfValue, Order>& OwningTree<Key, Value, KeyOfValue, Order>::operator=(OwningTree&& aOther)
+{
+    if (this != &aOther)
+    {
+        clear();
+        m_Tree = aOther.m_Tree;
+        m_Pool = std::move(aOther.m_Pool);
+        aOther.m_Tree.clear();
+    }
+    return *this;
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+template <class... Args>
+std::pair<typename OwningTree<Key, Value, KeyOfValue, Order>::iterator, bool>
+OwningTree<Key, Value, KeyOfValue, Order>::emplace(Args&&... aArgs)
+{
+    Entry* sEntry = create(std::forward<Args>(aArgs)...);
+    std::pair<typename EntryTree::iterator, bool> sRes = m_Tree.insert(*sEntry);
+    if (!sRes.second)
+        dispose(sEntry);
+    return std::make_pair(iterator(sRes.first), sRes.second);
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+template <class... Args>
+typename OwningTree<Key, Value, KeyOfValue, Order>::iterator
+OwningTree<Key, Value, KeyOfValue, Order>::emplace_hint(const_iterator aHint, Args&&... aArgs)
+{
+    Entry* sEntry = create(std::forward<Args>(aArgs)...);
+    std::pair<typename EntryTree::iterator, bool> sRes = m_Tree.insert(aHint.m_Itr, *sEntry);
+    if (!sRes.second)
+        dispose(sEntry);
+    return iterator(sRes.first);
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+typename OwningTree<Key, Value, KeyOfValue, Order>::iterator
+OwningTree<Key, Value, KeyOfValue, Order>::erase(const_iterator aItr)
+{
+    Entry& sEntry = const_cast<Entry&>(*aItr.m_Itr);
+    iterator sNext(m_Tree.iterator_to(sEntry));
+    ++sNext;
+    m_Tree.erase(sEntry);
+    dispose(&sEntry);
+    return sNext;
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+size_t OwningTree<Key, Value, KeyOfValue, Order>::erase(const Key& aKey)
+{
+    typename EntryTree::iterator sItr = m_Tree.find(aKey);
+    if (sItr == m_Tree.end())
+        return 0;
+    m_Tree.erase(*sItr);
+    dispose(&*sItr);
+    return 1;
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+typename OwningTree<Key, Value, KeyOfValue, Order>::iterator
+OwningTree<Key, Value, KeyOfValue, Order>::erase(const_iterator aFirst, const_iterator aLast)
+{
+    return iterator(m_Tree.erase(aFirst.m_Itr, aLast.m_Itr, [this](Entry& aEntry) { dispose(&aEntry); }));
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+void OwningTree<Key, Value, KeyOfValue, Order>::clear()
+{
+    if (std::is_trivially_destructible<Value>::value)
+        m_Tree.clear();
+    else
+        m_Tree.clearAndDispose([](Entry& aEntry) { aEntry.~Entry(); });
+    m_Pool.release();
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+template <class... Args>
+typename OwningTree<Key, Value, KeyOfValue, Order>::Entry*
+OwningTree<Key, Value, KeyOfValue, Order>::create(Args&&... aArgs)
+{
+    void* sBlock = m_Pool.allocate();
+    try
+    {
+        return new (sBlock) Entry(std::forward<Args>(aArgs)...);
+    }
+    catch (...)
+    {
+        m_Pool.deallocate(sBlock);
+        throw;
+    }
+}
+
+template <class Key, class Value, class KeyOfValue, class Order>
+void OwningTree<Key, Value, KeyOfValue, Order>::dispose(Entry* aEntry)
+{
+    aEntry->~Entry();
+    m_Pool.deallocate(aEntry);
+}
+
+template <class Key, class T, class Order>
+template <class KeyArg, class... Args>
+std::pair<typename Map<Key, T, Order>::iterator, bool> Map<Key, T, Order>::try_emplace(KeyArg&& aKey, Args&&... aArgs)
+{
+    // The lower bound is the place of a new value, so it's a perfect hint.
+    iterator sItr = this->lower_bound(aKey);
+    if (sItr != this->end() && !Order()(aKey, sItr->first))
+        return std::make_pair(sItr, false);
+    sItr = this->emplace_hint(sItr, std::piecewise_construct, std::forward_as_tuple(std::forward<KeyArg>(aKey)),
+                              std::forward_as_tuple(std::forward<Args>(aArgs)...));
+    return std::make_pair(sItr, true);
+}
+
+} // namespace Avl
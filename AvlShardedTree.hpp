@@ -0,0 +1,223 @@
+#pragma once
+
+#include <AvlTree.hpp>
+
+#include <memory>
+#include <mutex>
+
+namespace Avl
+{
+
+// Trees partitioned by key ranges, each one under its own lock, for many threads modifying
+// different parts of the key space. The ranges are given by bound items: shard i holds
+// the keys not less than bound i - 1 and less than bound i, so the shards concatenated
+// in order make one ordered sequence.
+// find(), insert(), erase() and lower_bound() may be called concurrently. The returned items
+// are not protected: the caller must not dispose an item that other threads can still find.
+template <class Item, Node Item::*NodeMember, class Comparator = Default<Item>>
+class ShardedTree
+{
+public:
+    using ShardTree = Tree<Item, NodeMember, Comparator>;
+
+    // Items (or pointers to items) with strictly increasing keys; N bounds make N + 1 shards.
+    // The bounds are only compared with, they must stay alive and unchanged while the tree is used.
+    template <class ItemItr>
+    inline ShardedTree(ItemItr aFirst, ItemItr aLast);
+    ShardedTree(const ShardedTree&) = delete;
+    ShardedTree& operator=(const ShardedTree&) = delete;
+
+    // Thread safe access, locks one shard at a time.
+    template <class Key>
+    inline Item* find(const Key& aKey);
+    // First item not less than aKey, nullptr if there's no such item.
+    template <class Key>
+    inline Item* lower_bound(const Key& aKey);
+    inline bool insert(Item& aItem); // false if an item with the same key is in the tree
+    inline void erase(Item& aItem);
+    inline size_t size() const;
+    inline void clear();
+
+    size_t shardCount() const { return m_Bounds.size() + 1; }
+    // Index of the shard for aKey, that is the number of bounds not bigger than aKey.
+    template <class Key>
+    inline size_t shardOf(const Key& aKey) const;
+
+    // Ordered iteration over all the shards; only when there are no concurrent modifications.
+    template <class TItem, class TOwner, class TShardItr>
+    class iterator_common
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename std::remove_const<TItem>::type;
+        using difference_type = ptrdiff_t;
+        using pointer = TItem*;
+        using reference = TItem&;
+
+        iterator_common() : m_Owner(nullptr), m_Shard(0) {}
+        TItem& operator*() const { return *m_Itr; }
+        TItem* operator->() const { return &*m_Itr; }
+        // All the shards have the same end().
+        bool operator==(const iterator_common& aItr) const { return m_Itr == aItr.m_Itr; }
+        bool operator!=(const iterator_common& aItr) const { return m_Itr != aItr.m_Itr; }
+        iterator_common& operator++() { ++m_Itr; skipEmpty(); return *this; }
+        iterator_common operator++(int) { iterator_common aTmp = *this; ++(*this); return aTmp; }
+    private:
+        friend class ShardedTree;
+        iterator_common(TOwner* aOwner, size_t aShard, TShardItr aItr) : m_Owner(aOwner), m_Shard(aShard), m_Itr(aItr) { skipEmpty(); }
+        void skipEmpty()
+        {
+            while (m_Itr == m_Owner->m_Shards[m_Shard].m_Tree.end() && m_Shard + 1 < m_Owner->shardCount())
+                m_Itr = m_Owner->m_Shards[++m_Shard].m_Tree.begin();
+        }
+        TOwner* m_Owner;
+        size_t m_Shard;
+        TShardItr m_Itr;
+    };
+    using iterator = iterator_common<Item, ShardedTree, typename ShardTree::iterator>;
+    using const_iterator = iterator_common<const Item, const ShardedTree, typename ShardTree::const_iterator>;
+
+    const_iterator begin() const { return const_iterator(this, 0, m_Shards[0].m_Tree.begin()); }
+    const_iterator end() const { return const_iterator(this, m_Bounds.size(), m_Shards[m_Bounds.size()].m_Tree.end()); }
+    iterator begin() { return iterator(this, 0, m_Shards[0].m_Tree.begin()); }
+    iterator end() { return iterator(this, m_Bounds.size(), m_Shards[m_Bounds.size()].m_Tree.end()); }
+    // Direct access to a shard, also without locking.
+    const ShardTree& shard(size_t aIndex) const { return m_Shards[aIndex].m_Tree; }
+
+    // Debug, only when there are no concurrent modifications.
+    inline int selfCheck() const;
+
+private:
+    // Shards are padded so that locks of neighbours don't share a cache line.
+    struct Shard
+    {
+        std::mutex m_Mutex;
+        ShardTree m_Tree;
+        char m_Pad[64];
+    };
+    std::vector<const Item*> m_Bounds;
+    std::unique_ptr<Shard[]> m_Shards;
+
+    using Order = Comparison<Item, Comparator>;
+
+    static const Item* itemPtrOf(const Item& aItem) { return &aItem; }
+    static const Item* itemPtrOf(const Item* aItem) { return aItem; }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////// Implementaion /////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+template <class ItemItr>
+ShardedTree<Item, NodeMember, Comparator>::ShardedTree(ItemItr aFirst, ItemItr aLast)
+{
+    for (; aFirst != aLast; ++aFirst)
+    {
+        const Item* sBound = itemPtrOf(*aFirst);
+        assert(m_Bounds.empty() || Order::less(*m_Bounds.back(), *sBound));
+        m_Bounds.push_back(sBound);
+    }
+    m_Shards.reset(new Shard[m_Bounds.size() + 1]);
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+template <class Key>
+size_t ShardedTree<Item, NodeMember, Comparator>::shardOf(const Key& aKey) const
+{
+    size_t sLow = 0;
+    size_t sHigh = m_Bounds.size();
+    while (sLow < sHigh)
+    {
+        size_t sMid = (sLow + sHigh) / 2;
+        if (!Order::greater(*m_Bounds[sMid], aKey))
+            sLow = sMid + 1;
+        else
+            sHigh = sMid;
+    }
+    return sLow;
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+template <class Key>
+Item* ShardedTree<Item, NodeMember, Comparator>::find(const Key& aKey)
+{
+    Shard& sShard = m_Shards[shardOf(aKey)];
+    std::lock_guard<std::mutex> sLock(sShard.m_Mutex);
+    typename ShardTree::iterator sItr = sShard.m_Tree.find(aKey);
+    return sItr != sShard.m_Tree.end() ? &*sItr : nullptr;
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+template <class Key>
+Item* ShardedTree<Item, NodeMember, Comparator>::lower_bound(const Key& aKey)
+{
+    // Next shards hold only bigger keys, the first item of any of them will do.
+    for (size_t i = shardOf(aKey); i < shardCount(); i++)
+    {
+        Shard& sShard = m_Shards[i];
+        std::lock_guard<std::mutex> sLock(sShard.m_Mutex);
+        typename ShardTree::iterator sItr = sShard.m_Tree.lower_bound(aKey);
+        if (sItr != sShard.m_Tree.end())
+            return &*sItr;
+    }
+    return nullptr;
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+bool ShardedTree<Item, NodeMember, Comparator>::insert(Item& aItem)
+{
+    Shard& sShard = m_Shards[shardOf(aItem)];
+    std::lock_guard<std::mutex> sLock(sShard.m_Mutex);
+    return sShard.m_Tree.insert(aItem).second;
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+void ShardedTree<Item, NodeMember, Comparator>::erase(Item& aItem)
+{
+    Shard& sShard = m_Shards[shardOf(aItem)];
+    std::lock_guard<std::mutex> sLock(sShard.m_Mutex);
+    sShard.m_Tree.erase(aItem);
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+size_t ShardedTree<Item, NodeMember, Comparator>::size() const
+{
+    size_t sRes = 0;
+    for (size_t i = 0; i < shardCount(); i++)
+    {
+        std::lock_guard<std::mutex> sLock(m_Shards[i].m_Mutex);
+        sRes += m_Shards[i].m_Tree.size();
+    }
+    return sRes;
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+void ShardedTree<Item, NodeMember, Comparator>::clear()
+{
+    for (size_t i = 0; i < shardCount(); i++)
+    {
+        std::lock_guard<std::mutex> sLock(m_Shards[i].m_Mutex);
+        m_Shards[i].m_Tree.clear();
+    }
+}
+
+template <class Item, Node Item::*NodeMember, class Comparator>
+int ShardedTree<Item, NodeMember, Comparator>::selfCheck() const
+{
+    int sRes = 0;
+    for (size_t i = 0; i < shardCount(); i++)
+    {
+        const ShardTree& sTree = m_Shards[i].m_Tree;
+        sRes |= sTree.selfCheck();
+        if (0 == sTree.size())
+            continue;
+        if (i > 0 && Order::less(*sTree.min(), *m_Bounds[i - 1]))
+            sRes |= 1 << 24;
+        if (i < m_Bounds.size() && !Order::less(*sTree.max(), *m_Bounds[i]))
+            sRes |= 1 << 25;
+    }
+    return sRes;
+}
+
+} // namespace Avl
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <AvlTree.hpp>
+#include <AvlEpoch.hpp>
+
+#include <atomic>
+#include <thread>
+
+namespace Avl
+{
+
+// Links that may be read by other threads while being modified: every field is atomic.
+// Links are published with release stores, so a reader that reaches a node also sees
+// the item it was initialized with.
+template <class Self>
+struct BasicAtomicNode
+{
+    std::atomic<Self*> m_Parent; // nullptr for root node
+    std::atomic<Self*> m_Child[2]; // { left-lesser, right-bigger }
+    std::atomic<uint8_t> m_Bits; // left-bigger << 0 | right-bigger << 1 | is-right << 2
+
+    static const uint8_t IS_RIGHT_BIT = 4;
+
+    Self* getParent() const { return m_Parent.load(std::memory_order_acquire); }
+    void setParent(Self* aParent) { m_Parent.store(aParent, std::memory_order_release); }
+    Self* getChild(bool aRight) const { return m_Child[aRight].load(std::memory_order_acquire); }
+    void setChild(bool aRight, Self* aChild) { m_Child[aRight].store(aChild, std::memory_order_release); }
+    bool isChildBigger(bool aRight) const { return 0 != (m_Bits.load(std::memory_order_relaxed) & (1 << aRight)); }
+    void setChildBigger(bool aRight, bool aBigger) { setBit(1 << aRight, aBigger); }
+    bool isRight() const { return 0 != (m_Bits.load(std::memory_order_relaxed) & IS_RIGHT_BIT); }
+    void setRight(bool aRight) { setBit(IS_RIGHT_BIT, aRight); }
+
+private:
+    // There's only one writer, no need in read-modify-write.
+    void setBit(uint8_t aBit, bool aValue)
+    {
+        uint8_t sBits = m_Bits.load(std::memory_order_relaxed);
+        m_Bits.store(static_cast<uint8_t>(aValue ? sBits | aBit : sBits & ~aBit), std::memory_order_relaxed);
+    }
+};
+
+struct AtomicNode : BasicAtomicNode<AtomicNode>
+{
+};
+
+// Tree with one writer thread and any number of reader threads that never lock.
+// The writer makes every modification under a sequence counter (seqlock): a reader checks
+// that the counter has not changed during its search and retries otherwise. Erased items
+// are retired: they stay readable until reclaim() hands them back when no reader can see them.
+template <class Item, AtomicNode Item::*NodeMember, class Comparator = Default<Item>>
+class SingleWriterTree
+{
+public:
+    using BaseTree = BasicTree<Item, AtomicNode, NodeMember, Comparator>;
+
+    SingleWriterTree() = default;
+    SingleWriterTree(const SingleWriterTree&) = delete;
+    SingleWriterTree& operator=(const SingleWriterTree&) = delete;
+
+    // Writer side; the methods must not be called concurrently.
+    inline std::pair<typename BaseTree::iterator, bool> insert(Item& aItem);
+    // The item must not be reused or inserted again until it's returned by reclaim().
+    inline void erase(Item& aItem);
+    // Pass the erased items that no reader can access anymore to aDisposer(Item&).
+    template <class Disposer>
+    size_t reclaim(Disposer aDisposer) { return m_Retired.reclaim(m_Epochs.advance(), aDisposer); }
+    size_t retired() const { return m_Retired.size(); }
+    // Direct access for the writer thread.
+    const BaseTree& tree() const { return m_Tree; }
+    size_t size() const { return m_Tree.size(); }
+
+    // Reader side; one Reader per thread. Searches must be done between lock() and unlock(),
+    // the found items stay valid until unlock() even if they are erased meanwhile.
+    class Reader
+    {
+    public:
+        explicit Reader(SingleWriterTree& aTree) : m_Tree(aTree), m_Slot(aTree.m_Epochs.attach()) {}
+        ~Reader() { m_Tree.m_Epochs.detach(m_Slot); }
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        void lock() { m_Tree.m_Epochs.enter(m_Slot); }
+        void unlock() { m_Tree.m_Epochs.leave(m_Slot); }
+
+        template <class Key>
+        const Item* find(const Key& aKey) const { return m_Tree.search(aKey, false); }
+        template <class Key>
+        const Item* lower_bound(const Key& aKey) const { return m_Tree.search(aKey, true); }
+        // Call aFn(const Item&) for the items not less than aFrom in order while it returns true.
+        // Return false if the writer has changed the tree meanwhile; the items passed to aFn
+        // were correct, the scan can be continued after the last of them.
+        template <class Key, class Fn>
+        bool scan(const Key& aFrom, Fn aFn) const { return m_Tree.scan(aFrom, aFn); }
+
+    private:
+        SingleWriterTree& m_Tree;
+        size_t m_Slot;
+    };
+
+private:
+    // A longer path means the tree is being changed; wait and retry.
+    static const size_t MAX_STEPS = 128;
+    using Order = Comparison<Item, Comparator>;
+
+    BaseTree m_Tree;
+    std::atomic<const Item*> m_Root{nullptr};
+    std::atomic<uint64_t> m_Version{0}; // odd while the writer is modifying the tree
+    EpochDomain m_Epochs;
+    Retired<Item> m_Retired;
+
+    inline void beginWrite();
+    inline void endWrite();
+    inline uint64_t readBegin() const;
+    inline bool readValidate(uint64_t aVersion) const;
+    template <class Key>
+    inline const Item* search(const Key& aKey, bool aLowerBound) const;
+    template <class Key>
+    inline const Item* lookup(const Key& aKey, bool aLowerBound, bool& aValid) const;
+    static inline const Item* next(const Item* aItem, bool& aValid);
+    template <class Key, class Fn>
+    inline bool scan(const Key& aFrom, Fn& aFn) const;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////// Implementaion /////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+std::pair<typename SingleWriterTree<Item, NodeMember, Comparator>::BaseTree::iterator, bool>
+SingleWriterTree<Item, NodeMember, Comparator>::insert(Item& aItem)
+{
+    beginWrite();
+    std::pair<typename BaseTree::iterator, bool> sRes = m_Tree.insert(aItem);
+    endWrite();
+    return sRes;
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+void SingleWriterTree<Item, NodeMember, Comparator>::erase(Item& aItem)
+{
+    beginWrite();
+    m_Tree.erase(aItem);
+    endWrite();
+    m_Retired.retire(&aItem, m_Epochs.current());
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+void SingleWriterTree<Item, NodeMember, Comparator>::beginWrite()
+{
+    m_Version.store(m_Version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+void SingleWriterTree<Item, NodeMember, Comparator>::endWrite()
+{
+    m_Root.store(m_Tree.getRoot(), std::memory_order_release);
+    m_Version.store(m_Version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+uint64_t SingleWriterTree<Item, NodeMember, Comparator>::readBegin() const
+{
+    uint64_t sVersion;
+    while (0 != ((sVersion = m_Version.load(std::memory_order_acquire)) & 1))
+        std::this_thread::yield();
+    return sVersion;
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+bool SingleWriterTree<Item, NodeMember, Comparator>::readValidate(uint64_t aVersion) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return m_Version.load(std::memory_order_relaxed) == aVersion;
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+template <class Key>
+const Item* SingleWriterTree<Item, NodeMember, Comparator>::search(const Key& aKey, bool aLowerBound) const
+{
+    while (true)
+    {
+        uint64_t sVersion = readBegin();
+        bool sValid = true;
+        const Item* sRes = lookup(aKey, aLowerBound, sValid);
+        if (sValid && readValidate(sVersion))
+            return sRes;
+    }
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+template <class Key>
+const Item* SingleWriterTree<Item, NodeMember, Comparator>::lookup(const Key& aKey, bool aLowerBound, bool& aValid) const
+{
+    // The last item where the search turned left is the lower bound.
+    const Item* sItem = m_Root.load(std::memory_order_acquire);
+    const Item* sBound = nullptr;
+    for (size_t i = 0; nullptr != sItem; i++)
+    {
+        if (MAX_STEPS == i)
+        {
+            aValid = false;
+            return nullptr;
+        }
+        int sCmp = Order::compare(*sItem, aKey);
+        if (0 == sCmp)
+            return sItem;
+        if (sCmp > 0)
+            sBound = sItem;
+        sItem = sCmp > 0 ? BaseTree::getLeft(sItem) : BaseTree::getRight(sItem);
+    }
+    return aLowerBound ? sBound : nullptr;
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+const Item* SingleWriterTree<Item, NodeMember, Comparator>::next(const Item* aItem, bool& aValid)
+{
+    // The same as traverse(), but a path can't be longer than MAX_STEPS.
+    size_t sSteps = 0;
+    const Item* sNext = BaseTree::getRight(aItem);
+    if (nullptr != sNext)
+    {
+        while (nullptr != BaseTree::getLeft(sNext) && ++sSteps < MAX_STEPS)
+            sNext = BaseTree::getLeft(sNext);
+        aValid = sSteps < MAX_STEPS;
+        return sNext;
+    }
+    while (++sSteps < MAX_STEPS)
+    {
+        bool sParentBigger = !BaseTree::isRight(aItem);
+        aItem = BaseTree::getParent(aItem);
+        if (nullptr == aItem || sParentBigger)
+            return aItem;
+    }
+    aValid = false;
+    return nullptr;
+}
+
+template <class Item, AtomicNode Item::*NodeMember, class Comparator>
+template <class Key, class Fn>
+bool SingleWriterTree<Item, NodeMember, Comparator>::scan(const Key& aFrom, Fn& aFn) const
+{
+    uint64_t sVersion = readBegin();
+    bool sValid = true;
+    const Item* sItem = lookup(aFrom, true, sValid);
+    while (true)
+    {
+        if (!sValid || !readValidate(sVersion))
+            return false;
+        if (nullptr == sItem || !aFn(*sItem))
+            return true;
+        sItem = next(sItem, sValid);
+    }
+}
+
+} // namespace Avl
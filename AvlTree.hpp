@@ -1,24 +1,218 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <utility>
 #include <iterator>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+#include <atomic>
+#include <thread>
 #include <cassert>
 
 namespace Avl
 {
 
-struct Node
+// Links of a tree node. Self is the final node type.
+// Any links layout must provide the same set of accessors that the tree uses.
+template <class Self>
+struct BasicNode
 {
-    Node* m_Parent; // nullptr for root node
-    Node* m_Child[2]; // { left-lesser, right-bigger }
+    Self* m_Parent; // nullptr for root node
+    Self* m_Child[2]; // { left-lesser, right-bigger }
     bool m_ChildBigger[2];
     bool m_IsRight;
+
+    Self* getParent() const { return m_Parent; }
+    void setParent(Self* aParent) { m_Parent = aParent; }
+    Self* getChild(bool aRight) const { return m_Child[aRight]; }
+    void setChild(bool aRight, Self* aChild) { m_Child[aRight] = aChild; }
+    bool isChildBigger(bool aRight) const { return m_ChildBigger[aRight]; }
+    void setChildBigger(bool aRight, bool aBigger) { m_ChildBigger[aRight] = aBigger; }
+    bool isRight() const { return m_IsRight; }
+    void setRight(bool aRight) { m_IsRight = aRight; }
 };
 
-inline const Node* traverse(const Node* aNode, bool aBackward);
-inline Node* traverse(Node* aNode, bool aBackward);
+// Links with balance and side bits packed into the low bits of the parent pointer,
+// three pointers in total (24 bytes instead of 32 on 64-bit platforms).
+template <class Self>
+struct alignas(8) BasicCompactNode
+{
+    uintptr_t m_ParentAndBits; // parent | left-bigger << 0 | right-bigger << 1 | is-right << 2
+    Self* m_Child[2]; // { left-lesser, right-bigger }
+
+    static const uintptr_t BITS_MASK = 7;
+    static const uintptr_t IS_RIGHT_BIT = 4;
+
+    Self* getParent() const { return reinterpret_cast<Self*>(m_ParentAndBits & ~BITS_MASK); }
+    void setParent(Self* aParent)
+    {
+        assert(0 == (reinterpret_cast<uintptr_t>(aParent) & BITS_MASK));
+        m_ParentAndBits = reinterpret_cast<uintptr_t>(aParent) | (m_ParentAndBits & BITS_MASK);
+    }
+    Self* getChild(bool aRight) const { return m_Child[aRight]; }
+    void setChild(bool aRight, Self* aChild) { m_Child[aRight] = aChild; }
+    bool isChildBigger(bool aRight) const { return 0 != (m_ParentAndBits & (uintptr_t(1) << aRight)); }
+    void setChildBigger(bool aRight, bool aBigger) { setBit(uintptr_t(1) << aRight, aBigger); }
+    bool isRight() const { return 0 != (m_ParentAndBits & IS_RIGHT_BIT); }
+    void setRight(bool aRight) { setBit(IS_RIGHT_BIT, aRight); }
+
+private:
+    void setBit(uintptr_t aBit, bool aValue) { m_ParentAndBits = (m_ParentAndBits & ~aBit) | (aValue ? aBit : 0); }
+};
+
+// Links stored as 32-bit byte offsets relative to the node itself, with the balance
+// and side bits in the low bits of the offsets (12 bytes per node). All nodes of a
+// tree must lie within 2GB of each other, e.g. in one arena. The links do not depend
+// on where the arena is mapped, so the arena can be moved as a whole (see rebase()).
+template <class Self>
+struct alignas(4) BasicOffsetNode
+{
+    int32_t m_Parent; // offset | left-bigger << 0 | right-bigger << 1
+    int32_t m_Child[2]; // { left-lesser offset | is-right << 0, right-bigger offset }
+
+    static const bool POSITION_INDEPENDENT = true;
+    static const int32_t BITS_MASK = 3;
+
+    Self* getParent() const { return decode(m_Parent); }
+    void setParent(Self* aParent) { m_Parent = encode(aParent) | (m_Parent & BITS_MASK); }
+    Self* getChild(bool aRight) const { return decode(m_Child[aRight]); }
+    void setChild(bool aRight, Self* aChild) { m_Child[aRight] = encode(aChild) | (m_Child[aRight] & BITS_MASK); }
+    bool isChildBigger(bool aRight) const { return 0 != (m_Parent & (1 << aRight)); }
+    void setChildBigger(bool aRight, bool aBigger) { setBit(m_Parent, 1 << aRight, aBigger); }
+    bool isRight() const { return 0 != (m_Child[0] & 1); }
+    void setRight(bool aRight) { setBit(m_Child[0], 1, aRight); }
+
+private:
+    const char* self() const { return reinterpret_cast<const char*>(static_cast<const Self*>(this)); }
+    Self* decode(int32_t aLink) const
+    {
+        int32_t sOffset = aLink & ~BITS_MASK;
+        return 0 == sOffset ? nullptr : reinterpret_cast<Self*>(const_cast<char*>(self() + sOffset));
+    }
+    int32_t encode(const Self* aNode) const
+    {
+        if (nullptr == aNode)
+            return 0;
+        ptrdiff_t sOffset = reinterpret_cast<const char*>(aNode) - self();
+        assert(sOffset >= INT32_MIN && sOffset <= INT32_MAX && 0 == (sOffset & BITS_MASK));
+        return static_cast<int32_t>(sOffset);
+    }
+    static void setBit(int32_t& aLink, int32_t aBit, bool aValue) { aLink = (aLink & ~aBit) | (aValue ? aBit : 0); }
+};
+
+struct Node : BasicNode<Node>
+{
+};
+
+struct CompactNode : BasicCompactNode<CompactNode>
+{
+};
+
+struct OffsetNode : BasicOffsetNode<OffsetNode>
+{
+};
 
+// Node that also keeps the number of nodes in its subtree.
+// A tree of such nodes provides select(), rank() and distance() in O(log n).
+struct CountedNode : BasicNode<CountedNode>
+{
+    size_t m_Count;
+};
+
+template <class NodeT, class = void>
+struct IsCounted : std::false_type {};
+template <class NodeT>
+struct IsCounted<NodeT, decltype(void(std::declval<NodeT&>().m_Count))> : std::true_type {};
+
+// Node that also keeps a prefix of the key of its item, so that a descent compares the
+// prefixes in nodes and reads an item only when its prefix is equal to the prefix of the key.
+// Prefix provides (see MemberKeyPrefix):
+//   Type - an arithmetic type, ordered as the keys: of(a) < of(b) must imply a < b;
+//   static Type of(const Item&), static Type of(const Key&) for every key type that is searched;
+//   static const bool FULL - the prefix is the whole key, equal prefixes mean equal keys.
+template <class Prefix>
+struct KeyNode : BasicNode<KeyNode<Prefix>>
+{
+    using KeyPrefix = Prefix;
+    typename Prefix::Type m_KeyPrefix;
+};
+
+template <class NodeT, class = void>
+struct HasKeyPrefix : std::false_type {};
+template <class NodeT>
+struct HasKeyPrefix<NodeT, decltype(void(std::declval<NodeT&>().m_KeyPrefix))> : std::true_type {};
+
+// The whole small key as the prefix: an arithmetic member KeyMember of the item.
+template <class Item, class Key, Key Item::*KeyMember>
+struct MemberKeyPrefix
+{
+    using Type = Key;
+    static const bool FULL = true;
+    static Key of(const Item& aItem) { return aItem.*KeyMember; }
+    static Key of(const Key& aKey) { return aKey; }
+};
+
+// Node that also keeps an aggregate of the items of its subtree, like a sum or a maximum of
+// their members. Aggregates are updated by rotations and along the changed paths, O(log n).
+// Augment provides (see SumOf, MaxOf):
+//   Type - the aggregate;
+//   static Type of(const Item&) - the aggregate of a single item;
+//   static Type combine(const Type&, const Type&) - the aggregate of two adjacent ranges of
+//   items, must be associative.
+template <class Augment>
+struct AugmentedNode : BasicNode<AugmentedNode<Augment>>
+{
+    using Augmentation = Augment;
+    typename Augment::Type m_Aggregate;
+};
+
+template <class NodeT, class = void>
+struct IsAugmented : std::false_type {};
+template <class NodeT>
+struct IsAugmented<NodeT, decltype(void(std::declval<NodeT&>().m_Aggregate))> : std::true_type {};
+
+// Sum of an arithmetic member of the items, for sums over ranges of keys.
+template <class Item, class T, T Item::*Member>
+struct SumOf
+{
+    using Type = T;
+    static T of(const Item& aItem) { return aItem.*Member; }
+    static T combine(const T& a, const T& b) { return a + b; }
+};
+
+// Maximum of a member of the items; for intervals that start at the keys and end at
+// the member it makes an interval tree.
+template <class Item, class T, T Item::*Member>
+struct MaxOf
+{
+    using Type = T;
+    static T of(const Item& aItem) { return aItem.*Member; }
+    static T combine(const T& a, const T& b) { return a < b ? b : a; }
+};
+
+template <class NodeT>
+inline const NodeT* traverse(const NodeT* aNode, bool aBackward);
+template <class NodeT>
+inline NodeT* traverse(NodeT* aNode, bool aBackward);
+
+// Ask to bring the memory at aPtr into cache; a no-op for compilers without the builtin.
+inline void prefetch(const void* aPtr)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(aPtr);
+#else
+    (void)aPtr;
+#endif
+}
+
+// A comparator provides one of (the first one found is used):
+//   static int Compare(const Item&, const Key&) - three-way comparison: negative, zero or positive;
+//   static bool Less(const A&, const B&) - strict order of items and keys, in both argument orders;
+//   static K KeyOf(const Item&) - projection to a cheap key K (e.g. integral) compared by value,
+//   the keys that are searched are either items or K.
+// Default makes a three-way result of one or two operator< calls.
 template <class Item>
 struct Default
 {
@@ -29,227 +223,1074 @@ struct Default
     }
 };
 
-template <class Item, Node Item::*NodeMember, class Comparator = Default<Item>>
-class Tree
+// Less-only by operator<, for keys that are expensive to compare, like strings: descents call
+// it once per level and check the found item for equality at the end.
+template <class Item>
+struct LessOnly
+{
+    template <class A, class B>
+    static bool Less(const A& a, const B& b) { return a < b; }
+};
+
+template <class Item, class Comparator, class = void>
+struct HasThreeWayCompare : std::false_type {};
+template <class Item, class Comparator>
+struct HasThreeWayCompare<Item, Comparator,
+    decltype(void(Comparator::Compare(std::declval<const Item&>(), std::declval<const Item&>())))> : std::true_type {};
+template <class Item, class Comparator, class = void>
+struct HasLess : std::false_type {};
+template <class Item, class Comparator>
+struct HasLess<Item, Comparator,
+    decltype(void(Comparator::Less(std::declval<const Item&>(), std::declval<const Item&>())))> : std::true_type {};
+
+// Uniform access to any kind of comparator. compare() is three-way, less() is aItem < aKey,
+// greater() is aKey < aItem; each one costs a single call to the comparator when possible.
+template <class Item, class Comparator>
+struct Comparison
+{
+    enum Kind { THREE_WAY, LESS, PROJECTION };
+    static const Kind KIND = HasThreeWayCompare<Item, Comparator>::value ? THREE_WAY :
+                             HasLess<Item, Comparator>::value ? LESS : PROJECTION;
+    // Three-way comparison costs as much as less(), so descents may stop at an equal item.
+    static const bool CHEAP_THREE_WAY = KIND != LESS;
+
+    template <class Key>
+    static int compare(const Item& aItem, const Key& aKey) { return compare(aItem, aKey, KindTag<KIND>()); }
+    template <class Key>
+    static bool less(const Item& aItem, const Key& aKey) { return less(aItem, aKey, KindTag<KIND>()); }
+    template <class Key>
+    static bool greater(const Item& aItem, const Key& aKey) { return greater(aItem, aKey, KindTag<KIND>()); }
+
+private:
+    template <Kind K>
+    using KindTag = std::integral_constant<Kind, K>;
+
+    template <class Key>
+    static int compare(const Item& aItem, const Key& aKey, KindTag<THREE_WAY>) { return Comparator::Compare(aItem, aKey); }
+    template <class Key>
+    static int compare(const Item& aItem, const Key& aKey, KindTag<LESS>)
+    {
+        return Comparator::Less(aItem, aKey) ? -1 : Comparator::Less(aKey, aItem) ? 1 : 0;
+    }
+    template <class Key>
+    static int compare(const Item& aItem, const Key& aKey, KindTag<PROJECTION>)
+    {
+        return (project(aItem) > project(aKey)) - (project(aItem) < project(aKey));
+    }
+    template <class Key>
+    static bool less(const Item& aItem, const Key& aKey, KindTag<THREE_WAY>) { return Comparator::Compare(aItem, aKey) < 0; }
+    template <class Key>
+    static bool less(const Item& aItem, const Key& aKey, KindTag<LESS>) { return Comparator::Less(aItem, aKey); }
+    template <class Key>
+    static bool less(const Item& aItem, const Key& aKey, KindTag<PROJECTION>) { return project(aItem) < project(aKey); }
+    template <class Key>
+    static bool greater(const Item& aItem, const Key& aKey, KindTag<THREE_WAY>) { return Comparator::Compare(aItem, aKey) > 0; }
+    template <class Key>
+    static bool greater(const Item& aItem, const Key& aKey, KindTag<LESS>) { return Comparator::Less(aKey, aItem); }
+    template <class Key>
+    static bool greater(const Item& aItem, const Key& aKey, KindTag<PROJECTION>) { return project(aKey) < project(aItem); }
+
+    template <class Key, class C = Comparator>
+    static auto project(const Key& aItem, std::true_type) -> decltype(C::KeyOf(aItem)) { return C::KeyOf(aItem); }
+    template <class Key>
+    static const Key& project(const Key& aKey, std::false_type) { return aKey; }
+    template <class Key>
+    static auto project(const Key& aKey) -> decltype(project(aKey, std::is_base_of<Item, Key>()))
+    {
+        return project(aKey, std::is_base_of<Item, Key>());
+    }
+};
+
+// Counters of the work done by trees, see CountingStats.
+struct TreeStats
+{
+    // Lookups that visit more nodes than the histogram has buckets are counted in the last one.
+    static const size_t DEPTH_LIMIT = 64;
+
+    size_t m_Comparisons = 0; // calls of the comparator
+    size_t m_SingleRotations = 0;
+    size_t m_DoubleRotations = 0;
+    size_t m_Rebalances = 0; // rebalancing passes after inserts and erases
+    size_t m_RebalanceSteps = 0; // levels climbed by them
+    size_t m_Lookups = 0;
+    size_t m_LookupDepth[DEPTH_LIMIT] = {}; // the number of lookups that visited i nodes
+
+    double averageRebalancePath() const { return 0 == m_Rebalances ? 0 : double(m_RebalanceSteps) / m_Rebalances; }
+    inline double averageLookupDepth() const;
+};
+
+// Statistics policy of a tree: it is told about every unit of work. NoStats is empty and
+// compiles out completely.
+struct NoStats
+{
+    static void comparison() {}
+    static void rotation(bool) {}
+    static void rebalance() {}
+    static void rebalanceStep() {}
+    static void lookup(size_t) {}
+};
+
+// Statistics policy that counts into thread-local TreeStats, so it costs no synchronization;
+// snapshot() and reset() are of the calling thread. Trees with different Tags count apart.
+template <class Tag = void>
+struct CountingStats
+{
+    static void comparison() { data().m_Comparisons++; }
+    static void rotation(bool aDouble) { (aDouble ? data().m_DoubleRotations : data().m_SingleRotations)++; }
+    static void rebalance() { data().m_Rebalances++; }
+    static void rebalanceStep() { data().m_RebalanceSteps++; }
+    static void lookup(size_t aDepth)
+    {
+        data().m_Lookups++;
+        data().m_LookupDepth[std::min<size_t>(aDepth, TreeStats::DEPTH_LIMIT - 1)]++;
+    }
+    static TreeStats snapshot() { return data(); }
+    static void reset() { data() = TreeStats(); }
+
+private:
+    static TreeStats& data() { static thread_local TreeStats sData; return sData; }
+};
+
+// Orders of items in memory made by BasicTree::relayout(). Breadth-first puts every level
+// together, so the top levels share cache lines and pages. Van Emde Boas puts together every
+// subtree of the top half of the levels and then every subtree below it, recursively, so that
+// a lookup touches O(log n / log B) blocks for any block size B.
+enum Placement { BREADTH_FIRST, VAN_EMDE_BOAS };
+
+// Shape of a tree and placement of its nodes in memory, see BasicTree::shape().
+struct TreeShape
+{
+    static const size_t CACHE_LINE = 64;
+    static const size_t PAGE = 4096;
+
+    size_t m_Size = 0;
+    size_t m_Height = 0;
+    size_t m_MinHeight = 0; // of a perfectly balanced tree of the same size
+    size_t m_MaxHeight = 0; // the AVL bound, of the sparsest AVL tree of the same size
+    std::vector<size_t> m_Levels; // the number of nodes at every depth, the root is at 0
+    size_t m_Balanced = 0; // nodes with subtrees of equal heights
+    size_t m_LeftHeavy = 0;
+    size_t m_RightHeavy = 0;
+    size_t m_TotalDepth = 0; // sum of the numbers of nodes visited by lookups of every item
+    size_t m_LineCrossings = 0; // parent-child links between different cache lines
+    size_t m_PageCrossings = 0; // and between different pages
+
+    double averageDepth() const { return 0 == m_Size ? 0 : double(m_TotalDepth) / m_Size; }
+    double lineCrossingRate() const { return m_Size < 2 ? 0 : double(m_LineCrossings) / (m_Size - 1); }
+    double pageCrossingRate() const { return m_Size < 2 ? 0 : double(m_PageCrossings) / (m_Size - 1); }
+};
+
+// Multi - allow items with equal keys (a multiset). A new item goes after the equal ones,
+// so they stay in the order of insertion.
+// Stats - statistics policy, see NoStats and CountingStats.
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator = Default<Item>, bool Multi = false,
+          class Stats = NoStats>
+class BasicTree
 {
 public:
-    // Iterators
-    template <class TItem, class TNode>
-    class iterator_common : std::iterator<std::input_iterator_tag, TItem>
+    // Iterators. Bidirectional, end() included: decrementing end() gives the last item, so an
+    // iterator keeps the tree for that. Backward - a reverse iterator, it goes from max() to min().
+    template <class TItem, class TNode, bool Backward>
+    class iterator_common
     {
     public:
-        explicit iterator_common(TNode* aNode) : m_Node(aNode) {}
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = typename std::remove_const<TItem>::type;
+        using difference_type = ptrdiff_t;
+        using pointer = TItem*;
+        using reference = TItem&;
+
+        iterator_common() : m_Node(nullptr), m_Tree(nullptr) {}
+        iterator_common(TNode* aNode, const BasicTree* aTree) : m_Node(aNode), m_Tree(aTree) {}
+        template <class TItem2, class TNode2, typename std::enable_if<std::is_convertible<TNode2*, TNode*>::value>::type* = nullptr>
+        iterator_common(const iterator_common<TItem2, TNode2, Backward>& aItr) : m_Node(aItr.m_Node), m_Tree(aItr.m_Tree) {}
+        // From an iterator in the other direction, to the previous item: as std::reverse_iterator(aItr).
+        template <class TItem2, class TNode2, typename std::enable_if<std::is_convertible<TNode2*, TNode*>::value>::type* = nullptr>
+        explicit iterator_common(const iterator_common<TItem2, TNode2, !Backward>& aItr)
+            : m_Node(nullptr != aItr.m_Node ? traverse(aItr.m_Node, Backward) : aItr.m_Tree->edge(Backward)), m_Tree(aItr.m_Tree) {}
         TItem& operator*() const { return *objByNode(m_Node); }
         TItem* operator->() const { return objByNode(m_Node); }
-        bool operator==(const iterator_common& aItr) { return m_Node == aItr.m_Node; }
-        bool operator!=(const iterator_common& aItr) { return m_Node != aItr.m_Node; }
-        iterator_common& operator++() { m_Node = traverse(m_Node, false); return *this; }
+        bool operator==(const iterator_common& aItr) const { return m_Node == aItr.m_Node; }
+        bool operator!=(const iterator_common& aItr) const { return m_Node != aItr.m_Node; }
+        iterator_common& operator++() { m_Node = traverse(m_Node, Backward); return *this; }
         iterator_common operator++(int) { iterator_common aTmp = *this; ++(*this); return aTmp; }
-        iterator_common& operator--() { m_Node = traverse(m_Node, true); return *this; }
+        iterator_common& operator--() { m_Node = nullptr != m_Node ? traverse(m_Node, !Backward) : m_Tree->edge(!Backward); return *this; }
         iterator_common operator--(int) { iterator_common aTmp = *this; --(*this); return aTmp; }
+        // The iterator in the other direction that points to the next item, as std::reverse_iterator::base().
+        iterator_common<TItem, TNode, !Backward> base() const { return iterator_common<TItem, TNode, !Backward>(*this); }
+    private:
+        template <class TItem2, class TNode2, bool Backward2> friend class iterator_common;
+        friend class BasicTree;
+        TNode* m_Node;
+        const BasicTree* m_Tree;
+    };
+    using iterator = iterator_common<Item, NodeT, false>;
+    using const_iterator = iterator_common<const Item, const NodeT, false>;
+    using reverse_iterator = iterator_common<Item, NodeT, true>;
+    using const_reverse_iterator = iterator_common<const Item, const NodeT, true>;
+
+    // Forward iteration that keeps the path from the root in the iterator, so that a step up
+    // is a pop instead of a walk over the parent links. The iterator is big (about 800 bytes),
+    // it is meant for loops over the whole tree, see stack_begin().
+    template <class TItem, class TNode>
+    class stack_iterator_common
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename std::remove_const<TItem>::type;
+        using difference_type = ptrdiff_t;
+        using pointer = TItem*;
+        using reference = TItem&;
+
+        stack_iterator_common() : m_Depth(0) {}
+        explicit stack_iterator_common(TNode* aRoot) : m_Depth(0) { pushLeft(aRoot); }
+        TItem& operator*() const { return *objByNode(top()); }
+        TItem* operator->() const { return objByNode(top()); }
+        bool operator==(const stack_iterator_common& aItr) const { return top() == aItr.top(); }
+        bool operator!=(const stack_iterator_common& aItr) const { return top() != aItr.top(); }
+        stack_iterator_common& operator++() { pushLeft(m_Stack[--m_Depth]->getChild(1)); return *this; }
+        stack_iterator_common operator++(int) { stack_iterator_common aTmp = *this; ++(*this); return aTmp; }
     private:
+        // The height of an AVL tree is less than 1.45 * log2(n + 2), 93 for any n of size_t.
+        static const size_t MAX_HEIGHT = 96;
+        TNode* top() const { return 0 != m_Depth ? m_Stack[m_Depth - 1] : nullptr; }
+        void pushLeft(TNode* aNode)
+        {
+            for (; nullptr != aNode; aNode = aNode->getChild(0))
+            {
+                assert(m_Depth < MAX_HEIGHT);
+                m_Stack[m_Depth++] = aNode;
+            }
+        }
+        size_t m_Depth;
+        TNode* m_Stack[MAX_HEIGHT];
+    };
+    using stack_iterator = stack_iterator_common<Item, NodeT>;
+    using const_stack_iterator = stack_iterator_common<const Item, const NodeT>;
+
+    // Post-order iteration: children before their parent, the root is the last. The next item is
+    // found before the current one is returned by operator++(int), so the items may be disposed
+    // of on the way, as in for (itr = postorder_begin(); itr != postorder_end();) dispose(*itr++);
+    template <class TItem, class TNode>
+    class postorder_iterator_common
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename std::remove_const<TItem>::type;
+        using difference_type = ptrdiff_t;
+        using pointer = TItem*;
+        using reference = TItem&;
+
+        postorder_iterator_common() : m_Node(nullptr) {}
+        explicit postorder_iterator_common(TNode* aNode) : m_Node(aNode) {}
+        TItem& operator*() const { return *objByNode(m_Node); }
+        TItem* operator->() const { return objByNode(m_Node); }
+        bool operator==(const postorder_iterator_common& aItr) const { return m_Node == aItr.m_Node; }
+        bool operator!=(const postorder_iterator_common& aItr) const { return m_Node != aItr.m_Node; }
+        postorder_iterator_common& operator++()
+        {
+            TNode* sParent = m_Node->getParent();
+            if (nullptr != sParent && !m_Node->isRight() && nullptr != sParent->getChild(1))
+                m_Node = firstPostorder(sParent->getChild(1));
+            else
+                m_Node = sParent;
+            return *this;
+        }
+        postorder_iterator_common operator++(int) { postorder_iterator_common aTmp = *this; ++(*this); return aTmp; }
+    private:
+        friend class BasicTree;
+        // The first node of the subtree in post-order: the deepest one on the leftmost path.
+        static TNode* firstPostorder(TNode* aNode)
+        {
+            while (nullptr != aNode)
+            {
+                TNode* sChild = nullptr != aNode->getChild(0) ? aNode->getChild(0) : aNode->getChild(1);
+                if (nullptr == sChild)
+                    break;
+                aNode = sChild;
+            }
+            return aNode;
+        }
         TNode* m_Node;
     };
-    using iterator = iterator_common<Item, Node>;
-    using const_iterator = iterator_common<const Item, const Node>;
+    using postorder_iterator = postorder_iterator_common<Item, NodeT>;
+    using const_postorder_iterator = postorder_iterator_common<const Item, const NodeT>;
 
     // Access
-    const_iterator begin() const { return const_iterator(m_Min); }
-    const_iterator end() const { return const_iterator(nullptr); }
-    iterator begin() { return iterator(m_Min); }
-    iterator end() { return iterator(nullptr); }
-    const_iterator min() const { return const_iterator(m_Min); }
-    const_iterator max() const { return const_iterator(m_Max); }
-    iterator min() { return iterator(m_Min); }
-    iterator max() { return iterator(m_Max); }
+    const_iterator begin() const { return const_iterator(m_Min, this); }
+    const_iterator end() const { return const_iterator(nullptr, this); }
+    iterator begin() { return iterator(m_Min, this); }
+    iterator end() { return iterator(nullptr, this); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(m_Max, this); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(nullptr, this); }
+    reverse_iterator rbegin() { return reverse_iterator(m_Max, this); }
+    reverse_iterator rend() { return reverse_iterator(nullptr, this); }
+    const_stack_iterator stack_begin() const { return const_stack_iterator(m_Root); }
+    const_stack_iterator stack_end() const { return const_stack_iterator(); }
+    stack_iterator stack_begin() { return stack_iterator(m_Root); }
+    stack_iterator stack_end() { return stack_iterator(); }
+    const_postorder_iterator postorder_begin() const { return const_postorder_iterator(const_postorder_iterator::firstPostorder(m_Root)); }
+    const_postorder_iterator postorder_end() const { return const_postorder_iterator(); }
+    postorder_iterator postorder_begin() { return postorder_iterator(postorder_iterator::firstPostorder(m_Root)); }
+    postorder_iterator postorder_end() { return postorder_iterator(); }
+    const_iterator min() const { return const_iterator(m_Min, this); }
+    const_iterator max() const { return const_iterator(m_Max, this); }
+    iterator min() { return iterator(m_Min, this); }
+    iterator max() { return iterator(m_Max, this); }
+    // The iterator that points to aItem, which must be in the tree.
+    const_iterator iterator_to(const Item& aItem) const { return const_iterator(&(aItem.*NodeMember), this); }
+    iterator iterator_to(Item& aItem) { return iterator(&(aItem.*NodeMember), this); }
     size_t size() const { return m_Size; }
 
+    // Any of the items equal to aKey in a multi tree, see equal_range().
+    template <class Key>
+    const const_iterator find(const Key& aKey) const { return const_iterator(lookup(aKey), this); }
     template <class Key>
-    const const_iterator find(const Key& aKey) const { return const_iterator(lookup(aKey)); }
+    iterator find(const Key& aKey) { return iterator(lookup(aKey), this); }
+    // Finger search: start from aHint (max() for end()) and go up only as far as needed, O(log d)
+    // for the distance d between aHint and the result.
     template <class Key>
-    iterator find(const Key& aKey) { return iterator(lookup(aKey)); }
+    const_iterator find(const_iterator aHint, const Key& aKey) const { return const_iterator(lookup(climb(hintNode(aHint), aKey), aKey), this); }
+    template <class Key>
+    iterator find(const_iterator aHint, const Key& aKey) { return iterator(lookup(climb(hintNode(aHint), aKey), aKey), this); }
+    // aResults[i] = find(aKeys[i]) for i < aCount, random access iterators or pointers.
+    // Descents of FIND_BATCH_WIDTH keys are interleaved and the next node of each one is
+    // prefetched, so that cache misses of different keys overlap.
+    template <class KeyItr, class ResultItr>
+    void findBatch(KeyItr aKeys, size_t aCount, ResultItr aResults) const
+    {
+        lookupBatch(aKeys, aCount, [this, &aResults](size_t i, const NodeT* aNode) { aResults[i] = const_iterator(aNode, this); });
+    }
+    template <class KeyItr, class ResultItr>
+    void findBatch(KeyItr aKeys, size_t aCount, ResultItr aResults)
+    {
+        lookupBatch(aKeys, aCount, [this, &aResults](size_t i, const NodeT* aNode) { aResults[i] = iterator(const_cast<NodeT*>(aNode), this); });
+    }
+
+    // Ordered lookup: first item not less than aKey / first item bigger than aKey.
+    template <class Key>
+    const_iterator lower_bound(const Key& aKey) const { return const_iterator(lookupBound(aKey, false), this); }
+    template <class Key>
+    iterator lower_bound(const Key& aKey) { return iterator(lookupBound(aKey, false), this); }
+    template <class Key>
+    const_iterator upper_bound(const Key& aKey) const { return const_iterator(lookupBound(aKey, true), this); }
+    template <class Key>
+    iterator upper_bound(const Key& aKey) { return iterator(lookupBound(aKey, true), this); }
+    template <class Key>
+    inline std::pair<const_iterator, const_iterator> equal_range(const Key& aKey) const;
+    template <class Key>
+    inline std::pair<iterator, iterator> equal_range(const Key& aKey);
+    // Number of items equal to aKey, O(log n) for counted nodes, O(log n + count) otherwise.
+    template <class Key>
+    size_t count(const Key& aKey) const { return countRange(equal_range(aKey), IsCounted<NodeT>()); }
 
     // Modification
-    inline std::pair<iterator, bool> insert(Item& aItem); // bool - success
+    inline std::pair<iterator, bool> insert(Item& aItem); // bool - success, always true in a multi tree
+    // Insert with a finger search from aHint, see find(). Appending before min() or after max()
+    // is amortized O(1) regardless of the hint.
+    inline std::pair<iterator, bool> insert(const_iterator aHint, Item& aItem);
     inline void replace(Item& aItem, Item& aNewItem);
     inline void erase(Item& aItem);
+    // Batches, given by random access ranges of pointers to items; the ranges are sorted in place.
+    // insertBatch() inserts the items with a finger search from the previously inserted one, or
+    // rebuilds the tree by merging when the batch is large; erased items must be in the tree.
+    // Both return the number of skipped duplicates (keys already in the tree or repeated in the batch,
+    // only repeated items for eraseBatch() of a multi tree; nothing is skipped by its insertBatch()).
+    template <class ItemPtrItr>
+    inline size_t insertBatch(ItemPtrItr aFirst, ItemPtrItr aLast);
+    template <class ItemPtrItr>
+    inline size_t eraseBatch(ItemPtrItr aFirst, ItemPtrItr aLast);
+    // Erase the items of [aFirst, aLast) by splits before aFirst and aLast and one join of
+    // the outer parts, O(log n + k) for k items instead of k rebalancing erases (O(log n) for
+    // counted nodes without aDisposer). The erased items are passed to aDisposer(Item&) in
+    // post-order. Return aLast.
+    template <class Disposer>
+    inline iterator erase(const_iterator aFirst, const_iterator aLast, Disposer aDisposer);
+    inline iterator erase(const_iterator aFirst, const_iterator aLast);
+    // Forget all the items at once, their nodes are left as they are.
     void clear() { m_Root = m_Min = m_Max = nullptr; m_Size = 0; }
+    // Pass every item to aDisposer(Item&) in post-order and clear, O(n) without recursion.
+    // An item may be reused or freed by aDisposer, the tree doesn't access it anymore.
+    template <class Disposer>
+    void clearAndDispose(Disposer aDisposer) { disposeSubTree(m_Root, aDisposer); clear(); }
+    // Replace the content with a range of items (or pointers to items) sorted by
+    // strictly increasing keys (non-decreasing for a multi tree). Links a perfectly balanced
+    // tree in O(n), no comparisons.
+    template <class ItemItr>
+    inline void buildSorted(ItemItr aFirst, ItemItr aLast);
+    // The memory holding all the items was moved by aDelta bytes; only for position independent nodes.
+    inline void rebase(ptrdiff_t aDelta);
+    // Move every item to a new place, in aPlacement order, to restore locality after churn:
+    // aRelocate(Item&) must return a copy of the item (its node is overwritten), e.g. made in
+    // the next slot of an arena; the old item is passed to aDisposer(Item&) right after it has
+    // left the tree. The content and the shape stay the same, O(n) without comparisons.
+    // Position independent nodes must be within reach of each other in both places at once.
+    template <class Relocate, class Disposer>
+    inline void relayout(Placement aPlacement, Relocate aRelocate, Disposer aDisposer);
+    template <class Relocate>
+    void relayout(Placement aPlacement, Relocate aRelocate) { relayout(aPlacement, aRelocate, [](Item&) {}); }
+
+    // Join and split, O(log n).
+    // join(pivot, right) - all items of this < aPivot < all items of aRight (<= for a multi tree); moves aPivot
+    // and the whole aRight into this. join(right) - the same without a pivot.
+    // split() moves the items not less than aKey to aRight, that must be empty.
+    // Without counted nodes sizes of the parts are recounted in O(size of the smaller part).
+    inline void join(Item& aPivot, BasicTree& aRight);
+    inline void join(BasicTree& aRight);
+    template <class Key>
+    inline void split(const Key& aKey, BasicTree& aRight);
+
+    // Set algebra, O(m log(n/m + 1)) for trees of m and n items, m <= n.
+    // merge() moves into this the items of aOther with keys missing in this, the rest stay in aOther.
+    // intersect() keeps the items with keys present in aOther, subtract() keeps the items with keys
+    // missing in aOther. Dropped items are passed to aDisposer(Item&) and must not be accessed
+    // through this tree anymore. Multi trees have merge() only, it moves all the items of aOther,
+    // they go after the items of this with equal keys.
+    inline void merge(BasicTree& aOther);
+    template <class Disposer>
+    inline void intersect(const BasicTree& aOther, Disposer aDisposer);
+    template <class Disposer>
+    inline void subtract(const BasicTree& aOther, Disposer aDisposer);
+
+    // Parallel traversal on aThreads threads (the calling one included). The tree is cut at
+    // subtree roots into pieces of adjacent items, about PIECES_PER_THREAD per thread; items
+    // of a piece are visited in order, pieces are taken by threads as they go.
+    // parallelForEach() calls aFn(Item&) (aFn(const Item&) for a const tree) for every item,
+    // from different threads.
+    // parallelReduce() folds every piece with aFold(T, const Item&) starting from aInit, then
+    // combines the results of pieces in order with aCombine(T, T), so aInit must be neutral.
+    template <class Fn>
+    inline void parallelForEach(size_t aThreads, Fn aFn) const;
+    template <class Fn>
+    inline void parallelForEach(size_t aThreads, Fn aFn);
+    template <class T, class Fold, class Combine>
+    inline T parallelReduce(size_t aThreads, T aInit, Fold aFold, Combine aCombine) const;
 
     // Low level access
     const Item* getRoot() const { return objByNodeSafe(m_Root); }
-    static const Item* getLeft(const Item* aItem) { return objByNodeSafe((aItem->*NodeMember).m_Child[0]); }
-    static const Item* getRight(const Item* aItem) { return objByNodeSafe((aItem->*NodeMember).m_Child[1]); }
-    static bool isLeftBigger(const Item* aItem) { return (aItem->*NodeMember).m_ChildBigger[0]; }
-    static bool isRightBigger(const Item* aItem) { return (aItem->*NodeMember).m_ChildBigger[1]; }
+    static const Item* getLeft(const Item* aItem) { return objByNodeSafe((aItem->*NodeMember).getChild(0)); }
+    static const Item* getRight(const Item* aItem) { return objByNodeSafe((aItem->*NodeMember).getChild(1)); }
+    static bool isLeftBigger(const Item* aItem) { return (aItem->*NodeMember).isChildBigger(0); }
+    static bool isRightBigger(const Item* aItem) { return (aItem->*NodeMember).isChildBigger(1); }
+    static const Item* getParent(const Item* aItem) { return objByNodeSafe((aItem->*NodeMember).getParent()); }
+    static bool isRight(const Item* aItem) { return (aItem->*NodeMember).isRight(); }
+
+    // Order statistics, available for trees of counted nodes (see CountedNode).
+    // select(k) - k-th smallest item (0-based), end() if k >= size().
+    // rank() - number of items less than the given one, size() for end().
+    inline const_iterator select(size_t aIndex) const;
+    inline iterator select(size_t aIndex);
+    inline size_t rank(const Item& aItem) const;
+    inline size_t rank(const_iterator aItr) const;
+    size_t distance(const_iterator aFirst, const_iterator aLast) const { return rank(aLast) - rank(aFirst); }
+
+    // Aggregates, available for trees of augmented nodes (see AugmentedNode).
+    // aggregate() - aInit combined with the aggregates of the items not less than aFrom
+    // and less than aTo, in order; O(log n).
+    // forEachOverlap() - call aFn(Item&) (aFn(const Item&) for a const tree) in order for the
+    // items that overlap [aLow, aHigh) as intervals [key, end) where end is the aggregate of
+    // the item and the aggregate is the maximum (see MaxOf); O(log n) per item.
+    // refresh() - the aggregate of aItem has changed (its key must not); O(log n).
+    template <class Key, class T>
+    inline T aggregate(const Key& aFrom, const Key& aTo, T aInit) const;
+    template <class Key, class Fn>
+    void forEachOverlap(const Key& aLow, const Key& aHigh, Fn aFn) const { forEachOverlap(static_cast<const NodeT*>(m_Root), aLow, aHigh, aFn); }
+    template <class Key, class Fn>
+    void forEachOverlap(const Key& aLow, const Key& aHigh, Fn aFn) { forEachOverlap(m_Root, aLow, aHigh, aFn); }
+    void refresh(Item& aItem) { reaggregatePath(&(aItem.*NodeMember)); }
 
     // Debug
     inline int selfCheck() const;
+    // Height against its bounds, nodes per level, balance and how often links cross cache lines
+    // and pages; O(n). Tells how cache-hostile the tree is, i.e. whether it is worth compacting.
+    inline TreeShape shape() const;
 
 private:
-    Node* m_Root = nullptr;
-    Node* m_Min = nullptr;
-    Node* m_Max = nullptr;
+    NodeT* m_Root = nullptr;
+    NodeT* m_Min = nullptr;
+    NodeT* m_Max = nullptr;
     size_t m_Size = 0;
 
-    static inline const Item* objByNode(const Node* aNode);
-    static inline Item* objByNode(Node* aNode);
-    static inline const Item* objByNodeSafe(const Node* aNode);
-    static inline Item* objByNodeSafe(Node* aNode);
-    template <class Key>
-    inline const Node* lookup(const Key& aKey) const;
-    template <class Key>
-    inline Node* lookup(const Key& aKey);
-    inline void rebalanceInsert(Node* sNode);
-    inline void rebalanceErase(Node* aNode, bool aRight);
-    inline void relink(Node* aNode);
-    inline void relinkParent(Node* aOldNode, Node* aNewNode);
-    inline void relinkParentSafe(Node* aOldNode, Node* aNewNode);
-    inline void relinkChild(Node* aNewParent, Node* aNewChild, bool aRight);
-    inline void relinkChildSafe(Node* aNewParent, Node* aNewChild, bool aRight);
-    inline int checkSubTree(const Node* aNode, size_t& aHeight, size_t& aSize) const;
+    static inline const Item* objByNode(const NodeT* aNode);
+    static inline Item* objByNode(NodeT* aNode);
+    static inline const Item* objByNodeSafe(const NodeT* aNode);
+    static inline Item* objByNodeSafe(NodeT* aNode);
+    template <class Key>
+    const NodeT* lookup(const Key& aKey) const { return lookup(m_Root, aKey); }
+    template <class Key>
+    NodeT* lookup(const Key& aKey) { return lookup(m_Root, aKey); }
+    template <class Key>
+    static const NodeT* lookup(const NodeT* aNode, const Key& aKey) { return lookup(aNode, aKey, CheapThreeWay()); }
+    template <class Key>
+    static inline const NodeT* lookup(const NodeT* aNode, const Key& aKey, std::true_type);
+    template <class Key>
+    static inline const NodeT* lookup(const NodeT* aNode, const Key& aKey, std::false_type);
+    template <class Key>
+    static NodeT* lookup(NodeT* aNode, const Key& aKey) { return const_cast<NodeT*>(lookup(const_cast<const NodeT*>(aNode), aKey)); }
+    static constexpr size_t FIND_BATCH_WIDTH = 16;
+    template <class KeyItr, class Store>
+    inline void lookupBatch(KeyItr aKeys, size_t aCount, Store aStore) const;
+    NodeT* edge(bool aMax) const { return aMax ? m_Max : m_Min; }
+    NodeT* hintNode(const_iterator aHint) const { return const_cast<NodeT*>(nullptr != aHint.m_Node ? aHint.m_Node : m_Max); }
+    template <class Key>
+    static inline NodeT* climb(NodeT* aNode, const Key& aKey);
+    // In a multi tree a new item goes after the equal ones, climbAfter() and insertAfter() look
+    // for the first item bigger than it.
+    static NodeT* climbToInsert(NodeT* aNode, const Item& aItem) { return Multi ? climbAfter(aNode, aItem) : climb(aNode, aItem); }
+    static inline NodeT* climbAfter(NodeT* aNode, const Item& aItem);
+    std::pair<iterator, bool> insertFrom(NodeT* aNode, Item& aItem) { return Multi ? insertAfter(aNode, aItem) : insertFrom(aNode, aItem, CheapThreeWay()); }
+    inline std::pair<iterator, bool> insertFrom(NodeT* aNode, Item& aItem, std::true_type);
+    inline std::pair<iterator, bool> insertFrom(NodeT* aNode, Item& aItem, std::false_type);
+    inline std::pair<iterator, bool> insertAfter(NodeT* aNode, Item& aItem);
+    using ConstRange = std::pair<const_iterator, const_iterator>;
+    size_t countRange(const ConstRange& aRange, std::true_type) const { return distance(aRange.first, aRange.second); }
+    static inline size_t countRange(ConstRange aRange, std::false_type);
+    template <class Key>
+    inline const NodeT* lookupBound(const Key& aKey, bool aUpper) const;
+    template <class Key>
+    inline NodeT* lookupBound(const Key& aKey, bool aUpper);
+    inline void insertLeaf(NodeT* sParent, bool sIsRight, NodeT* sNode);
+    inline void rebalanceInsert(NodeT* sNode);
+    static bool itemPtrLess(const Item* a, const Item* b) { Stats::comparison(); return Order::less(*a, *b); }
+    // A batch is merged with the tree by a full rebuild if it's bigger than 1/BATCH_REBUILD_RATIO of the tree.
+    static constexpr size_t BATCH_REBUILD_RATIO = 8;
+    inline void rebalanceErase(NodeT* aNode, bool aRight);
+    static inline void copyLinks(NodeT* aTo, const NodeT* aFrom);
+    template <class ItemItr>
+    inline NodeT* buildSubTree(ItemItr& aItr, size_t aCount, size_t& aHeight);
+    static Item& itemOf(Item& aItem) { return aItem; }
+    static Item& itemOf(Item* aItem) { return *aItem; }
+    inline void updateMinMax();
+
+    // Detached subtrees: roots have no parent, heights are passed along to keep joins O(log n).
+    // Joins use m_Root as the root of the subtree being rebalanced.
+    static inline size_t heightOf(const NodeT* aNode);
+    static size_t childHeight(const NodeT* aNode, size_t aHeight, bool aRight) { return aHeight - (aNode->isChildBigger(!aRight) ? 2 : 1); }
+    static void detach(NodeT* aNode) { if (nullptr != aNode) { aNode->setParent(nullptr); aNode->setRight(false); } }
+    inline NodeT* joinSubTrees(NodeT* aLeft, size_t aLeftHeight, NodeT* aPivot, NodeT* aRight, size_t aRightHeight, size_t& aHeight);
+    inline NodeT* joinSubTrees(NodeT* aLeft, size_t aLeftHeight, NodeT* aRight, size_t aRightHeight, size_t& aHeight);
+    inline NodeT* splitMin(NodeT* aNode, size_t aHeight, NodeT*& aRest, size_t& aRestHeight);
+    inline NodeT* cutRange(NodeT* aFirst, NodeT* aLast);
+    inline void splitBefore(NodeT* aNode, NodeT*& aLeft, size_t& aLeftHeight, NodeT*& aRight, size_t& aRightHeight);
+    template <class Key>
+    inline NodeT* splitSubTree(NodeT* aNode, size_t aHeight, const Key& aKey,
+                               NodeT*& aLeft, size_t& aLeftHeight, NodeT*& aRight, size_t& aRightHeight,
+                               bool aEqualLeft = false);
+    inline NodeT* mergeSubTrees(NodeT* aNode, size_t aHeight, NodeT* aOther, size_t aOtherHeight,
+                                std::vector<Item*>& aDuplicates, size_t& aResHeight);
+    template <class Disposer>
+    inline NodeT* intersectSubTrees(NodeT* aNode, size_t aHeight, const NodeT* aOther, size_t aOtherHeight,
+                                    Disposer& aDisposer, size_t& aKept, size_t& aResHeight);
+    template <class Disposer>
+    inline NodeT* subtractSubTrees(NodeT* aNode, size_t aHeight, const NodeT* aOther, size_t aOtherHeight,
+                                   Disposer& aDisposer, size_t& aRemoved, size_t& aResHeight);
+    template <class Disposer>
+    static inline void disposeSubTree(NodeT* aNode, Disposer& aDisposer);
+    // A piece of the parallel traversal: a whole subtree or a single node between subtrees.
+    using Piece = std::pair<const NodeT*, bool>; // node, whole subtree
+    static constexpr size_t PIECES_PER_THREAD = 8;
+    inline void cutPieces(const NodeT* aNode, size_t aHeight, size_t aMaxHeight, std::vector<Piece>& aPieces) const;
+    inline std::vector<Piece> cutPieces(size_t aThreads) const;
+    template <class Fn>
+    static inline void forEachInPiece(const Piece& aPiece, Fn& aFn);
+    template <class Fn>
+    static inline void forEachInSubTree(const NodeT* aNode, Fn& aFn);
+    template <class Fn>
+    static inline void runParallel(size_t aThreads, size_t aCount, Fn aFn);
+    static size_t leftSizeOf(const NodeT* aLeft, const NodeT* aRight, size_t aTotal) { return leftSizeOf(aLeft, aRight, aTotal, IsCounted<NodeT>()); }
+    static size_t leftSizeOf(const NodeT* aLeft, const NodeT*, size_t, std::true_type) { return countOf(aLeft); }
+    static inline size_t leftSizeOf(const NodeT* aLeft, const NodeT* aRight, size_t aTotal, std::false_type);
+    inline void relink(NodeT* aNode);
+    inline void relinkParent(NodeT* aOldNode, NodeT* aNewNode);
+    inline void relinkParentSafe(NodeT* aOldNode, NodeT* aNewNode);
+    inline void relinkChild(NodeT* aNewParent, NodeT* aNewChild, bool aRight);
+    inline void relinkChildSafe(NodeT* aNewParent, NodeT* aNewChild, bool aRight);
+    inline int checkSubTree(const NodeT* aNode, size_t& aHeight, size_t& aSize) const;
+    static inline void shapeSubTree(const NodeT* aNode, size_t aDepth, TreeShape& aShape);
+    // Van Emde Boas order of aHeight top levels of the subtree of aNode, and of the subtrees at aDepth under it.
+    static inline void vebOrder(NodeT* aNode, size_t aHeight, std::vector<NodeT*>& aOrder);
+    static inline void vebBottoms(NodeT* aNode, size_t aDepth, size_t aHeight, std::vector<NodeT*>& aOrder);
+
+    // Comparison of the item of aNode with aKey, by cached key prefixes first (see KeyNode).
+    // A less-only comparator takes two calls for compareNode(), so descents with it do one
+    // lessNode() per level and check the found node for equality at the end.
+    using Order = Comparison<Item, Comparator>;
+    using CheapThreeWay = std::integral_constant<bool, Order::CHEAP_THREE_WAY || HasKeyPrefix<NodeT>::value>;
+    template <class Key>
+    static int compareNode(const NodeT* aNode, const Key& aKey) { return compareNode(aNode, aKey, HasKeyPrefix<NodeT>()); }
+    template <class Key>
+    static int compareNode(const NodeT* aNode, const Key& aKey, std::false_type)
+    {
+        Stats::comparison();
+        return Order::compare(*objByNode(aNode), aKey);
+    }
+    template <class Key>
+    static inline int compareNode(const NodeT* aNode, const Key& aKey, std::true_type);
+    template <class Key>
+    static bool lessNode(const NodeT* aNode, const Key& aKey)
+    {
+        if (CheapThreeWay::value)
+            return compareNode(aNode, aKey) < 0;
+        Stats::comparison();
+        return Order::less(*objByNode(aNode), aKey);
+    }
+    template <class Key>
+    static bool greaterNode(const NodeT* aNode, const Key& aKey)
+    {
+        if (CheapThreeWay::value)
+            return compareNode(aNode, aKey) > 0;
+        Stats::comparison();
+        return Order::greater(*objByNode(aNode), aKey);
+    }
+    // Key prefixes are cached when items enter the tree; compiled out for nodes without m_KeyPrefix.
+    static void cacheKey(NodeT* aNode) { cacheKey(aNode, HasKeyPrefix<NodeT>()); }
+    static void cacheKey(NodeT*, std::false_type) {}
+    static void cacheKey(NodeT* aNode, std::true_type) { aNode->m_KeyPrefix = NodeT::KeyPrefix::of(*objByNode(aNode)); }
+    static bool isKeyCacheValid(const NodeT* aNode) { return isKeyCacheValid(aNode, HasKeyPrefix<NodeT>()); }
+    static bool isKeyCacheValid(const NodeT*, std::false_type) { return true; }
+    static bool isKeyCacheValid(const NodeT* aNode, std::true_type) { return aNode->m_KeyPrefix == NodeT::KeyPrefix::of(*objByNode(aNode)); }
+
+    // Subtree counters and aggregates; compiled out for nodes without m_Count and m_Aggregate.
+    static size_t countOf(const NodeT* aNode) { return nullptr == aNode ? 0 : aNode->m_Count; }
+    static void recount(NodeT* aNode) { recount(aNode, IsCounted<NodeT>()); reaggregate(aNode, IsAugmented<NodeT>()); }
+    static void recount(NodeT*, std::false_type) {}
+    static void recount(NodeT* aNode, std::true_type) { aNode->m_Count = 1 + countOf(aNode->getChild(0)) + countOf(aNode->getChild(1)); }
+    static void recountUpward(NodeT* aNode, bool aIncrease) { recountUpward(aNode, aIncrease, IsCounted<NodeT>()); }
+    static void recountUpward(NodeT*, bool, std::false_type) {}
+    static inline void recountUpward(NodeT* aNode, bool aIncrease, std::true_type);
+    static void recountPath(NodeT* aNode) { recountPath(aNode, IsCounted<NodeT>()); reaggregatePath(aNode); }
+    static void recountPath(NodeT*, std::false_type) {}
+    static void recountPath(NodeT* aNode, std::true_type) { for (; nullptr != aNode; aNode = aNode->getParent()) recount(aNode, std::true_type()); }
+    static bool isCountValid(const NodeT* aNode, size_t aSize) { return isCountValid(aNode, aSize, IsCounted<NodeT>()); }
+    static bool isCountValid(const NodeT*, size_t, std::false_type) { return true; }
+    static bool isCountValid(const NodeT* aNode, size_t aSize, std::true_type) { return aNode->m_Count == aSize; }
+    template <class N>
+    static inline typename N::Augmentation::Type aggregateOf(const N* aNode);
+    static void reaggregate(NodeT*, std::false_type) {}
+    static void reaggregate(NodeT* aNode, std::true_type) { aNode->m_Aggregate = aggregateOf(aNode); }
+    static void reaggregatePath(NodeT* aNode) { reaggregatePath(aNode, IsAugmented<NodeT>()); }
+    static void reaggregatePath(NodeT*, std::false_type) {}
+    static void reaggregatePath(NodeT* aNode, std::true_type) { for (; nullptr != aNode; aNode = aNode->getParent()) reaggregate(aNode, std::true_type()); }
+    static bool isAggregateValid(const NodeT* aNode) { return isAggregateValid(aNode, IsAugmented<NodeT>()); }
+    static bool isAggregateValid(const NodeT*, std::false_type) { return true; }
+    static bool isAggregateValid(const NodeT* aNode, std::true_type) { return aNode->m_Aggregate == aggregateOf(aNode); }
+    template <class Key, class T>
+    static inline T aggregateFrom(const NodeT* aNode, const Key& aFrom, T aInit);
+    template <class N, class Key, class Fn>
+    static inline void forEachOverlap(N* aNode, const Key& aLow, const Key& aHigh, Fn& aFn);
 };
 
+template <class Item, Node Item::*NodeMember, class Comparator = Default<Item>>
+using Tree = BasicTree<Item, Node, NodeMember, Comparator>;
+
+template <class Item, CountedNode Item::*NodeMember, class Comparator = Default<Item>>
+using CountedTree = BasicTree<Item, CountedNode, NodeMember, Comparator>;
+
+template <class Item, CompactNode Item::*NodeMember, class Comparator = Default<Item>>
+using CompactTree = BasicTree<Item, CompactNode, NodeMember, Comparator>;
+
+template <class Item, OffsetNode Item::*NodeMember, class Comparator = Default<Item>>
+using OffsetTree = BasicTree<Item, OffsetNode, NodeMember, Comparator>;
+
+template <class Item, class Prefix, KeyNode<Prefix> Item::*NodeMember, class Comparator = Default<Item>>
+using KeyTree = BasicTree<Item, KeyNode<Prefix>, NodeMember, Comparator>;
+
+template <class Item, Node Item::*NodeMember, class Comparator = Default<Item>>
+using MultiTree = BasicTree<Item, Node, NodeMember, Comparator, true>;
+
 //////////////////////////////////////////////////////////////////
 ////////////////////////// Implementaion /////////////////////////
 //////////////////////////////////////////////////////////////////
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-std::pair<typename Tree<Item, NodeMember, Comparator>::iterator, bool>
-Tree<Item, NodeMember, Comparator>::insert(Item& aItem)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+std::pair<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator, bool>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::insert(Item& aItem)
+{
+    return insertFrom(m_Root, aItem);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+std::pair<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator, bool>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::insert(const_iterator aHint, Item& aItem)
+{
+    // Max (min) node has no right (left) child, a new max (min) item becomes that child.
+    NodeT* sNode = &(aItem.*NodeMember);
+    if (nullptr != m_Max && (Multi ? !greaterNode(m_Max, aItem) : lessNode(m_Max, aItem)))
+    {
+        insertLeaf(m_Max, true, sNode);
+        return std::make_pair(iterator(sNode, this), true);
+    }
+    if (nullptr != m_Min && greaterNode(m_Min, aItem))
+    {
+        insertLeaf(m_Min, false, sNode);
+        return std::make_pair(iterator(sNode, this), true);
+    }
+    return insertFrom(climbToInsert(hintNode(aHint), aItem), aItem);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+std::pair<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator, bool>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::insertFrom(NodeT* aNode, Item& aItem, std::true_type)
 {
     // Search for a parent for the coming leaf node
-    Node** sParentPtr = &m_Root;
-    Node* sParent = m_Root;
+    NodeT* sParent = nullptr;
+    NodeT* sNext = aNode;
     bool sIsRight = false;
-    Node* sNode = &(aItem.*NodeMember);
-    bool sOneDirection[2] = {true, true};
-    while (nullptr != *sParentPtr)
+    while (nullptr != sNext)
     {
-        sParent = *sParentPtr;
-        int sCmp = Comparator::Compare(aItem, *objByNode(*sParentPtr));
+        sParent = sNext;
+        int sCmp = compareNode(sParent, aItem);
         if (0 == sCmp)
-            return std::make_pair(iterator(*sParentPtr), false);
-        sOneDirection[sCmp < 0] = false;
-        sIsRight = sCmp > 0;
-        sParentPtr = &((*sParentPtr)->m_Child)[sIsRight];
+            return std::make_pair(iterator(sParent, this), false);
+        sIsRight = sCmp < 0;
+        sNext = sParent->getChild(sIsRight);
     }
 
+    NodeT* sNode = &(aItem.*NodeMember);
+    insertLeaf(sParent, sIsRight, sNode);
+    return std::make_pair(iterator(sNode, this), true);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+std::pair<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator, bool>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::insertFrom(NodeT* aNode, Item& aItem, std::false_type)
+{
+    // Search for a parent for the coming leaf node, remembering the last node not less than aItem;
+    // aItem is a duplicate if that node is not bigger.
+    NodeT* sParent = nullptr;
+    NodeT* sNext = aNode;
+    NodeT* sBound = nullptr;
+    bool sIsRight = false;
+    while (nullptr != sNext)
+    {
+        sParent = sNext;
+        sIsRight = lessNode(sParent, aItem);
+        if (sIsRight)
+        {
+            sNext = sParent->getChild(1);
+        }
+        else
+        {
+            sBound = sParent;
+            sNext = sParent->getChild(0);
+        }
+    }
+    if (nullptr != sBound && !greaterNode(sBound, aItem))
+        return std::make_pair(iterator(sBound, this), false);
+
+    NodeT* sNode = &(aItem.*NodeMember);
+    insertLeaf(sParent, sIsRight, sNode);
+    return std::make_pair(iterator(sNode, this), true);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+std::pair<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator, bool>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::insertAfter(NodeT* aNode, Item& aItem)
+{
+    // Go right from the equal items, one comparison per level.
+    NodeT* sParent = nullptr;
+    NodeT* sNext = aNode;
+    bool sIsRight = false;
+    while (nullptr != sNext)
+    {
+        sParent = sNext;
+        sIsRight = !greaterNode(sParent, aItem);
+        sNext = sParent->getChild(sIsRight);
+    }
+
+    NodeT* sNode = &(aItem.*NodeMember);
+    insertLeaf(sParent, sIsRight, sNode);
+    return std::make_pair(iterator(sNode, this), true);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::insertLeaf(NodeT* sParent, bool sIsRight, NodeT* sNode)
+{
     // Insert the leaf node
-    sNode->m_Parent = sParent;
-    sNode->m_Child[0] = sNode->m_Child[1] = nullptr;
-    sNode->m_ChildBigger[0] = sNode->m_ChildBigger[1] = false;
-    sNode->m_IsRight = sIsRight;
+    cacheKey(sNode);
+    sNode->setParent(sParent);
+    sNode->setChild(0, nullptr);
+    sNode->setChild(1, nullptr);
+    sNode->setChildBigger(0, false);
+    sNode->setChildBigger(1, false);
+    sNode->setRight(sIsRight);
+    recount(sNode);
+    recountUpward(sParent, true);
 
     m_Size++;
-    *sParentPtr = sNode;
-    if (sOneDirection[0])
+    if (nullptr == sParent)
+        m_Root = sNode;
+    else
+        sParent->setChild(sIsRight, sNode);
+    reaggregatePath(sParent);
+    // The leaf is the new min (max) if it's the left (right) child of the old one.
+    if (nullptr == sParent || (!sIsRight && sParent == m_Min))
         m_Min = sNode;
-    if (sOneDirection[1])
+    if (nullptr == sParent || (sIsRight && sParent == m_Max))
         m_Max = sNode;
 
     // Rebalance if necessary
     rebalanceInsert(sNode);
-
-    return std::make_pair(iterator(sNode), true);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::erase(Item& aItem)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::erase(Item& aItem)
 {
     m_Size--;
-    Node* sNode = &(aItem.*NodeMember);
+    NodeT* sNode = &(aItem.*NodeMember);
 
     if (m_Min == sNode)
-        m_Min = nullptr != sNode->m_Child[1] ? sNode->m_Child[1] : sNode->m_Parent;
+        m_Min = nullptr != sNode->getChild(1) ? sNode->getChild(1) : sNode->getParent();
     if (m_Max == sNode)
-        m_Max = nullptr != sNode->m_Child[0] ? sNode->m_Child[0] : sNode->m_Parent;
+        m_Max = nullptr != sNode->getChild(0) ? sNode->getChild(0) : sNode->getParent();
 
     // A node from which rebalancing will start.
-    Node* sRebalanceNode = sNode->m_Parent;
+    NodeT* sRebalanceNode = sNode->getParent();
     // Which child of sRebalanceNode decreased its height.
-    bool sRebalanceRight = sNode->m_IsRight;
+    bool sRebalanceRight = sNode->isRight();
 
-    if (nullptr == sNode->m_Child[0] && nullptr == sNode->m_Child[1])
+    if (nullptr == sNode->getChild(0) && nullptr == sNode->getChild(1))
     {
         // Leaf. Just unlink it from parent; beware of the only root node.
-        if (nullptr == sNode->m_Parent)
+        recountUpward(sNode->getParent(), false);
+        if (nullptr == sNode->getParent())
             m_Root = nullptr;
         else
-            sNode->m_Parent->m_Child[sNode->m_IsRight] = nullptr;
+            sNode->getParent()->setChild(sNode->isRight(), nullptr);
     }
     else
     {
         // Not leaf. Find closest by value node from bigger subtree (sReplacement)
         // Remove sReplacement from the tree and then replace sNode with sReplacement.
-        bool sRight = sNode->m_ChildBigger[0];
+        bool sRight = sNode->isChildBigger(0);
         bool sLeft = !sRight;
 
-        Node* sReplacement = sNode->m_Child[sLeft];
-        while (nullptr != sReplacement->m_Child[sRight])
-            sReplacement = sReplacement->m_Child[sRight];
-        sRebalanceNode = sReplacement->m_Parent;
-        sRebalanceRight = sReplacement->m_IsRight;
-        if (nullptr != sReplacement->m_Child[sLeft])
+        NodeT* sReplacement = sNode->getChild(sLeft);
+        while (nullptr != sReplacement->getChild(sRight))
+            sReplacement = sReplacement->getChild(sRight);
+        sRebalanceNode = sReplacement->getParent();
+        sRebalanceRight = sReplacement->isRight();
+        recountUpward(sRebalanceNode, false);
+        if (nullptr != sReplacement->getChild(sLeft))
         {
             // Not leaf again. Good news is that left child is a leaf node.
-            assert(nullptr == sReplacement->m_Child[sLeft]->m_Child[0] &&
-                   nullptr == sReplacement->m_Child[sLeft]->m_Child[1]);
-            relinkParent(sReplacement, sReplacement->m_Child[sLeft]);
+            assert(nullptr == sReplacement->getChild(sLeft)->getChild(0) &&
+                   nullptr == sReplacement->getChild(sLeft)->getChild(1));
+            relinkParent(sReplacement, sReplacement->getChild(sLeft));
         }
         else
         {
             // Found leaf replacement. Just unlink it from parent.
-            sReplacement->m_Parent->m_Child[sReplacement->m_IsRight] = nullptr;
+            sReplacement->getParent()->setChild(sReplacement->isRight(), nullptr);
         }
 
         // We are about to replace sNode, check links.
         if (sRebalanceNode == sNode)
         {
             sRebalanceNode = sReplacement;
-            sReplacement->m_ChildBigger[0] = sReplacement->m_ChildBigger[1] = false;
+            sReplacement->setChildBigger(0, false);
+            sReplacement->setChildBigger(1, false);
         }
 
         // Replace sNode with sReplacement
-        *sReplacement = *sNode;
+        copyLinks(sReplacement, sNode);
         relink(sReplacement);
+        recount(sReplacement);
     }
 
+    reaggregatePath(sRebalanceNode);
     rebalanceErase(sRebalanceNode, sRebalanceRight);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::rebalanceInsert(Node* sNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Disposer>
+typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::erase(const_iterator aFirst, const_iterator aLast, Disposer aDisposer)
+{
+    size_t sErased = 0;
+    auto sDisposer = [&sErased, &aDisposer](Item& aItem) { sErased++; aDisposer(aItem); };
+    disposeSubTree(cutRange(const_cast<NodeT*>(aFirst.m_Node), const_cast<NodeT*>(aLast.m_Node)), sDisposer);
+    m_Size -= sErased;
+    return iterator(const_cast<NodeT*>(aLast.m_Node), this);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::erase(const_iterator aFirst, const_iterator aLast)
+{
+    // Counting is cheaper than the post-order walk with cutting links.
+    m_Size -= countRange(ConstRange(aFirst, aLast), IsCounted<NodeT>());
+    cutRange(const_cast<NodeT*>(aFirst.m_Node), const_cast<NodeT*>(aLast.m_Node));
+    return iterator(const_cast<NodeT*>(aLast.m_Node), this);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::cutRange(NodeT* aFirst, NodeT* aLast)
+{
+    // Returns the detached subtree of [aFirst, aLast), m_Size is left for the caller.
+    if (aFirst == aLast)
+        return nullptr;
+    NodeT* sBefore = traverse(aFirst, true);
+
+    // Positions, not keys: equal items of a multi tree may be on both sides of a bound.
+    // The second split cuts the head part left by the first one.
+    NodeT *sLeft, *sMiddle, *sRight = nullptr;
+    size_t sLeftHeight, sMiddleHeight, sRightHeight = 0;
+    if (nullptr != aLast)
+        splitBefore(aLast, sLeft, sLeftHeight, sRight, sRightHeight);
+    splitBefore(aFirst, sLeft, sLeftHeight, sMiddle, sMiddleHeight);
+
+    size_t sHeight;
+    m_Root = joinSubTrees(sLeft, sLeftHeight, sRight, sRightHeight, sHeight);
+    if (m_Min == aFirst)
+        m_Min = aLast;
+    if (nullptr == aLast)
+        m_Max = sBefore;
+    return sMiddle;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class ItemPtrItr>
+size_t BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::insertBatch(ItemPtrItr aFirst, ItemPtrItr aLast)
+{
+    size_t sCount = std::distance(aFirst, aLast);
+    // Equal items of a multi tree are inserted in the order of the batch.
+    if (Multi)
+        std::stable_sort(aFirst, aLast, itemPtrLess);
+    else
+        std::sort(aFirst, aLast, itemPtrLess);
+    size_t sDuplicates = 0;
+
+    if (sCount * BATCH_REBUILD_RATIO >= m_Size)
+    {
+        // Merge the batch with the items of the tree and rebuild it.
+        std::vector<Item*> sAll;
+        sAll.reserve(m_Size + sCount);
+        NodeT* sNode = m_Min;
+        for (ItemPtrItr sItr = aFirst; sItr != aLast; ++sItr)
+        {
+            while (nullptr != sNode && (Multi ? !greaterNode(sNode, **sItr) : lessNode(sNode, **sItr)))
+            {
+                sAll.push_back(objByNode(sNode));
+                sNode = traverse(sNode, false);
+            }
+            if (Multi)
+                sAll.push_back(*sItr);
+            else if ((nullptr != sNode && !greaterNode(sNode, **sItr)) ||
+                     (!sAll.empty() && !itemPtrLess(sAll.back(), *sItr)))
+                sDuplicates++;
+            else
+                sAll.push_back(*sItr);
+        }
+        for (; nullptr != sNode; sNode = traverse(sNode, false))
+            sAll.push_back(objByNode(sNode));
+        buildSorted(sAll.begin(), sAll.end());
+        return sDuplicates;
+    }
+
+    // Every next item is bigger than the previous one, search from the previous one.
+    NodeT* sFinger = m_Root;
+    for (ItemPtrItr sItr = aFirst; sItr != aLast; ++sItr)
+    {
+        std::pair<iterator, bool> sRes = insertFrom(climbToInsert(sFinger, **sItr), **sItr);
+        sFinger = sRes.first.m_Node;
+        if (!sRes.second)
+            sDuplicates++;
+    }
+    return sDuplicates;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class ItemPtrItr>
+size_t BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::eraseBatch(ItemPtrItr aFirst, ItemPtrItr aLast)
+{
+    size_t sCount = std::distance(aFirst, aLast);
+    // Items with equal keys of a multi tree can be told apart only by addresses.
+    if (Multi)
+        std::sort(aFirst, aLast, std::less<Item*>());
+    else
+        std::sort(aFirst, aLast, itemPtrLess);
+    size_t sDuplicates = 0;
+
+    if (sCount * BATCH_REBUILD_RATIO >= m_Size)
+    {
+        // Rebuild the tree from the items that are not in the batch.
+        std::vector<Item*> sRest;
+        sRest.reserve(m_Size);
+        ItemPtrItr sItr = aFirst;
+        for (NodeT* sNode = m_Min; nullptr != sNode; sNode = traverse(sNode, false))
+        {
+            Item* sItem = objByNode(sNode);
+            if (Multi)
+            {
+                if (std::binary_search(aFirst, aLast, sItem, std::less<Item*>()))
+                    continue;
+            }
+            else
+            {
+                while (sItr != aLast && itemPtrLess(*sItr, sItem))
+                    ++sItr;
+                if (sItr != aLast && *sItr == sItem)
+                    continue;
+            }
+            sRest.push_back(sItem);
+        }
+        sDuplicates = sCount - (m_Size - sRest.size());
+        buildSorted(sRest.begin(), sRest.end());
+        return sDuplicates;
+    }
+
+    // Erase in order, consequent items share the path to the root and stay in cache. A multi
+    // tree gets them in order of addresses instead, which only makes the duplicates adjacent.
+    Item* sPrev = nullptr;
+    for (ItemPtrItr sItr = aFirst; sItr != aLast; ++sItr)
+    {
+        if (*sItr == sPrev)
+        {
+            sDuplicates++;
+            continue;
+        }
+        sPrev = *sItr;
+        erase(*sPrev);
+    }
+    return sDuplicates;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::rebalanceInsert(NodeT* sNode)
 {
     // A child node sNode of sParent node has just increased its height. Rebalance it recursively.
-    while (nullptr != sNode->m_Parent)
+    Stats::rebalance();
+    while (nullptr != sNode->getParent())
     {
+        Stats::rebalanceStep();
         // Let's think that sNode is the right child of sParent.
         // Due to node implementation a mirror balancing will have the same code.
-        bool sRight = sNode->m_IsRight;
+        bool sRight = sNode->isRight();
         bool sLeft = !sRight;
-        Node* sParent = sNode->m_Parent;
+        NodeT* sParent = sNode->getParent();
 
-        if (sParent->m_ChildBigger[sLeft])
+        if (sParent->isChildBigger(sLeft))
         {
             // Another sibling of sNode was bigger. Now it's not.
-            sParent->m_ChildBigger[sLeft] = false;
+            sParent->setChildBigger(sLeft, false);
             // sParent did not increased its height. Nothing to do.
             return;
         }
-        else if (!sParent->m_ChildBigger[sRight])
+        else if (!sParent->isChildBigger(sRight))
         {
             // Well-balanced subtree sParent became not well balanced.
             // No rotation is needed, but sParent increased its height, so continue with it.
-            sParent->m_ChildBigger[sRight] = true;
+            sParent->setChildBigger(sRight, true);
             sNode = sParent;
             continue;
         }
 
-        // Note that in any case sNode grew because of just on its subtrees, not both.
-        assert(sNode->m_ChildBigger[0] != sNode->m_ChildBigger[1]);
+        // Note that after insertion sNode grew because of just one of its subtrees, not both.
+        // The only exception is a subtree attached by join, it may be balanced.
 
         // The right child of sParent has +2 height than the left. This must be fixed via rotation.
-        if (sNode->m_ChildBigger[sRight])
+        if (sNode->isChildBigger(sRight))
         {
             // Right child of sNode is bigger than left. Make 'single' rotation.
             /* On the pseudograffiti below (P) - sParent, (N) - sNode, (L),(C) and (R) - other nodes.
@@ -264,14 +1305,34 @@ void Tree<Item, NodeMember, Comparator>::rebalanceInsert(Node* sNode)
              *               /     \
              *              /_______\
              */
+            Stats::rotation(false);
             relinkParentSafe(sParent, sNode);
-            relinkChildSafe(sParent, sNode->m_Child[sLeft], sRight);
+            relinkChildSafe(sParent, sNode->getChild(sLeft), sRight);
             relinkChild(sNode, sParent, sLeft);
-            sNode->m_ChildBigger[0] = sNode->m_ChildBigger[1] = false;
-            sParent->m_ChildBigger[0] = sParent->m_ChildBigger[1] = false;
+            sNode->setChildBigger(0, false);
+            sNode->setChildBigger(1, false);
+            sParent->setChildBigger(0, false);
+            sParent->setChildBigger(1, false);
+            recount(sParent);
+            recount(sNode);
             // Note that we have just fixed the growth of subtree, so exit.
             return;
         }
+        else if (!sNode->isChildBigger(sLeft))
+        {
+            // sNode is balanced, it was attached by join. Make 'single' rotation as above,
+            // but now (C) is as high as (R), so (P) is right-bigger, (N) is left-bigger
+            // and the subtree is still one level higher than before.
+            Stats::rotation(false);
+            relinkParentSafe(sParent, sNode);
+            relinkChildSafe(sParent, sNode->getChild(sLeft), sRight);
+            relinkChild(sNode, sParent, sLeft);
+            sParent->setChildBigger(sRight, true);
+            sNode->setChildBigger(sLeft, true);
+            recount(sParent);
+            recount(sNode);
+            continue;
+        }
         else
         {
             // Left child of sNode is bigger than right. Make 'double' rotation.
@@ -304,53 +1365,59 @@ void Tree<Item, NodeMember, Comparator>::rebalanceInsert(Node* sNode)
              *             (C)
              */
             // Note that, like children of sNode, only one child of (C) grew
-            // OR (C) is a new node with both empty children.
+            // OR (C) is a new node with both empty children
+            // OR (C) is a balanced subtree that was attached under sNode by join.
 
-            Node* sCenter = sNode->m_Child[sLeft]; // (C) in the picture
-            assert((nullptr == sCenter->m_Child[0] && nullptr == sCenter->m_Child[1]) ||
-                   (sCenter->m_ChildBigger[0] != sCenter->m_ChildBigger[1]));
+            Stats::rotation(true);
+            NodeT* sCenter = sNode->getChild(sLeft); // (C) in the picture
             relinkParentSafe(sParent, sCenter);
-            relinkChildSafe(sParent, sCenter->m_Child[sLeft], sRight);
-            relinkChildSafe(sNode, sCenter->m_Child[sRight], sLeft);
+            relinkChildSafe(sParent, sCenter->getChild(sLeft), sRight);
+            relinkChildSafe(sNode, sCenter->getChild(sRight), sLeft);
             relinkChild(sCenter, sParent, sLeft);
             relinkChild(sCenter, sNode, sRight);
-            sParent->m_ChildBigger[sRight] = false;
-            sParent->m_ChildBigger[sLeft] = sCenter->m_ChildBigger[sRight];
-            sNode->m_ChildBigger[sLeft] = false;
-            sNode->m_ChildBigger[sRight] = sCenter->m_ChildBigger[sLeft];
-            sCenter->m_ChildBigger[0] = sCenter->m_ChildBigger[1] = false;
+            sParent->setChildBigger(sRight, false);
+            sParent->setChildBigger(sLeft, sCenter->isChildBigger(sRight));
+            sNode->setChildBigger(sLeft, false);
+            sNode->setChildBigger(sRight, sCenter->isChildBigger(sLeft));
+            sCenter->setChildBigger(0, false);
+            sCenter->setChildBigger(1, false);
+            recount(sParent);
+            recount(sNode);
+            recount(sCenter);
             // Note that we have just fixed the growth of subtree, so exit.
             return;
         }
     }
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::rebalanceErase(Node* sParent, bool sRight)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::rebalanceErase(NodeT* sParent, bool sRight)
 {
     // Let's think that right subtree of sParent became smaller.
     bool sLeft = !sRight;
+    Stats::rebalance();
     while (nullptr != sParent)
     {
-        if (sParent->m_ChildBigger[sRight])
+        Stats::rebalanceStep();
+        if (sParent->isChildBigger(sRight))
         {
             // That child subtree was bigger. Now it's not.
-            sParent->m_ChildBigger[sRight] = false;
-            sRight = sParent->m_IsRight;
+            sParent->setChildBigger(sRight, false);
+            sRight = sParent->isRight();
             sLeft = !sRight;
-            sParent = sParent->m_Parent;
+            sParent = sParent->getParent();
             continue;
         }
-        else if (!sParent->m_ChildBigger[sLeft])
+        else if (!sParent->isChildBigger(sLeft))
         {
             // sParent was well-balanced. Now it's not.
-            sParent->m_ChildBigger[sLeft] = true;
+            sParent->setChildBigger(sLeft, true);
             break;
         }
 
         // Now left subtree of sParent has +2 height that right. Need balance.
-        Node* sNode = sParent->m_Child[sLeft];
-        if (!sNode->m_ChildBigger[sRight])
+        NodeT* sNode = sParent->getChild(sLeft);
+        if (!sNode->isChildBigger(sRight))
         {
             // Right child of sNode is not bigger than left. Make 'single' rotation.
             /* On the pseudograffiti below (P) - sParent, (N) - sNode, (L),(C) and (R) - other nodes.
@@ -375,202 +1442,1003 @@ void Tree<Item, NodeMember, Comparator>::rebalanceErase(Node* sParent, bool sRig
              *     /     \  /     \                         /     \
              *    /_______\/_______\                       /_______\
              */
-            bool sNodeWasBalanced = !sNode->m_ChildBigger[sLeft];
+            Stats::rotation(false);
+            bool sNodeWasBalanced = !sNode->isChildBigger(sLeft);
             relinkParentSafe(sParent, sNode);
-            relinkChildSafe(sParent, sNode->m_Child[sRight], sLeft);
+            relinkChildSafe(sParent, sNode->getChild(sRight), sLeft);
             relinkChild(sNode, sParent, sRight);
-            sNode->m_ChildBigger[sLeft] = sParent->m_ChildBigger[sRight] = false;
-            sNode->m_ChildBigger[sRight] = sParent->m_ChildBigger[sLeft] = sNodeWasBalanced;
+            sNode->setChildBigger(sLeft, false);
+            sParent->setChildBigger(sRight, false);
+            sNode->setChildBigger(sRight, sNodeWasBalanced);
+            sParent->setChildBigger(sLeft, sNodeWasBalanced);
+            recount(sParent);
+            recount(sNode);
             if (sNodeWasBalanced)
                 return; // (2) Subtree height is unchanged.
-            sRight = sNode->m_IsRight;
+            sRight = sNode->isRight();
             sLeft = !sRight;
-            sParent = sNode->m_Parent;
+            sParent = sNode->getParent();
         }
         else
-        {
-            // Right child of sNode is bigger than left. Make 'double' rotation.
-            /* On the pseudograffiti below (P) - sParent, (N) - sNode, (L),(C),(C1),(C2) and (R) - other nodes.
-             *
-             *   (1)          (P)                            (C)
-             *              /     \                       /      \
-             *            (N)      (R)                (N)          (P)
-             *          /    \     / \     --->      /  \        /    \
-             *       (L)      (C) /___\            (L)  (C1)   (C2)   (R)
-             *       / \      / \                  / \   / \   / \    / \
-             *      /___\  (C1) (C2)              /___\ /___\ /___\  /___\
-             *            /  \  /  \
-             *           /____\/____\
-             *
-             *   (2)          (P)                            (C)
-             *              /     \                       /      \
-             *            (N)      (R)                (N)          (P)
-             *          /    \     / \     --->      /  \        /    \
-             *       (L)      (C) /___\            (L)  (C1)   (C2)   (R)
-             *       / \      / \                  / \  /__\   / \    / \
-             *      /___\  (C1) (C2)              /___\       /___\  /___\
-             *             /__\ /  \
-             *                 /____\
-             *
-             *   (3)          (P)                            (C)
-             *              /     \                       /      \
-             *            (N)      (R)                (N)          (P)
-             *          /    \     / \     --->      /  \        /    \
-             *       (L)      (C) /___\            (L)  (C1)   (C2)   (R)
-             *       / \      / \                  / \  /  \   /__\   / \
-             *      /___\  (C1) (C2)              /___\/____\        /___\
-             *            /  \  /__\
-             *           /____\
-             *
-             *   (4)          (P)                            (C)
-             *              /                             /      \
-             *            (N)              --->       (N)          (P)
-             *               \
-             *                (C)
-             */
-            Node* sCenter = sNode->m_Child[sRight]; // (C) in the picture
-            relinkParentSafe(sParent, sCenter);
-            relinkChildSafe(sParent, sCenter->m_Child[sRight], sLeft);
-            relinkChildSafe(sNode, sCenter->m_Child[sLeft], sRight);
-            relinkChild(sCenter, sParent, sRight);
-            relinkChild(sCenter, sNode, sLeft);
-            sParent->m_ChildBigger[sLeft] = sNode->m_ChildBigger[sRight] = false;
-            sParent->m_ChildBigger[sRight] = sCenter->m_ChildBigger[sLeft];
-            sNode->m_ChildBigger[sLeft] = sCenter->m_ChildBigger[sRight];
-            sCenter->m_ChildBigger[0] = sCenter->m_ChildBigger[1] = false;
+        {
+            // Right child of sNode is bigger than left. Make 'double' rotation.
+            /* On the pseudograffiti below (P) - sParent, (N) - sNode, (L),(C),(C1),(C2) and (R) - other nodes.
+             *
+             *   (1)          (P)                            (C)
+             *              /     \                       /      \
+             *            (N)      (R)                (N)          (P)
+             *          /    \     / \     --->      /  \        /    \
+             *       (L)      (C) /___\            (L)  (C1)   (C2)   (R)
+             *       / \      / \                  / \   / \   / \    / \
+             *      /___\  (C1) (C2)              /___\ /___\ /___\  /___\
+             *            /  \  /  \
+             *           /____\/____\
+             *
+             *   (2)          (P)                            (C)
+             *              /     \                       /      \
+             *            (N)      (R)                (N)          (P)
+             *          /    \     / \     --->      /  \        /    \
+             *       (L)      (C) /___\            (L)  (C1)   (C2)   (R)
+             *       / \      / \                  / \  /__\   / \    / \
+             *      /___\  (C1) (C2)              /___\       /___\  /___\
+             *             /__\ /  \
+             *                 /____\
+             *
+             *   (3)          (P)                            (C)
+             *              /     \                       /      \
+             *            (N)      (R)                (N)          (P)
+             *          /    \     / \     --->      /  \        /    \
+             *       (L)      (C) /___\            (L)  (C1)   (C2)   (R)
+             *       / \      / \                  / \  /  \   /__\   / \
+             *      /___\  (C1) (C2)              /___\/____\        /___\
+             *            /  \  /__\
+             *           /____\
+             *
+             *   (4)          (P)                            (C)
+             *              /                             /      \
+             *            (N)              --->       (N)          (P)
+             *               \
+             *                (C)
+             */
+            Stats::rotation(true);
+            NodeT* sCenter = sNode->getChild(sRight); // (C) in the picture
+            relinkParentSafe(sParent, sCenter);
+            relinkChildSafe(sParent, sCenter->getChild(sRight), sLeft);
+            relinkChildSafe(sNode, sCenter->getChild(sLeft), sRight);
+            relinkChild(sCenter, sParent, sRight);
+            relinkChild(sCenter, sNode, sLeft);
+            sParent->setChildBigger(sLeft, false);
+            sNode->setChildBigger(sRight, false);
+            sParent->setChildBigger(sRight, sCenter->isChildBigger(sLeft));
+            sNode->setChildBigger(sLeft, sCenter->isChildBigger(sRight));
+            sCenter->setChildBigger(0, false);
+            sCenter->setChildBigger(1, false);
+            recount(sParent);
+            recount(sNode);
+            recount(sCenter);
+
+            sRight = sCenter->isRight();
+            sLeft = !sRight;
+            sParent = sCenter->getParent();
+        }
+    }
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::replace(Item& aItem, Item& aNewItem)
+{
+    NodeT* sNode = &(aItem.*NodeMember);
+    NodeT* sNewNode = &(aNewItem.*NodeMember);
+    copyLinks(sNewNode, sNode);
+    relink(sNewNode);
+    cacheKey(sNewNode);
+    recount(sNewNode);
+    reaggregatePath(sNewNode);
+
+    if (m_Min == sNode)
+        m_Min = sNewNode;
+    if (m_Max == sNode)
+        m_Max = sNewNode;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+const Item* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::objByNode(const NodeT* aNode)
+{
+    const uintptr_t sOffset = reinterpret_cast<uintptr_t>(&(reinterpret_cast<const Item*>(0)->*NodeMember));
+    return reinterpret_cast<const Item*>(reinterpret_cast<const char*>(aNode) - sOffset);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+Item* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::objByNode(NodeT* aNode)
+{
+    return const_cast<Item*>(objByNode(const_cast<const NodeT*>(aNode)));
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+const Item* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::objByNodeSafe(const NodeT* aNode)
+{
+    return nullptr == aNode ? nullptr : objByNode(aNode);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+Item* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::objByNodeSafe(NodeT* aNode)
+{
+    return nullptr == aNode ? nullptr : objByNode(aNode);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+const NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::lookup(const NodeT* aNode, const Key& aKey, std::true_type)
+{
+    const NodeT* sNode = aNode;
+    size_t sDepth = 0;
+    while (nullptr != sNode)
+    {
+        sDepth++;
+        int sCmp = compareNode(sNode, aKey);
+        if (0 == sCmp)
+            break;
+        sNode = sNode->getChild(sCmp < 0);
+    }
+    Stats::lookup(sDepth);
+    return sNode;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+const NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::lookup(const NodeT* aNode, const Key& aKey, std::false_type)
+{
+    // Go down to a leaf to the first node not less than aKey, then check it for equality.
+    // The child is chosen by a branch rather than by an index computed from the comparison,
+    // so that loads of the next nodes do not wait for a slow comparison to complete.
+    const NodeT* sNode = aNode;
+    const NodeT* sRes = nullptr;
+    size_t sDepth = 0;
+    while (nullptr != sNode)
+    {
+        sDepth++;
+        if (lessNode(sNode, aKey))
+        {
+            sNode = sNode->getChild(1);
+        }
+        else
+        {
+            sRes = sNode;
+            sNode = sNode->getChild(0);
+        }
+    }
+    Stats::lookup(sDepth);
+    return nullptr != sRes && !greaterNode(sRes, aKey) ? sRes : nullptr;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+int BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::compareNode(const NodeT* aNode, const Key& aKey, std::true_type)
+{
+    using Prefix = typename NodeT::KeyPrefix;
+    typename Prefix::Type sPrefix = Prefix::of(aKey);
+    if (aNode->m_KeyPrefix != sPrefix)
+        return aNode->m_KeyPrefix < sPrefix ? -1 : 1;
+    if (Prefix::FULL)
+        return 0;
+    Stats::comparison();
+    return Order::compare(*objByNode(aNode), aKey);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class KeyItr, class Store>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::lookupBatch(KeyItr aKeys, size_t aCount, Store aStore) const
+{
+    // Every lane goes one level down per round; a lane that has found its node (or nullptr)
+    // takes the next key, a lane without keys left is removed by moving the last one in.
+    const NodeT* sNodes[FIND_BATCH_WIDTH];
+    size_t sKeys[FIND_BATCH_WIDTH];
+    size_t sDepths[FIND_BATCH_WIDTH]; // for Stats only, compiled out without them
+    size_t sLanes = 0;
+    size_t sNext = 0;
+    for (; sLanes < FIND_BATCH_WIDTH && sNext < aCount; sLanes++)
+    {
+        sNodes[sLanes] = m_Root;
+        sKeys[sLanes] = sNext++;
+        sDepths[sLanes] = 0;
+    }
+    while (sLanes > 0)
+    {
+        for (size_t i = 0; i < sLanes;)
+        {
+            const NodeT* sNode = sNodes[i];
+            if (nullptr != sNode)
+                sDepths[i]++;
+            int sCmp = nullptr == sNode ? 0 : compareNode(sNode, aKeys[sKeys[i]]);
+            if (0 != sCmp)
+            {
+                sNode = sNode->getChild(sCmp < 0);
+                prefetch(sNode);
+                sNodes[i++] = sNode;
+                continue;
+            }
+            Stats::lookup(sDepths[i]);
+            aStore(sKeys[i], sNode);
+            if (sNext < aCount)
+            {
+                sNodes[i] = m_Root;
+                sDepths[i] = 0;
+                sKeys[i++] = sNext++;
+                continue;
+            }
+            sLanes--;
+            sNodes[i] = sNodes[sLanes];
+            sKeys[i] = sKeys[sLanes];
+            sDepths[i] = sDepths[sLanes];
+        }
+    }
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::climb(NodeT* aNode, const Key& aKey)
+{
+    // Go up while the parent is on the same side of aKey as aNode; then aKey is within
+    // the range of aNode's subtree (or it's the parent that is equal to aKey).
+    if (nullptr == aNode)
+        return nullptr;
+    int sCmp = compareNode(aNode, aKey);
+    if (0 == sCmp)
+        return aNode;
+    bool sKeyIsBigger = sCmp < 0;
+    while (nullptr != aNode->getParent())
+    {
+        sCmp = compareNode(aNode->getParent(), aKey);
+        if (0 == sCmp)
+            return aNode->getParent();
+        if ((sCmp < 0) != sKeyIsBigger)
+            break;
+        aNode = aNode->getParent();
+    }
+    return aNode;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::climbAfter(NodeT* aNode, const Item& aItem)
+{
+    // As climb(), with the equal items on the left of aItem.
+    if (nullptr == aNode)
+        return nullptr;
+    bool sItemIsBigger = !greaterNode(aNode, aItem);
+    while (nullptr != aNode->getParent() && !greaterNode(aNode->getParent(), aItem) == sItemIsBigger)
+        aNode = aNode->getParent();
+    return aNode;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+size_t BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::countRange(ConstRange aRange, std::false_type)
+{
+    size_t sRes = 0;
+    for (; aRange.first != aRange.second; ++aRange.first)
+        sRes++;
+    return sRes;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+const NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::lookupBound(const Key& aKey, bool aUpper) const
+{
+    // The last node where the search turned left is the answer.
+    const NodeT* sNode = m_Root;
+    const NodeT* sRes = nullptr;
+    while (nullptr != sNode)
+    {
+        bool sRight = aUpper ? !greaterNode(sNode, aKey) : lessNode(sNode, aKey);
+        if (!sRight)
+            sRes = sNode;
+        sNode = sNode->getChild(sRight);
+    }
+    return sRes;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::lookupBound(const Key& aKey, bool aUpper)
+{
+    const BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>* sConstThis = this;
+    return const_cast<NodeT*>(sConstThis->lookupBound(aKey, aUpper));
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+std::pair<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::const_iterator,
+          typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::const_iterator>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::equal_range(const Key& aKey) const
+{
+    // Unique keys make the range either empty or the lower bound and its successor.
+    const NodeT* sFirst = lookupBound(aKey, false);
+    const NodeT* sLast = sFirst;
+    if (Multi)
+        sLast = lookupBound(aKey, true);
+    else if (nullptr != sFirst && !greaterNode(sFirst, aKey))
+        sLast = traverse(sFirst, false);
+    return std::make_pair(const_iterator(sFirst, this), const_iterator(sLast, this));
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+std::pair<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator,
+          typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::equal_range(const Key& aKey)
+{
+    NodeT* sFirst = lookupBound(aKey, false);
+    NodeT* sLast = sFirst;
+    if (Multi)
+        sLast = lookupBound(aKey, true);
+    else if (nullptr != sFirst && !greaterNode(sFirst, aKey))
+        sLast = traverse(sFirst, false);
+    return std::make_pair(iterator(sFirst, this), iterator(sLast, this));
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class ItemItr>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::buildSorted(ItemItr aFirst, ItemItr aLast)
+{
+    clear();
+    size_t sCount = std::distance(aFirst, aLast);
+    if (0 == sCount)
+        return;
+
+    size_t sHeight;
+    m_Root = buildSubTree(aFirst, sCount, sHeight);
+    detach(m_Root);
+    m_Size = sCount;
+    updateMinMax();
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::updateMinMax()
+{
+    m_Min = m_Max = m_Root;
+    while (nullptr != m_Min && nullptr != m_Min->getChild(0))
+        m_Min = m_Min->getChild(0);
+    while (nullptr != m_Max && nullptr != m_Max->getChild(1))
+        m_Max = m_Max->getChild(1);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::join(Item& aPivot, BasicTree& aRight)
+{
+    NodeT* sPivot = &(aPivot.*NodeMember);
+    cacheKey(sPivot);
+    assert(nullptr == m_Max || (Multi ? !Order::less(aPivot, *objByNode(m_Max)) : Order::less(*objByNode(m_Max), aPivot)));
+    assert(nullptr == aRight.m_Min || (Multi ? !Order::less(*objByNode(aRight.m_Min), aPivot) : Order::less(aPivot, *objByNode(aRight.m_Min))));
+
+    size_t sHeight;
+    NodeT* sLeftMin = m_Min;
+    m_Root = joinSubTrees(m_Root, heightOf(m_Root), sPivot, aRight.m_Root, heightOf(aRight.m_Root), sHeight);
+    m_Min = nullptr != sLeftMin ? sLeftMin : sPivot;
+    m_Max = nullptr != aRight.m_Max ? aRight.m_Max : sPivot;
+    m_Size += 1 + aRight.m_Size;
+    aRight.clear();
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::join(BasicTree& aRight)
+{
+    if (0 == aRight.m_Size)
+        return;
+    Item& sPivot = *objByNode(aRight.m_Min);
+    aRight.erase(sPivot);
+    join(sPivot, aRight);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::split(const Key& aKey, BasicTree& aRight)
+{
+    assert(0 == aRight.m_Size);
+    NodeT *sLeft, *sRight;
+    size_t sLeftHeight, sRightHeight;
+    NodeT* sEqual = splitSubTree(m_Root, heightOf(m_Root), aKey, sLeft, sLeftHeight, sRight, sRightHeight);
+    if (nullptr != sEqual)
+        sRight = joinSubTrees(nullptr, 0, sEqual, sRight, sRightHeight, sRightHeight);
+
+    size_t sLeftSize = leftSizeOf(sLeft, sRight, m_Size);
+    aRight.m_Root = sRight;
+    aRight.m_Size = m_Size - sLeftSize;
+    aRight.updateMinMax();
+    m_Root = sLeft;
+    m_Size = sLeftSize;
+    updateMinMax();
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::merge(BasicTree& aOther)
+{
+    if (this == &aOther)
+        return;
+    std::vector<Item*> sDuplicates;
+    size_t sHeight;
+    m_Root = mergeSubTrees(m_Root, heightOf(m_Root), aOther.m_Root, heightOf(aOther.m_Root), sDuplicates, sHeight);
+    m_Size += aOther.m_Size - sDuplicates.size();
+    updateMinMax();
+    aOther.buildSorted(sDuplicates.begin(), sDuplicates.end());
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Disposer>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::intersect(const BasicTree& aOther, Disposer aDisposer)
+{
+    static_assert(!Multi, "intersect() is not defined for a multi tree");
+    if (this == &aOther)
+        return;
+    size_t sKept = 0;
+    size_t sHeight;
+    m_Root = intersectSubTrees(m_Root, heightOf(m_Root), aOther.m_Root, heightOf(aOther.m_Root), aDisposer, sKept, sHeight);
+    m_Size = sKept;
+    updateMinMax();
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Disposer>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::subtract(const BasicTree& aOther, Disposer aDisposer)
+{
+    static_assert(!Multi, "subtract() is not defined for a multi tree");
+    size_t sRemoved = 0;
+    size_t sHeight;
+    if (this == &aOther)
+    {
+        disposeSubTree(m_Root, aDisposer);
+        clear();
+        return;
+    }
+    m_Root = subtractSubTrees(m_Root, heightOf(m_Root), aOther.m_Root, heightOf(aOther.m_Root), aDisposer, sRemoved, sHeight);
+    m_Size -= sRemoved;
+    updateMinMax();
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+size_t BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::heightOf(const NodeT* aNode)
+{
+    // Follow the bigger child down to a leaf.
+    size_t sHeight = 0;
+    for (; nullptr != aNode; aNode = aNode->getChild(aNode->isChildBigger(1)))
+        sHeight++;
+    return sHeight;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::joinSubTrees(NodeT* aLeft, size_t aLeftHeight, NodeT* aPivot,
+                                                                    NodeT* aRight, size_t aRightHeight, size_t& aHeight)
+{
+    if (aLeftHeight <= aRightHeight + 1 && aRightHeight <= aLeftHeight + 1)
+    {
+        // Heights are close enough, aPivot becomes the root.
+        detach(aPivot);
+        relinkChildSafe(aPivot, aLeft, false);
+        relinkChildSafe(aPivot, aRight, true);
+        aPivot->setChildBigger(0, aLeftHeight > aRightHeight);
+        aPivot->setChildBigger(1, aRightHeight > aLeftHeight);
+        recount(aPivot);
+        aHeight = 1 + (aLeftHeight > aRightHeight ? aLeftHeight : aRightHeight);
+        return aPivot;
+    }
+
+    // Let's think that the left subtree is higher. Go down along its right spine to a
+    // subtree (S) that is as high as aRight or one level higher, and put aPivot instead.
+    // On the picture below (A) and (B) - nodes of the spine, children are listed left first:
+    /*
+     *   (A)                          (A)
+     *    |-- ...                      |-- ...
+     *    `-- (B)          --->        `-- (B)
+     *         |-- ...                      |-- ...
+     *         `-- (S)                      `-- (aPivot)
+     *                                           |-- (S)
+     *                                           `-- (aRight)
+     */
+    // The subtree of aPivot is one level higher than (S) was, that is the same as insertion.
+    bool sRight = aLeftHeight > aRightHeight;
+    bool sLeft = !sRight;
+    NodeT* sHigh = sRight ? aLeft : aRight;
+    NodeT* sLow = sRight ? aRight : aLeft;
+    size_t sLowHeight = sRight ? aRightHeight : aLeftHeight;
+    size_t sHeight = sRight ? aLeftHeight : aRightHeight;
+
+    NodeT* sParent = nullptr;
+    NodeT* sNode = sHigh;
+    while (sHeight > sLowHeight + 1)
+    {
+        sParent = sNode;
+        sHeight = childHeight(sNode, sHeight, sRight);
+        sNode = sNode->getChild(sRight);
+    }
+
+    relinkChildSafe(aPivot, sNode, sLeft);
+    relinkChildSafe(aPivot, sLow, sRight);
+    aPivot->setChildBigger(sLeft, sHeight > sLowHeight);
+    aPivot->setChildBigger(sRight, false);
+    recount(aPivot);
+    relinkChild(sParent, aPivot, sRight);
+    recountPath(sParent);
+
+    // The whole tree grows only if the growth reaches the root when it was balanced.
+    bool sWasBalanced = !sHigh->isChildBigger(0) && !sHigh->isChildBigger(1);
+    m_Root = sHigh;
+    rebalanceInsert(aPivot);
+    bool sGrew = sWasBalanced && m_Root == sHigh && (sHigh->isChildBigger(0) || sHigh->isChildBigger(1));
+    aHeight = (sRight ? aLeftHeight : aRightHeight) + (sGrew ? 1 : 0);
+    assert(aHeight == heightOf(m_Root));
+    return m_Root;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::joinSubTrees(NodeT* aLeft, size_t aLeftHeight,
+                                                                    NodeT* aRight, size_t aRightHeight, size_t& aHeight)
+{
+    if (nullptr == aLeft || nullptr == aRight)
+    {
+        aHeight = nullptr == aLeft ? aRightHeight : aLeftHeight;
+        return nullptr == aLeft ? aRight : aLeft;
+    }
+    NodeT* sRest;
+    size_t sRestHeight;
+    NodeT* sPivot = splitMin(aRight, aRightHeight, sRest, sRestHeight);
+    return joinSubTrees(aLeft, aLeftHeight, sPivot, sRest, sRestHeight, aHeight);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::splitMin(NodeT* aNode, size_t aHeight, NodeT*& aRest, size_t& aRestHeight)
+{
+    NodeT* sLeft = aNode->getChild(0);
+    NodeT* sRight = aNode->getChild(1);
+    if (nullptr == sLeft)
+    {
+        detach(sRight);
+        aRest = sRight;
+        aRestHeight = aHeight - 1;
+        return aNode;
+    }
+    size_t sLeftHeight = childHeight(aNode, aHeight, false);
+    size_t sRightHeight = childHeight(aNode, aHeight, true);
+    detach(sLeft);
+    detach(sRight);
+    NodeT* sLeftRest;
+    size_t sLeftRestHeight;
+    NodeT* sMin = splitMin(sLeft, sLeftHeight, sLeftRest, sLeftRestHeight);
+    aRest = joinSubTrees(sLeftRest, sLeftRestHeight, aNode, sRight, sRightHeight, aRestHeight);
+    return sMin;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::splitBefore(NodeT* aNode, NodeT*& aLeft, size_t& aLeftHeight, NodeT*& aRight, size_t& aRightHeight)
+{
+    // Splits the tree of aNode into the nodes before it and the rest, going up from aNode:
+    // every ancestor is joined with its other subtree to the part on its side.
+    size_t sHeight = heightOf(aNode);
+    NodeT* sParent = aNode->getParent();
+    bool sIsRight = aNode->isRight();
+    aLeft = aNode->getChild(0);
+    aRight = aNode->getChild(1);
+    aLeftHeight = childHeight(aNode, sHeight, false);
+    aRightHeight = childHeight(aNode, sHeight, true);
+    detach(aLeft);
+    detach(aRight);
+    aRight = joinSubTrees(nullptr, 0, aNode, aRight, aRightHeight, aRightHeight);
+
+    while (nullptr != sParent)
+    {
+        NodeT* sNode = sParent;
+        sHeight += sNode->isChildBigger(!sIsRight) ? 2 : 1;
+        sParent = sNode->getParent();
+        bool sNodeIsRight = sNode->isRight();
+        NodeT* sOther = sNode->getChild(!sIsRight);
+        size_t sOtherHeight = childHeight(sNode, sHeight, !sIsRight);
+        detach(sOther);
+        if (sIsRight)
+            aLeft = joinSubTrees(sOther, sOtherHeight, sNode, aLeft, aLeftHeight, aLeftHeight);
+        else
+            aRight = joinSubTrees(aRight, aRightHeight, sNode, sOther, sOtherHeight, aRightHeight);
+        sIsRight = sNodeIsRight;
+    }
+}
 
-            sRight = sCenter->m_IsRight;
-            sLeft = !sRight;
-            sParent = sCenter->m_Parent;
-        }
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::splitSubTree(NodeT* aNode, size_t aHeight, const Key& aKey,
+                                                                    NodeT*& aLeft, size_t& aLeftHeight,
+                                                                    NodeT*& aRight, size_t& aRightHeight, bool aEqualLeft)
+{
+    // Splits into items less than aKey, equal to aKey (returned) and bigger than aKey.
+    if (nullptr == aNode)
+    {
+        aLeft = aRight = nullptr;
+        aLeftHeight = aRightHeight = 0;
+        return nullptr;
+    }
+    NodeT* sLeft = aNode->getChild(0);
+    NodeT* sRight = aNode->getChild(1);
+    size_t sLeftHeight = childHeight(aNode, aHeight, false);
+    size_t sRightHeight = childHeight(aNode, aHeight, true);
+    detach(sLeft);
+    detach(sRight);
+
+    // Equal items may be in both subtrees of a multi tree; they all go to the aEqualLeft part.
+    int sCmp = !Multi ? compareNode(aNode, aKey) :
+               (aEqualLeft ? !greaterNode(aNode, aKey) : lessNode(aNode, aKey)) ? -1 : 1;
+    if (0 == sCmp)
+    {
+        aLeft = sLeft;
+        aLeftHeight = sLeftHeight;
+        aRight = sRight;
+        aRightHeight = sRightHeight;
+        return aNode;
+    }
+
+    NodeT* sMiddle;
+    size_t sMiddleHeight;
+    NodeT* sEqual;
+    if (sCmp < 0)
+    {
+        sEqual = splitSubTree(sRight, sRightHeight, aKey, sMiddle, sMiddleHeight, aRight, aRightHeight, aEqualLeft);
+        aLeft = joinSubTrees(sLeft, sLeftHeight, aNode, sMiddle, sMiddleHeight, aLeftHeight);
+    }
+    else
+    {
+        sEqual = splitSubTree(sLeft, sLeftHeight, aKey, aLeft, aLeftHeight, sMiddle, sMiddleHeight, aEqualLeft);
+        aRight = joinSubTrees(sMiddle, sMiddleHeight, aNode, sRight, sRightHeight, aRightHeight);
     }
+    return sEqual;
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::replace(Item& aItem, Item& aNewItem)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::mergeSubTrees(NodeT* aNode, size_t aHeight,
+                                                                     NodeT* aOther, size_t aOtherHeight,
+                                                                     std::vector<Item*>& aDuplicates, size_t& aResHeight)
 {
-    Node* sNode = &(aItem.*NodeMember);
-    Node* sNewNode = &(aNewItem.*NodeMember);
-    *sNewNode = *sNode;
-    relink(sNewNode);
+    // Split aNode by the root of aOther and merge the parts with its children.
+    if (nullptr == aOther || nullptr == aNode)
+    {
+        detach(aOther);
+        aResHeight = nullptr == aOther ? aHeight : aOtherHeight;
+        return nullptr == aOther ? aNode : aOther;
+    }
+    NodeT* sOtherLeft = aOther->getChild(0);
+    NodeT* sOtherRight = aOther->getChild(1);
+    size_t sOtherLeftHeight = childHeight(aOther, aOtherHeight, false);
+    size_t sOtherRightHeight = childHeight(aOther, aOtherHeight, true);
 
-    if (m_Min == sNode)
-        m_Min = sNewNode;
-    if (m_Max == sNode)
-        m_Max = sNewNode;
+    NodeT *sLeft, *sRight;
+    size_t sLeftHeight, sRightHeight;
+    // Items of aOther go after the equal ones of a multi tree.
+    NodeT* sEqual = splitSubTree(aNode, aHeight, *objByNode(aOther), sLeft, sLeftHeight, sRight, sRightHeight, Multi);
+    sLeft = mergeSubTrees(sLeft, sLeftHeight, sOtherLeft, sOtherLeftHeight, aDuplicates, sLeftHeight);
+    NodeT* sPivot = aOther;
+    if (nullptr != sEqual)
+    {
+        aDuplicates.push_back(objByNode(aOther));
+        sPivot = sEqual;
+    }
+    sRight = mergeSubTrees(sRight, sRightHeight, sOtherRight, sOtherRightHeight, aDuplicates, sRightHeight);
+    return joinSubTrees(sLeft, sLeftHeight, sPivot, sRight, sRightHeight, aResHeight);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-const Item* Tree<Item, NodeMember, Comparator>::objByNode(const Node* aNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Disposer>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::intersectSubTrees(NodeT* aNode, size_t aHeight,
+                                                                         const NodeT* aOther, size_t aOtherHeight,
+                                                                         Disposer& aDisposer, size_t& aKept, size_t& aResHeight)
 {
-    const uintptr_t sOffset = reinterpret_cast<uintptr_t>(&(reinterpret_cast<const Item*>(0)->*NodeMember));
-    return reinterpret_cast<const Item*>(reinterpret_cast<const char*>(aNode) - sOffset);
+    aResHeight = 0;
+    if (nullptr == aNode)
+        return nullptr;
+    if (nullptr == aOther)
+    {
+        disposeSubTree(aNode, aDisposer);
+        return nullptr;
+    }
+
+    NodeT *sLeft, *sRight;
+    size_t sLeftHeight, sRightHeight;
+    NodeT* sEqual = splitSubTree(aNode, aHeight, *objByNode(aOther), sLeft, sLeftHeight, sRight, sRightHeight);
+    sLeft = intersectSubTrees(sLeft, sLeftHeight, aOther->getChild(0), childHeight(aOther, aOtherHeight, false),
+                              aDisposer, aKept, sLeftHeight);
+    sRight = intersectSubTrees(sRight, sRightHeight, aOther->getChild(1), childHeight(aOther, aOtherHeight, true),
+                               aDisposer, aKept, sRightHeight);
+    if (nullptr == sEqual)
+        return joinSubTrees(sLeft, sLeftHeight, sRight, sRightHeight, aResHeight);
+    aKept++;
+    return joinSubTrees(sLeft, sLeftHeight, sEqual, sRight, sRightHeight, aResHeight);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-Item* Tree<Item, NodeMember, Comparator>::objByNode(Node* aNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Disposer>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::subtractSubTrees(NodeT* aNode, size_t aHeight,
+                                                                        const NodeT* aOther, size_t aOtherHeight,
+                                                                        Disposer& aDisposer, size_t& aRemoved, size_t& aResHeight)
 {
-    return const_cast<Item*>(objByNode(const_cast<const Node*>(aNode)));
+    if (nullptr == aNode || nullptr == aOther)
+    {
+        aResHeight = aHeight;
+        return aNode;
+    }
+
+    NodeT *sLeft, *sRight;
+    size_t sLeftHeight, sRightHeight;
+    NodeT* sEqual = splitSubTree(aNode, aHeight, *objByNode(aOther), sLeft, sLeftHeight, sRight, sRightHeight);
+    sLeft = subtractSubTrees(sLeft, sLeftHeight, aOther->getChild(0), childHeight(aOther, aOtherHeight, false),
+                             aDisposer, aRemoved, sLeftHeight);
+    sRight = subtractSubTrees(sRight, sRightHeight, aOther->getChild(1), childHeight(aOther, aOtherHeight, true),
+                              aDisposer, aRemoved, sRightHeight);
+    if (nullptr != sEqual)
+    {
+        aRemoved++;
+        aDisposer(*objByNode(sEqual));
+    }
+    return joinSubTrees(sLeft, sLeftHeight, sRight, sRightHeight, aResHeight);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-const Item* Tree<Item, NodeMember, Comparator>::objByNodeSafe(const Node* aNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Disposer>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::disposeSubTree(NodeT* aNode, Disposer& aDisposer)
 {
-    return nullptr == aNode ? nullptr : objByNode(aNode);
+    // Post-order via parent links: go down to a leaf, cut it off and dispose, continue from its parent.
+    while (nullptr != aNode)
+    {
+        while (nullptr != aNode->getChild(0) || nullptr != aNode->getChild(1))
+            aNode = aNode->getChild(nullptr == aNode->getChild(0));
+        NodeT* sParent = aNode->getParent();
+        if (nullptr != sParent)
+            sParent->setChild(aNode->isRight(), nullptr);
+        aDisposer(*objByNode(aNode));
+        aNode = sParent;
+    }
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-Item* Tree<Item, NodeMember, Comparator>::objByNodeSafe(Node* aNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+size_t BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::leftSizeOf(const NodeT* aLeft, const NodeT* aRight, size_t aTotal, std::false_type)
 {
-    return nullptr == aNode ? nullptr : objByNode(aNode);
+    // Walk both trees simultaneously until the smaller one ends.
+    while (nullptr != aLeft && nullptr != aLeft->getChild(0))
+        aLeft = aLeft->getChild(0);
+    while (nullptr != aRight && nullptr != aRight->getChild(0))
+        aRight = aRight->getChild(0);
+    size_t sCount = 0;
+    while (nullptr != aLeft && nullptr != aRight)
+    {
+        aLeft = traverse(aLeft, false);
+        aRight = traverse(aRight, false);
+        sCount++;
+    }
+    return nullptr == aLeft ? sCount : aTotal - sCount;
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-template <class Key>
-const Node* Tree<Item, NodeMember, Comparator>::lookup(const Key& aKey) const
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class ItemItr>
+NodeT* BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::buildSubTree(ItemItr& aItr, size_t aCount, size_t& aHeight)
 {
-    const Node* sNode = m_Root;
-    while (nullptr != sNode)
+    // In-order: left half, the middle item, right half. The right half is never smaller,
+    // so it is the only one that can be higher (by one). Parent link is set by the caller.
+    if (0 == aCount)
     {
-        int sCmp = Comparator::Compare(*objByNode(sNode), aKey);
-        if (0 == sCmp)
-            break;
-        sNode = sNode->m_Child[sCmp < 0];
+        aHeight = 0;
+        return nullptr;
     }
+    size_t sLeftCount = (aCount - 1) / 2;
+    size_t sLeftHeight, sRightHeight;
+    NodeT* sLeft = buildSubTree(aItr, sLeftCount, sLeftHeight);
+    NodeT* sNode = &(itemOf(*aItr).*NodeMember);
+    cacheKey(sNode);
+    ++aItr;
+    NodeT* sRight = buildSubTree(aItr, aCount - 1 - sLeftCount, sRightHeight);
+
+    relinkChildSafe(sNode, sLeft, false);
+    relinkChildSafe(sNode, sRight, true);
+    sNode->setChildBigger(0, false);
+    sNode->setChildBigger(1, sRightHeight > sLeftHeight);
+    recount(sNode);
+    aHeight = sRightHeight + 1;
     return sNode;
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-template <class Key>
-Node* Tree<Item, NodeMember, Comparator>::lookup(const Key& aKey)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::rebase(ptrdiff_t aDelta)
+{
+    static_assert(NodeT::POSITION_INDEPENDENT, "rebase() requires position independent nodes");
+    NodeT** sNodes[] = {&m_Root, &m_Min, &m_Max};
+    for (NodeT** sNode : sNodes)
+    {
+        if (nullptr != *sNode)
+            *sNode = reinterpret_cast<NodeT*>(reinterpret_cast<char*>(*sNode) + aDelta);
+    }
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::copyLinks(NodeT* aTo, const NodeT* aFrom)
 {
-    const Tree<Item, NodeMember, Comparator>* sConstThis = this;
-    return const_cast<Node*>(sConstThis->lookup(aKey));
+    // Not a plain copy: links may be relative to the node itself.
+    aTo->setParent(aFrom->getParent());
+    aTo->setChild(0, aFrom->getChild(0));
+    aTo->setChild(1, aFrom->getChild(1));
+    aTo->setChildBigger(0, aFrom->isChildBigger(0));
+    aTo->setChildBigger(1, aFrom->isChildBigger(1));
+    aTo->setRight(aFrom->isRight());
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::relink(Node* aNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::relink(NodeT* aNode)
 {
-    if (nullptr != aNode->m_Parent)
-        aNode->m_Parent->m_Child[aNode->m_IsRight] = aNode;
+    if (nullptr != aNode->getParent())
+        aNode->getParent()->setChild(aNode->isRight(), aNode);
     else
         m_Root = aNode;
-    if (nullptr != aNode->m_Child[0])
-        aNode->m_Child[0]->m_Parent = aNode;
-    if (nullptr != aNode->m_Child[1])
-        aNode->m_Child[1]->m_Parent = aNode;
+    if (nullptr != aNode->getChild(0))
+        aNode->getChild(0)->setParent(aNode);
+    if (nullptr != aNode->getChild(1))
+        aNode->getChild(1)->setParent(aNode);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::relinkParent(Node* aOldNode, Node* aNewNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::relinkParent(NodeT* aOldNode, NodeT* aNewNode)
 {
-    aNewNode->m_Parent = aOldNode->m_Parent;
-    aNewNode->m_IsRight = aOldNode->m_IsRight;
-    aNewNode->m_Parent->m_Child[aNewNode->m_IsRight] = aNewNode;
+    aNewNode->setParent(aOldNode->getParent());
+    aNewNode->setRight(aOldNode->isRight());
+    aNewNode->getParent()->setChild(aNewNode->isRight(), aNewNode);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::relinkParentSafe(Node* aOldNode, Node* aNewNode)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::relinkParentSafe(NodeT* aOldNode, NodeT* aNewNode)
 {
-    aNewNode->m_Parent = aOldNode->m_Parent;
-    aNewNode->m_IsRight = aOldNode->m_IsRight;
-    if (nullptr != aNewNode->m_Parent)
-        aNewNode->m_Parent->m_Child[aNewNode->m_IsRight] = aNewNode;
+    aNewNode->setParent(aOldNode->getParent());
+    aNewNode->setRight(aOldNode->isRight());
+    if (nullptr != aNewNode->getParent())
+        aNewNode->getParent()->setChild(aNewNode->isRight(), aNewNode);
     else
         m_Root = aNewNode;
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::relinkChild(Node* aNewParent, Node* aNewChild, bool aRight)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::relinkChild(NodeT* aNewParent, NodeT* aNewChild, bool aRight)
 {
-    aNewParent->m_Child[aRight] = aNewChild;
-    aNewChild->m_Parent = aNewParent;
-    aNewChild->m_IsRight = aRight;
+    aNewParent->setChild(aRight, aNewChild);
+    aNewChild->setParent(aNewParent);
+    aNewChild->setRight(aRight);
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-void Tree<Item, NodeMember, Comparator>::relinkChildSafe(Node* aNewParent, Node* aNewChild, bool aRight)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::relinkChildSafe(NodeT* aNewParent, NodeT* aNewChild, bool aRight)
 {
-    aNewParent->m_Child[aRight] = aNewChild;
+    aNewParent->setChild(aRight, aNewChild);
     if (nullptr != aNewChild)
     {
-        aNewChild->m_Parent = aNewParent;
-        aNewChild->m_IsRight = aRight;
+        aNewChild->setParent(aNewParent);
+        aNewChild->setRight(aRight);
+    }
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Fn>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::parallelForEach(size_t aThreads, Fn aFn) const
+{
+    std::vector<Piece> sPieces = cutPieces(aThreads);
+    runParallel(aThreads, sPieces.size(), [&sPieces, &aFn](size_t aIndex) { forEachInPiece(sPieces[aIndex], aFn); });
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Fn>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::parallelForEach(size_t aThreads, Fn aFn)
+{
+    const_cast<const BasicTree*>(this)->parallelForEach(aThreads, [&aFn](const Item& aItem) { aFn(const_cast<Item&>(aItem)); });
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class T, class Fold, class Combine>
+T BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::parallelReduce(size_t aThreads, T aInit, Fold aFold, Combine aCombine) const
+{
+    // Every piece has its own result; wrapped to have no packed std::vector<bool>.
+    struct Result
+    {
+        T m_Value;
+    };
+    std::vector<Piece> sPieces = cutPieces(aThreads);
+    std::vector<Result> sResults(sPieces.size(), Result{aInit});
+    runParallel(aThreads, sPieces.size(), [&](size_t aIndex)
+    {
+        T& sValue = sResults[aIndex].m_Value;
+        auto sFold = [&sValue, &aFold](const Item& aItem) { sValue = aFold(sValue, aItem); };
+        forEachInPiece(sPieces[aIndex], sFold);
+    });
+    T sRes = aInit;
+    for (Result& sResult : sResults)
+        sRes = aCombine(sRes, sResult.m_Value);
+    return sRes;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::cutPieces(const NodeT* aNode, size_t aHeight, size_t aMaxHeight,
+                                                               std::vector<Piece>& aPieces) const
+{
+    if (nullptr == aNode)
+        return;
+    if (aHeight <= aMaxHeight)
+    {
+        aPieces.emplace_back(aNode, true);
+        return;
+    }
+    cutPieces(aNode->getChild(0), childHeight(aNode, aHeight, false), aMaxHeight, aPieces);
+    aPieces.emplace_back(aNode, false);
+    cutPieces(aNode->getChild(1), childHeight(aNode, aHeight, true), aMaxHeight, aPieces);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+std::vector<typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::Piece>
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::cutPieces(size_t aThreads) const
+{
+    // A subtree of height h has about 2^h items; k levels above the cut there are 2^k subtrees.
+    size_t sHeight = heightOf(m_Root);
+    size_t sMaxHeight = sHeight;
+    for (size_t sCount = 1; sMaxHeight > 1 && sCount < aThreads * PIECES_PER_THREAD; sCount *= 2)
+        sMaxHeight--;
+    std::vector<Piece> sPieces;
+    cutPieces(m_Root, sHeight, sMaxHeight, sPieces);
+    return sPieces;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Fn>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::forEachInPiece(const Piece& aPiece, Fn& aFn)
+{
+    if (aPiece.second)
+        forEachInSubTree(aPiece.first, aFn);
+    else
+        aFn(*objByNode(aPiece.first));
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Fn>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::forEachInSubTree(const NodeT* aNode, Fn& aFn)
+{
+    // In-order with a stack of nodes whose right subtrees are pending, no parent links are read.
+    const NodeT* sStack[sizeof(size_t) * 8 * 3 / 2];
+    size_t sDepth = 0;
+    while (true)
+    {
+        for (; nullptr != aNode; aNode = aNode->getChild(0))
+            sStack[sDepth++] = aNode;
+        if (0 == sDepth)
+            return;
+        aNode = sStack[--sDepth];
+        aFn(*objByNode(aNode));
+        aNode = aNode->getChild(1);
     }
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-int Tree<Item, NodeMember, Comparator>::selfCheck() const
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Fn>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::runParallel(size_t aThreads, size_t aCount, Fn aFn)
+{
+    // Call aFn(i) for every i < aCount; the next index is taken by the first free thread.
+    std::atomic<size_t> sNext(0);
+    auto sWork = [&sNext, &aFn, aCount]()
+    {
+        for (size_t i = sNext++; i < aCount; i = sNext++)
+            aFn(i);
+    };
+    std::vector<std::thread> sThreads;
+    for (size_t i = 1; i < std::min(aThreads, aCount); i++)
+        sThreads.emplace_back(sWork);
+    sWork();
+    for (std::thread& sThread : sThreads)
+        sThread.join();
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+int BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::selfCheck() const
 {
     size_t sHeight, sSize;
     int sRes = checkSubTree(m_Root, sHeight, sSize);
     if (size() != sSize)
         sRes |= 1 << 0;
-    const Node *sMin = m_Root, *sMax = m_Root;
-    while (nullptr != sMin && nullptr != sMin->m_Child[0])
-        sMin = sMin->m_Child[0];
-    while (nullptr != sMax && nullptr != sMax->m_Child[1])
-        sMax = sMax->m_Child[1];
+    const NodeT *sMin = m_Root, *sMax = m_Root;
+    while (nullptr != sMin && nullptr != sMin->getChild(0))
+        sMin = sMin->getChild(0);
+    while (nullptr != sMax && nullptr != sMax->getChild(1))
+        sMax = sMax->getChild(1);
     if (sMin != m_Min)
         sRes |= 1 << 1;
     if (sMax != m_Max)
@@ -578,8 +2446,125 @@ int Tree<Item, NodeMember, Comparator>::selfCheck() const
     return sRes;
 }
 
-template <class Item, Node Item::*NodeMember, class Comparator>
-int Tree<Item, NodeMember, Comparator>::checkSubTree(const Node* aNode, size_t& aHeight, size_t& aSize) const
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Relocate, class Disposer>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::relayout(Placement aPlacement, Relocate aRelocate, Disposer aDisposer)
+{
+    std::vector<NodeT*> sOrder;
+    sOrder.reserve(m_Size);
+    if (VAN_EMDE_BOAS == aPlacement)
+    {
+        vebOrder(m_Root, heightOf(m_Root), sOrder);
+    }
+    else if (nullptr != m_Root)
+    {
+        sOrder.push_back(m_Root);
+        for (size_t i = 0; i < sOrder.size(); i++)
+        {
+            for (bool sRight : {false, true})
+            {
+                if (nullptr != sOrder[i]->getChild(sRight))
+                    sOrder.push_back(sOrder[i]->getChild(sRight));
+            }
+        }
+    }
+    assert(sOrder.size() == m_Size);
+
+    // As replace(), but the aggregates of the ancestors stay the same.
+    for (NodeT* sNode : sOrder)
+    {
+        Item& sOldItem = *objByNode(sNode);
+        NodeT* sNewNode = &(aRelocate(sOldItem).*NodeMember);
+        copyLinks(sNewNode, sNode);
+        relink(sNewNode);
+        cacheKey(sNewNode);
+        recount(sNewNode);
+        if (m_Min == sNode)
+            m_Min = sNewNode;
+        if (m_Max == sNode)
+            m_Max = sNewNode;
+        aDisposer(sOldItem);
+    }
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::vebOrder(NodeT* aNode, size_t aHeight, std::vector<NodeT*>& aOrder)
+{
+    if (nullptr == aNode)
+        return;
+    if (1 == aHeight)
+    {
+        aOrder.push_back(aNode);
+        return;
+    }
+    size_t sTopHeight = aHeight / 2;
+    vebOrder(aNode, sTopHeight, aOrder);
+    vebBottoms(aNode, sTopHeight, aHeight - sTopHeight, aOrder);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::vebBottoms(NodeT* aNode, size_t aDepth, size_t aHeight, std::vector<NodeT*>& aOrder)
+{
+    if (nullptr == aNode)
+        return;
+    if (0 == aDepth)
+    {
+        vebOrder(aNode, aHeight, aOrder);
+        return;
+    }
+    vebBottoms(aNode->getChild(0), aDepth - 1, aHeight, aOrder);
+    vebBottoms(aNode->getChild(1), aDepth - 1, aHeight, aOrder);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+TreeShape BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::shape() const
+{
+    TreeShape sShape;
+    sShape.m_Size = m_Size;
+    shapeSubTree(m_Root, 0, sShape);
+    sShape.m_Height = sShape.m_Levels.size();
+    while (m_Size >> sShape.m_MinHeight)
+        sShape.m_MinHeight++;
+    // The sparsest AVL tree of height h has F(h) = F(h - 1) + F(h - 2) + 1 nodes.
+    for (size_t sPrev = 0, sNodes = 1; sNodes <= m_Size; sShape.m_MaxHeight++)
+    {
+        size_t sNext = sNodes + sPrev + 1;
+        sPrev = sNodes;
+        sNodes = sNext;
+    }
+    return sShape;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::shapeSubTree(const NodeT* aNode, size_t aDepth, TreeShape& aShape)
+{
+    for (; nullptr != aNode; aNode = aNode->getChild(1), aDepth++)
+    {
+        if (aShape.m_Levels.size() == aDepth)
+            aShape.m_Levels.push_back(0);
+        aShape.m_Levels[aDepth]++;
+        aShape.m_TotalDepth += aDepth + 1;
+        if (aNode->isChildBigger(0))
+            aShape.m_LeftHeavy++;
+        else if (aNode->isChildBigger(1))
+            aShape.m_RightHeavy++;
+        else
+            aShape.m_Balanced++;
+        for (bool sRight : {false, true})
+        {
+            uintptr_t sParent = reinterpret_cast<uintptr_t>(aNode);
+            uintptr_t sChild = reinterpret_cast<uintptr_t>(aNode->getChild(sRight));
+            if (0 == sChild)
+                continue;
+            aShape.m_LineCrossings += sParent / TreeShape::CACHE_LINE != sChild / TreeShape::CACHE_LINE;
+            aShape.m_PageCrossings += sParent / TreeShape::PAGE != sChild / TreeShape::PAGE;
+        }
+        shapeSubTree(aNode->getChild(0), aDepth + 1, aShape);
+    }
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+int BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::checkSubTree(const NodeT* aNode, size_t& aHeight, size_t& aSize) const
 {
     if (nullptr == aNode)
     {
@@ -589,59 +2574,65 @@ int Tree<Item, NodeMember, Comparator>::checkSubTree(const Node* aNode, size_t&
     }
 
     int sRes = 0;
-    if (nullptr != aNode->m_Child[0] && aNode != aNode->m_Child[0]->m_Parent)
+    if (nullptr != aNode->getChild(0) && aNode != aNode->getChild(0)->getParent())
         sRes |= 1 << 4;
-    if (nullptr != aNode->m_Child[1] && aNode != aNode->m_Child[1]->m_Parent)
+    if (nullptr != aNode->getChild(1) && aNode != aNode->getChild(1)->getParent())
         sRes |= 1 << 5;
-    if (nullptr != aNode->m_Child[0] && aNode->m_Child[0]->m_IsRight)
+    if (nullptr != aNode->getChild(0) && aNode->getChild(0)->isRight())
         sRes |= 1 << 6;
-    if (nullptr != aNode->m_Child[1] && !aNode->m_Child[1]->m_IsRight)
+    if (nullptr != aNode->getChild(1) && !aNode->getChild(1)->isRight())
         sRes |= 1 << 7;
 
-    if (nullptr != aNode->m_Child[0])
+    if (nullptr != aNode->getChild(0))
     {
-        int sCmp = Comparator::Compare(*objByNode(aNode->m_Child[0]), *objByNode(aNode));
-        if (sCmp == 0)
+        int sCmp = Order::compare(*objByNode(aNode->getChild(0)), *objByNode(aNode));
+        if (sCmp == 0 && !Multi)
             sRes |= 1 << 8;
         else if (sCmp > 0)
             sRes |= 1 << 9;
     }
-    if (nullptr != aNode->m_Child[1])
+    if (nullptr != aNode->getChild(1))
     {
-        int sCmp = Comparator::Compare(*objByNode(aNode), *objByNode(aNode->m_Child[1]));
-        if (sCmp == 0)
+        int sCmp = Order::compare(*objByNode(aNode), *objByNode(aNode->getChild(1)));
+        if (sCmp == 0 && !Multi)
             sRes |= 1 << 10;
         else if (sCmp > 0)
             sRes |= 1 << 11;
     }
 
     size_t sHeight0, sHeight1, sSize0, sSize1;
-    sRes |= checkSubTree(aNode->m_Child[0], sHeight0, sSize0);
-    sRes |= checkSubTree(aNode->m_Child[1], sHeight1, sSize1);
+    sRes |= checkSubTree(aNode->getChild(0), sHeight0, sSize0);
+    sRes |= checkSubTree(aNode->getChild(1), sHeight1, sSize1);
     aHeight = 1 + (sHeight0 > sHeight1 ? sHeight0 : sHeight1);
     aSize = 1 + sSize0 + sSize1;
+    if (!isCountValid(aNode, aSize))
+        sRes |= 1 << 20;
+    if (!isKeyCacheValid(aNode))
+        sRes |= 1 << 21;
+    if (!isAggregateValid(aNode))
+        sRes |= 1 << 22;
 
     if (sHeight0 == sHeight1)
     {
-        if (aNode->m_ChildBigger[0])
+        if (aNode->isChildBigger(0))
             sRes |= 1 << 12;
-        if (aNode->m_ChildBigger[1])
+        if (aNode->isChildBigger(1))
             sRes |= 1 << 13;
     }
     else if (sHeight0 > sHeight1)
     {
         // Left is bigger
-        if (!aNode->m_ChildBigger[0])
+        if (!aNode->isChildBigger(0))
             sRes |= 1 << 14;
-        if (aNode->m_ChildBigger[1])
+        if (aNode->isChildBigger(1))
             sRes |= 1 << 15;
     }
     else
     {
         // Right is bigger
-        if (aNode->m_ChildBigger[0])
+        if (aNode->isChildBigger(0))
             sRes |= 1 << 16;
-        if (!aNode->m_ChildBigger[1])
+        if (!aNode->isChildBigger(1))
             sRes |= 1 << 17;
     }
     if (sHeight0 > sHeight1 + 1)
@@ -657,32 +2648,187 @@ int Tree<Item, NodeMember, Comparator>::checkSubTree(const Node* aNode, size_t&
     return sRes;
 }
 
-const Node* traverse(const Node* aNode, bool aBackward)
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::const_iterator
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::select(size_t aIndex) const
+{
+    static_assert(IsCounted<NodeT>::value, "select() requires counted nodes");
+    const NodeT* sNode = m_Root;
+    while (nullptr != sNode)
+    {
+        size_t sLeftCount = countOf(sNode->getChild(0));
+        if (aIndex == sLeftCount)
+            break;
+        bool sRight = aIndex > sLeftCount;
+        if (sRight)
+            aIndex -= sLeftCount + 1;
+        sNode = sNode->getChild(sRight);
+    }
+    return const_iterator(sNode, this);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+typename BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::iterator
+BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::select(size_t aIndex)
+{
+    const BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>* sConstThis = this;
+    return iterator(const_cast<NodeT*>(sConstThis->select(aIndex).m_Node), this);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+size_t BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::rank(const Item& aItem) const
+{
+    static_assert(IsCounted<NodeT>::value, "rank() requires counted nodes");
+    // Everything in the left subtree is less, plus every left sibling subtree on the way up.
+    const NodeT* sNode = &(aItem.*NodeMember);
+    size_t sRes = countOf(sNode->getChild(0));
+    for (; nullptr != sNode->getParent(); sNode = sNode->getParent())
+    {
+        if (sNode->isRight())
+            sRes += countOf(sNode->getParent()->getChild(0)) + 1;
+    }
+    return sRes;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+size_t BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::rank(const_iterator aItr) const
+{
+    return nullptr == aItr.m_Node ? m_Size : rank(*aItr);
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key, class T>
+T BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::aggregate(const Key& aFrom, const Key& aTo, T aInit) const
+{
+    static_assert(IsAugmented<NodeT>::value, "aggregate() requires augmented nodes");
+    using Augment = typename NodeT::Augmentation;
+    // Go down to the first node in the range; the range is the part of its left subtree from
+    // aFrom, the node itself and the part of its right subtree before aTo.
+    const NodeT* sNode = m_Root;
+    while (nullptr != sNode)
+    {
+        if (lessNode(sNode, aFrom))
+            sNode = sNode->getChild(1);
+        else if (!lessNode(sNode, aTo))
+            sNode = sNode->getChild(0);
+        else
+            break;
+    }
+    if (nullptr == sNode)
+        return aInit;
+
+    T sRes = aggregateFrom(sNode->getChild(0), aFrom, aInit);
+    sRes = Augment::combine(sRes, Augment::of(*objByNode(sNode)));
+    for (sNode = sNode->getChild(1); nullptr != sNode; )
+    {
+        if (!lessNode(sNode, aTo))
+        {
+            sNode = sNode->getChild(0);
+            continue;
+        }
+        if (nullptr != sNode->getChild(0))
+            sRes = Augment::combine(sRes, sNode->getChild(0)->m_Aggregate);
+        sRes = Augment::combine(sRes, Augment::of(*objByNode(sNode)));
+        sNode = sNode->getChild(1);
+    }
+    return sRes;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class N>
+typename N::Augmentation::Type BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::aggregateOf(const N* aNode)
+{
+    using Augment = typename N::Augmentation;
+    typename Augment::Type sRes = Augment::of(*objByNode(aNode));
+    if (nullptr != aNode->getChild(0))
+        sRes = Augment::combine(aNode->getChild(0)->m_Aggregate, sRes);
+    if (nullptr != aNode->getChild(1))
+        sRes = Augment::combine(sRes, aNode->getChild(1)->m_Aggregate);
+    return sRes;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class Key, class T>
+T BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::aggregateFrom(const NodeT* aNode, const Key& aFrom, T aInit)
+{
+    // aInit combined with the items of the subtree not less than aFrom.
+    using Augment = typename NodeT::Augmentation;
+    while (nullptr != aNode && lessNode(aNode, aFrom))
+        aNode = aNode->getChild(1);
+    if (nullptr == aNode)
+        return aInit;
+    T sRes = aggregateFrom(aNode->getChild(0), aFrom, aInit);
+    sRes = Augment::combine(sRes, Augment::of(*objByNode(aNode)));
+    if (nullptr != aNode->getChild(1))
+        sRes = Augment::combine(sRes, aNode->getChild(1)->m_Aggregate);
+    return sRes;
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+template <class N, class Key, class Fn>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::forEachOverlap(N* aNode, const Key& aLow, const Key& aHigh, Fn& aFn)
+{
+    static_assert(IsAugmented<NodeT>::value, "forEachOverlap() requires augmented nodes");
+    // Subtrees that end not after aLow are skipped; nothing from aHigh on overlaps.
+    while (nullptr != aNode && aLow < aNode->m_Aggregate)
+    {
+        forEachOverlap(static_cast<N*>(aNode->getChild(0)), aLow, aHigh, aFn);
+        if (!lessNode(aNode, aHigh))
+            return;
+        if (aLow < NodeT::Augmentation::of(*objByNode(aNode)))
+            aFn(*objByNode(aNode));
+        aNode = aNode->getChild(1);
+    }
+}
+
+template <class Item, class NodeT, NodeT Item::*NodeMember, class Comparator, bool Multi, class Stats>
+void BasicTree<Item, NodeT, NodeMember, Comparator, Multi, Stats>::recountUpward(NodeT* aNode, bool aIncrease, std::true_type)
+{
+    for (; nullptr != aNode; aNode = aNode->getParent())
+    {
+        if (aIncrease)
+            aNode->m_Count++;
+        else
+            aNode->m_Count--;
+    }
+}
+
+inline double TreeStats::averageLookupDepth() const
+{
+    size_t sSum = 0;
+    for (size_t i = 0; i < DEPTH_LIMIT; i++)
+        sSum += i * m_LookupDepth[i];
+    return 0 == m_Lookups ? 0 : double(sSum) / m_Lookups;
+}
+
+template <class NodeT>
+const NodeT* traverse(const NodeT* aNode, bool aBackward)
 {
     // Let's think that traverse is always left-to-right
     bool sLeft = aBackward;
     bool sRight = !aBackward;
 
-    if (nullptr != aNode->m_Child[sRight])
+    if (nullptr != aNode->getChild(sRight))
     {
-        aNode = aNode->m_Child[sRight];
-        while (nullptr != aNode->m_Child[sLeft])
-            aNode = aNode->m_Child[sLeft];
+        aNode = aNode->getChild(sRight);
+        while (nullptr != aNode->getChild(sLeft))
+            aNode = aNode->getChild(sLeft);
         return aNode;
     }
 
     while (true)
     {
-        bool sParentBigger = aNode->m_IsRight == sLeft;
-        aNode = aNode->m_Parent;
+        bool sParentBigger = aNode->isRight() == sLeft;
+        aNode = aNode->getParent();
         if (nullptr == aNode || sParentBigger)
             return aNode;
     }
 }
 
-Node* traverse(Node* aNode, bool aBackward)
+template <class NodeT>
+NodeT* traverse(NodeT* aNode, bool aBackward)
 {
-    return const_cast<Node*>(traverse(const_cast<const Node*>(aNode), aBackward));
+    return const_cast<NodeT*>(traverse(const_cast<const NodeT*>(aNode), aBackward));
 }
 
 } // namespace Avl
\ No newline at end of file
@@ -1,8 +1,21 @@
 #include <AvlTree.hpp>
+#include <AvlSingleWriterTree.hpp>
+#include <AvlConcurrentTree.hpp>
+#include <AvlShardedTree.hpp>
+#include <AvlFrozenTree.hpp>
+#include <AvlMap.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
 #include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 // Helpers
 static size_t SideEffect = 0;
@@ -52,6 +65,13 @@ static size_t simpleReset()
     return sRes;
 }
 
+static void memory(const char* aText, size_t aCount)
+{
+    size_t sBytes = simpleReset();
+    std::cout << aText << " memory: " << sBytes / 1024 << "kB, "
+              << (0 == aCount ? 0 : sBytes / aCount) << " bytes per element" << std::endl;
+}
+
 static void checkpoint(const char* aText, size_t aOpCount)
 {
     using namespace std::chrono;
@@ -66,6 +86,16 @@ static void checkpoint(const char* aText, size_t aOpCount)
     was = now;
 }
 
+template <class Tree>
+static void shape(const char* aText, const Tree& aTree)
+{
+    Avl::TreeShape sShape = aTree.shape();
+    std::cout << aText << " shape: height " << sShape.m_Height << " (" << sShape.m_MinHeight << " to "
+              << sShape.m_MaxHeight << "), average depth " << sShape.averageDepth() << ", links across cache lines "
+              << 100 * sShape.lineCrossingRate() << "%, across pages " << 100 * sShape.pageCrossingRate() << "%" << std::endl;
+    checkpoint("", 0);
+}
+
 // Avl tree with size_t key
 struct Test
 {
@@ -90,6 +120,7 @@ static void alv_test()
         sTree.insert(*t);
     }
     checkpoint("AVL insert", COUNT);
+    shape("AVL sequential", sTree);
 
     for (size_t i = 0; i < COUNT; i++)
     {
@@ -109,7 +140,34 @@ static void alv_test()
     }
     checkpoint("AVL erase", COUNT);
 
-    std::cout << "AVL memory: " << simpleReset() / 1024 << "kB" << std::endl;
+    memory("AVL", COUNT);
+
+    Test* sSorted = static_cast<Test*>(simpleAlloc(COUNT * sizeof(Test)));
+    for (size_t i = 0; i < COUNT; i++)
+        sSorted[i].m_Value = i;
+    checkpoint("", 0);
+    sTree.buildSorted(sSorted, sSorted + COUNT);
+    checkpoint("AVL build sorted", COUNT);
+    sTree.clear();
+    simpleReset();
+
+    checkpoint("", 0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        Test* t = simpleAlloc<Test>();
+        t->m_Value = i;
+        sTree.insert(sTree.end(), *t);
+    }
+    checkpoint("AVL hinted insert", COUNT);
+
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        Tree_t::iterator itr = sTree.find(sTree.begin(), i);
+        SideEffect ^= itr->m_Value;
+        sTree.erase(*itr);
+    }
+    checkpoint("AVL hinted find+erase", COUNT);
+    simpleReset();
 
     srand(0);
     for (size_t i = 0; i < COUNT; i++)
@@ -119,6 +177,7 @@ static void alv_test()
         sTree.insert(*t);
     }
     checkpoint("AVL rand insert", COUNT);
+    shape("AVL random", sTree);
 
     srand(0);
     for (size_t i = 0; i < COUNT; i++)
@@ -128,12 +187,62 @@ static void alv_test()
     }
     checkpoint("AVL rand find", COUNT);
 
+    {
+        srand(0);
+        std::vector<size_t> sKeys(COUNT);
+        for (size_t& sKey : sKeys)
+            sKey = rand();
+        std::vector<Tree_t::iterator> sFound(COUNT, sTree.end());
+        checkpoint("", 0);
+        sTree.findBatch(sKeys.begin(), COUNT, sFound.begin());
+        for (Tree_t::iterator sItr : sFound)
+            SideEffect ^= sItr->m_Value;
+        checkpoint("AVL rand findBatch", COUNT);
+    }
+
+    srand(1);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        Tree_t::iterator itr = sTree.lower_bound(val);
+        if (itr != sTree.end())
+            SideEffect ^= itr->m_Value;
+    }
+    checkpoint("AVL rand lower_bound", COUNT);
+
     for (Test& t : sTree)
     {
         SideEffect ^= t.m_Value;
     }
     checkpoint("AVL iteration", COUNT);
 
+    for (Tree_t::reverse_iterator itr = sTree.rbegin(); itr != sTree.rend(); ++itr)
+    {
+        SideEffect ^= itr->m_Value;
+    }
+    checkpoint("AVL reverse iteration", COUNT);
+
+    for (Tree_t::stack_iterator itr = sTree.stack_begin(); itr != sTree.stack_end(); ++itr)
+    {
+        SideEffect ^= itr->m_Value;
+    }
+    checkpoint("AVL stack iteration", COUNT);
+
+    for (Tree_t::postorder_iterator itr = sTree.postorder_begin(); itr != sTree.postorder_end(); ++itr)
+    {
+        SideEffect ^= itr->m_Value;
+    }
+    checkpoint("AVL post-order iteration", COUNT);
+
+    for (size_t sThreads = 1; sThreads <= 8; sThreads *= 2)
+    {
+        SideEffect ^= sTree.parallelReduce(sThreads, static_cast<size_t>(0),
+                                           [](size_t aRes, const Test& t) { return aRes ^ t.m_Value; },
+                                           [](size_t aLeft, size_t aRight) { return aLeft ^ aRight; });
+        std::string sText = "AVL parallel reduce " + std::to_string(sThreads) + " threads";
+        checkpoint(sText.c_str(), COUNT);
+    }
+
     srand(0);
     for (size_t i = 0; i < COUNT; i++)
     {
@@ -144,7 +253,921 @@ static void alv_test()
     }
     checkpoint("AVL rand erase", COUNT);
 
-    std::cout << "AVL memory: " << simpleReset() / 1024 << "kB" << std::endl;
+    memory("AVL", COUNT);
+
+    const size_t BATCH = 1024;
+    std::vector<Test*> sBatch(BATCH);
+    std::vector<Test*> sAll;
+    sAll.reserve(COUNT);
+    srand(0);
+    for (size_t i = 0; i < COUNT; i += BATCH)
+    {
+        for (size_t j = 0; j < BATCH; j++)
+        {
+            sBatch[j] = simpleAlloc<Test>();
+            sBatch[j]->m_Value = rand();
+        }
+        SideEffect += sTree.insertBatch(sBatch.begin(), sBatch.end());
+    }
+    checkpoint("AVL rand insert batch", COUNT);
+
+    for (Test& t : sTree)
+        sAll.push_back(&t);
+    std::random_shuffle(sAll.begin(), sAll.end());
+    checkpoint("", 0);
+    for (size_t i = 0; i < sAll.size(); i += BATCH)
+    {
+        std::vector<Test*>::iterator sEnd = sAll.begin() + std::min(i + BATCH, sAll.size());
+        SideEffect += sTree.eraseBatch(sAll.begin() + i, sEnd);
+    }
+    checkpoint("AVL rand erase batch", sAll.size());
+
+    memory("AVL", COUNT);
+}
+
+// Erase of ranges at once against erasing their items one by one
+static void range_erase_test()
+{
+    const size_t RANGE_COUNT = COUNT / 4;
+    const size_t RANGE = 1024;
+    std::vector<Test> sItems(RANGE_COUNT);
+    for (size_t i = 0; i < RANGE_COUNT; i++)
+        sItems[i].m_Value = i;
+    Tree_t sTree;
+
+    // Every other range, so that the ranges are in the middle of the tree.
+    sTree.buildSorted(sItems.begin(), sItems.end());
+    checkpoint("", 0);
+    for (size_t i = 0; i < RANGE_COUNT; i += 2 * RANGE)
+    {
+        sTree.erase(sTree.find(i), sTree.find(i + RANGE));
+    }
+    checkpoint("AVL range erase", RANGE_COUNT / 2);
+
+    sTree.buildSorted(sItems.begin(), sItems.end());
+    checkpoint("", 0);
+    for (size_t i = 0; i < RANGE_COUNT; i += 2 * RANGE)
+    {
+        Tree_t::iterator itr = sTree.find(i);
+        for (size_t j = 0; j < RANGE; j++)
+            sTree.erase(*itr++);
+    }
+    checkpoint("AVL erase of the same items", RANGE_COUNT / 2);
+
+    sTree.clearAndDispose([](Test& t) { SideEffect ^= t.m_Value; });
+    checkpoint("AVL clear and dispose", RANGE_COUNT / 2);
+}
+
+// Random finds in a tree churned by erases and inserts, before and after relayout()
+static void relayout_test()
+{
+    const size_t SIZE = COUNT / 4;
+    Tree_t sTree;
+    srand(0);
+    for (size_t i = 0; i < SIZE; i++)
+    {
+        Test* t = simpleAlloc<Test>();
+        t->m_Value = rand() % (2 * SIZE);
+        if (!sTree.insert(*t).second)
+            t->m_Value = SIZE_MAX;
+    }
+    for (size_t i = 0; i < SIZE; i++)
+    {
+        Tree_t::iterator itr = sTree.lower_bound(rand() % (2 * SIZE));
+        if (itr != sTree.end())
+            sTree.erase(*itr);
+        Test* t = simpleAlloc<Test>();
+        t->m_Value = rand() % (2 * SIZE);
+        sTree.insert(*t);
+    }
+    shape("AVL churned", sTree);
+
+    auto sFind = [&sTree](const char* aText)
+    {
+        srand(1);
+        checkpoint("", 0);
+        for (size_t i = 0; i < SIZE; i++)
+        {
+            Tree_t::iterator itr = sTree.find(rand() % (2 * SIZE));
+            if (itr != sTree.end())
+                SideEffect ^= itr->m_Value;
+        }
+        checkpoint(aText, SIZE);
+    };
+    sFind("AVL churned rand find");
+
+    auto sRelocate = [](Test& t) -> Test& { Test* sNew = simpleAlloc<Test>(); sNew->m_Value = t.m_Value; return *sNew; };
+    checkpoint("", 0);
+    sTree.relayout(Avl::BREADTH_FIRST, sRelocate);
+    checkpoint("AVL breadth-first relayout", sTree.size());
+    shape("AVL breadth-first", sTree);
+    sFind("AVL breadth-first rand find");
+
+    sTree.relayout(Avl::VAN_EMDE_BOAS, sRelocate);
+    checkpoint("AVL van Emde Boas relayout", sTree.size());
+    shape("AVL van Emde Boas", sTree);
+    sFind("AVL van Emde Boas rand find");
+
+    sTree.clear();
+    simpleReset();
+}
+
+// The same work as in alv_test() by a tree that counts it, the counters go after the rates.
+using StatsTree_t = Avl::BasicTree<Test, Avl::Node, &Test::m_Node, Avl::Default<Test>, false, Avl::CountingStats<>>;
+
+static void stats(size_t aOpCount)
+{
+    Avl::TreeStats sStats = Avl::CountingStats<>::snapshot();
+    std::cout << "    per op: " << double(sStats.m_Comparisons) / aOpCount << " comparisons, "
+              << double(sStats.m_SingleRotations) / aOpCount << " single and "
+              << double(sStats.m_DoubleRotations) / aOpCount << " double rotations; rebalance path "
+              << sStats.averageRebalancePath() << ", lookup depth " << sStats.averageLookupDepth() << std::endl;
+    Avl::CountingStats<>::reset();
+    checkpoint("", 0);
+}
+
+static void stats_test()
+{
+    StatsTree_t sTree;
+    Avl::CountingStats<>::reset();
+    checkpoint("", 0);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        Test* t = simpleAlloc<Test>();
+        t->m_Value = rand();
+        sTree.insert(*t);
+    }
+    checkpoint("Stats AVL rand insert", COUNT);
+    stats(COUNT);
+
+    srand(1);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        StatsTree_t::iterator itr = sTree.find(val);
+        if (itr != sTree.end())
+            SideEffect ^= itr->m_Value;
+    }
+    checkpoint("Stats AVL rand find", COUNT);
+    stats(COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        StatsTree_t::iterator itr = sTree.find(val);
+        if (itr != sTree.end())
+            sTree.erase(*itr);
+    }
+    checkpoint("Stats AVL rand erase", COUNT);
+    stats(COUNT);
+
+    memory("Stats AVL", COUNT);
+}
+
+// Counted avl tree with size_t key
+struct CountedTest
+{
+    size_t m_Value;
+    Avl::CountedNode m_Node;
+    bool operator<(const CountedTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const CountedTest& b) { return a < b.m_Value; }
+};
+
+using CountedTree_t = Avl::CountedTree<CountedTest, &CountedTest::m_Node>;
+
+static void counted_test()
+{
+    CountedTree_t sTree;
+    checkpoint("", 0);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        CountedTest* t = simpleAlloc<CountedTest>();
+        t->m_Value = rand();
+        sTree.insert(*t);
+    }
+    checkpoint("Counted AVL rand insert", COUNT);
+
+    srand(1);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t k = rand() % sTree.size();
+        SideEffect ^= sTree.select(k)->m_Value;
+    }
+    checkpoint("Counted AVL rand select", COUNT);
+
+    for (CountedTest& t : sTree)
+    {
+        SideEffect ^= sTree.rank(t);
+    }
+    checkpoint("Counted AVL rank", sTree.size());
+
+    const size_t SPLIT_COUNT = 1024 * 1024;
+    CountedTree_t sRight;
+    srand(2);
+    for (size_t i = 0; i < SPLIT_COUNT; i++)
+    {
+        sTree.split(static_cast<size_t>(rand()), sRight);
+        sTree.join(sRight);
+    }
+    checkpoint("Counted AVL split+join", SPLIT_COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        CountedTree_t::iterator itr = sTree.find(val);
+        if (itr != sTree.end())
+            sTree.erase(*itr);
+    }
+    checkpoint("Counted AVL rand erase", COUNT);
+
+    memory("Counted AVL", COUNT);
+}
+
+// Avl tree with size_t key and sums of a member over ranges of keys
+struct SumTest
+{
+    size_t m_Value;
+    size_t m_Price;
+    Avl::AugmentedNode<Avl::SumOf<SumTest, size_t, &SumTest::m_Price>> m_Node;
+    bool operator<(const SumTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const SumTest& b) { return a < b.m_Value; }
+};
+
+using SumTree_t = Avl::BasicTree<SumTest, decltype(SumTest::m_Node), &SumTest::m_Node>;
+
+static void augmented_test()
+{
+    SumTree_t sTree;
+    checkpoint("", 0);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        SumTest* t = simpleAlloc<SumTest>();
+        t->m_Value = rand();
+        t->m_Price = t->m_Value % 1000;
+        sTree.insert(*t);
+    }
+    checkpoint("Sum AVL rand insert", COUNT);
+
+    srand(1);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t sFrom = rand();
+        SideEffect ^= sTree.aggregate(sFrom, sFrom + RAND_MAX / 16, static_cast<size_t>(0));
+    }
+    checkpoint("Sum AVL rand range sum", COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        SumTree_t::iterator itr = sTree.find(val);
+        if (itr != sTree.end())
+            sTree.erase(*itr);
+    }
+    checkpoint("Sum AVL rand erase", COUNT);
+
+    memory("Sum AVL", COUNT);
+}
+
+// Compact avl tree with size_t key
+struct CompactTest
+{
+    size_t m_Value;
+    Avl::CompactNode m_Node;
+    bool operator<(const CompactTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const CompactTest& b) { return a < b.m_Value; }
+};
+
+using CompactTree_t = Avl::CompactTree<CompactTest, &CompactTest::m_Node>;
+
+static void compact_test()
+{
+    CompactTree_t sTree;
+    checkpoint("", 0);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        CompactTest* t = simpleAlloc<CompactTest>();
+        t->m_Value = rand();
+        sTree.insert(*t);
+    }
+    checkpoint("Compact AVL rand insert", COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        SideEffect ^= sTree.find(val)->m_Value;
+    }
+    checkpoint("Compact AVL rand find", COUNT);
+
+    for (CompactTest& t : sTree)
+    {
+        SideEffect ^= t.m_Value;
+    }
+    checkpoint("Compact AVL iteration", COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        CompactTree_t::iterator itr = sTree.find(val);
+        if (itr != sTree.end())
+            sTree.erase(*itr);
+    }
+    checkpoint("Compact AVL rand erase", COUNT);
+
+    memory("Compact AVL", COUNT);
+}
+
+// Offset avl tree with size_t key; all the items are in SimpleBuffer
+struct OffsetTest
+{
+    size_t m_Value;
+    Avl::OffsetNode m_Node;
+    bool operator<(const OffsetTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const OffsetTest& b) { return a < b.m_Value; }
+};
+
+using OffsetTree_t = Avl::OffsetTree<OffsetTest, &OffsetTest::m_Node>;
+
+static void offset_test()
+{
+    OffsetTree_t sTree;
+    checkpoint("", 0);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        OffsetTest* t = simpleAlloc<OffsetTest>();
+        t->m_Value = rand();
+        sTree.insert(*t);
+    }
+    checkpoint("Offset AVL rand insert", COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        SideEffect ^= sTree.find(val)->m_Value;
+    }
+    checkpoint("Offset AVL rand find", COUNT);
+
+    for (OffsetTest& t : sTree)
+    {
+        SideEffect ^= t.m_Value;
+    }
+    checkpoint("Offset AVL iteration", COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        OffsetTree_t::iterator itr = sTree.find(val);
+        if (itr != sTree.end())
+            sTree.erase(*itr);
+    }
+    checkpoint("Offset AVL rand erase", COUNT);
+
+    memory("Offset AVL", COUNT);
+}
+
+// Avl trees with the key and the node on different cache lines, with and without the key cached in nodes
+struct FarKeyPrefix
+{
+    using Type = size_t;
+    static const bool FULL = true;
+    static size_t of(size_t aKey) { return aKey; }
+    template <class Item>
+    static size_t of(const Item& aItem) { return aItem.m_Value; }
+};
+
+template <class NodeT>
+struct alignas(64) FarKeyTest
+{
+    size_t m_Value;
+    char m_Payload[64 - sizeof(size_t)];
+    NodeT m_Node;
+    bool operator<(const FarKeyTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const FarKeyTest& b) { return a < b.m_Value; }
+};
+
+template <class NodeT>
+static void far_key_test(const std::string& aName)
+{
+    using Item_t = FarKeyTest<NodeT>;
+    Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node> sTree;
+    const size_t sCount = COUNT / 4;
+    Item_t* sItems = static_cast<Item_t*>(simpleAlloc(sCount * sizeof(Item_t) + alignof(Item_t)));
+    sItems = reinterpret_cast<Item_t*>((reinterpret_cast<uintptr_t>(sItems) + alignof(Item_t) - 1) & ~(alignof(Item_t) - 1));
+    checkpoint("", 0);
+
+    srand(0);
+    for (size_t i = 0; i < sCount; i++)
+    {
+        sItems[i].m_Value = rand();
+        sTree.insert(sItems[i]);
+    }
+    checkpoint((aName + " rand insert").c_str(), sCount);
+
+    srand(0);
+    for (size_t i = 0; i < sCount; i++)
+    {
+        size_t val = rand();
+        SideEffect ^= sTree.find(val)->m_Value;
+    }
+    checkpoint((aName + " rand find").c_str(), sCount);
+
+    srand(0);
+    for (size_t i = 0; i < sCount; i++)
+    {
+        size_t val = rand();
+        SideEffect ^= sTree.lower_bound(val)->m_Value;
+    }
+    checkpoint((aName + " rand lower_bound").c_str(), sCount);
+
+    simpleReset();
+}
+
+static void key_test()
+{
+    far_key_test<Avl::Node>("Far key AVL");
+    far_key_test<Avl::KeyNode<FarKeyPrefix>>("Far key cached AVL");
+}
+
+// Avl trees with comparators of different kinds, see Avl::Comparison
+struct StringTest
+{
+    std::string m_Key;
+    Avl::Node m_Node;
+    bool operator<(const StringTest& a) const { return m_Key < a.m_Key; }
+    bool operator<(const std::string& a) const { return m_Key < a; }
+    friend bool operator<(const std::string& a, const StringTest& b) { return a < b.m_Key; }
+};
+
+struct StringCompare
+{
+    static int Compare(const StringTest& aItem, const StringTest& aKey) { return aItem.m_Key.compare(aKey.m_Key); }
+    static int Compare(const StringTest& aItem, const std::string& aKey) { return aItem.m_Key.compare(aKey); }
+};
+
+struct TestProjection
+{
+    static size_t KeyOf(const Test& aItem) { return aItem.m_Value; }
+};
+
+template <class Comparator, class Item, class Key>
+static void comparator_tree_test(const std::string& aName, std::vector<Item>& aItems, const std::vector<Key>& aKeys)
+{
+    Avl::Tree<Item, &Item::m_Node, Comparator> sTree;
+    checkpoint("", 0);
+
+    for (Item& t : aItems)
+        sTree.insert(t);
+    checkpoint((aName + " rand insert").c_str(), aItems.size());
+
+    for (const Key& sKey : aKeys)
+        SideEffect += sTree.find(sKey) != sTree.end();
+    checkpoint((aName + " rand find").c_str(), aKeys.size());
+}
+
+static void comparator_test()
+{
+    for (size_t sCount = 64 * 1024; sCount <= COUNT / 4; sCount *= 16)
+    {
+        std::vector<Test> sItems(sCount);
+        std::vector<size_t> sKeys(COUNT / 4);
+        srand(0);
+        for (size_t i = 0; i < sCount; i++)
+            sItems[i].m_Value = rand();
+        for (size_t i = 0; i < sKeys.size(); i++)
+            sKeys[i] = sItems[rand() % sCount].m_Value;
+
+        std::string sSuffix = " " + std::to_string(sCount / 1024) + "K";
+        comparator_tree_test<Avl::Default<Test>>("AVL default" + sSuffix, sItems, sKeys);
+        comparator_tree_test<Avl::LessOnly<Test>>("AVL less-only" + sSuffix, sItems, sKeys);
+        comparator_tree_test<TestProjection>("AVL projection" + sSuffix, sItems, sKeys);
+    }
+
+    // Keys with a long common prefix, every comparison goes through it.
+    for (size_t sCount = 64 * 1024; sCount <= COUNT / 4; sCount *= 16)
+    {
+        std::vector<StringTest> sItems(sCount);
+        std::vector<std::string> sKeys(COUNT / 4);
+        srand(0);
+        for (size_t i = 0; i < sCount; i++)
+            sItems[i].m_Key = "/var/lib/storage/index/partition/" + std::to_string(rand());
+        for (size_t i = 0; i < sKeys.size(); i++)
+            sKeys[i] = sItems[rand() % sCount].m_Key;
+
+        std::string sSuffix = " " + std::to_string(sCount / 1024) + "K";
+        comparator_tree_test<Avl::Default<StringTest>>("String AVL default" + sSuffix, sItems, sKeys);
+        comparator_tree_test<Avl::LessOnly<StringTest>>("String AVL less-only" + sSuffix, sItems, sKeys);
+        comparator_tree_test<StringCompare>("String AVL compare" + sSuffix, sItems, sKeys);
+    }
+}
+
+// Lock-free readers with one writer vs a tree under a mutex
+struct SyncTest
+{
+    size_t m_Value;
+    Avl::AtomicNode m_Node;
+    bool operator<(const SyncTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const SyncTest& b) { return a < b.m_Value; }
+};
+
+using SyncTree_t = Avl::SingleWriterTree<SyncTest, &SyncTest::m_Node>;
+
+static const size_t SYNC_COUNT = 1024 * 1024;
+static const size_t SYNC_READS = 1024 * 1024;
+
+static size_t nextRand(size_t& aSeed)
+{
+    aSeed = aSeed * 6364136223846793005ull + 1442695040888963407ull;
+    return aSeed >> 33;
+}
+
+template <class ReadFn, class WriteFn>
+static void readers_test(const char* aText, size_t aThreads, ReadFn aRead, WriteFn aWrite)
+{
+    std::atomic<size_t> sRunning(aThreads);
+    std::atomic<size_t> sSideEffect(0);
+    std::vector<std::thread> sThreads;
+    checkpoint("", 0);
+    for (size_t i = 0; i < aThreads; i++)
+    {
+        sThreads.emplace_back([&sRunning, &sSideEffect, &aRead, i]()
+        {
+            sSideEffect ^= aRead(i);
+            sRunning--;
+        });
+    }
+    size_t sWriterSeed = 0;
+    while (sRunning.load() != 0)
+        aWrite(sWriterSeed);
+    for (std::thread& sThread : sThreads)
+        sThread.join();
+    std::string sText = std::string(aText) + " " + std::to_string(aThreads) + " readers find";
+    checkpoint(sText.c_str(), aThreads * SYNC_READS);
+    SideEffect ^= sSideEffect.load();
+}
+
+static void single_writer_test()
+{
+    SyncTree_t sTree;
+    SyncTest* sItems = static_cast<SyncTest*>(simpleAlloc(SYNC_COUNT * sizeof(SyncTest)));
+    for (size_t i = 0; i < SYNC_COUNT; i++)
+    {
+        sItems[i].m_Value = i;
+        sTree.insert(sItems[i]);
+    }
+    std::vector<SyncTest*> sFree;
+    auto sDisposer = [&sFree](SyncTest& aItem) { sFree.push_back(&aItem); };
+
+    Tree_t sLockedTree;
+    std::mutex sMutex;
+    Test* sLockedItems = static_cast<Test*>(simpleAlloc(SYNC_COUNT * sizeof(Test)));
+    for (size_t i = 0; i < SYNC_COUNT; i++)
+    {
+        sLockedItems[i].m_Value = i;
+        sLockedTree.insert(sLockedItems[i]);
+    }
+
+    for (size_t sThreads = 1; sThreads <= 8; sThreads *= 2)
+    {
+        readers_test("SingleWriter AVL", sThreads, [&sTree](size_t aSeed)
+        {
+            SyncTree_t::Reader sReader(sTree);
+            size_t sRes = 0;
+            for (size_t i = 0; i < SYNC_READS; i++)
+            {
+                sReader.lock();
+                const SyncTest* sFound = sReader.find(nextRand(aSeed) % SYNC_COUNT);
+                if (nullptr != sFound)
+                    sRes ^= sFound->m_Value;
+                sReader.unlock();
+            }
+            return sRes;
+        }, [&](size_t& aSeed)
+        {
+            SyncTest& sItem = sItems[nextRand(aSeed) % SYNC_COUNT];
+            if (sTree.tree().find(sItem.m_Value) != sTree.tree().end())
+                sTree.erase(sItem);
+            sTree.reclaim(sDisposer);
+            for (SyncTest* sReclaimed : sFree)
+                sTree.insert(*sReclaimed);
+            sFree.clear();
+        });
+
+        readers_test("Mutex AVL", sThreads, [&sLockedTree, &sMutex](size_t aSeed)
+        {
+            size_t sRes = 0;
+            for (size_t i = 0; i < SYNC_READS; i++)
+            {
+                std::lock_guard<std::mutex> sLock(sMutex);
+                Tree_t::iterator sFound = sLockedTree.find(nextRand(aSeed) % SYNC_COUNT);
+                if (sFound != sLockedTree.end())
+                    sRes ^= sFound->m_Value;
+            }
+            return sRes;
+        }, [&](size_t& aSeed)
+        {
+            Test& sItem = sLockedItems[nextRand(aSeed) % SYNC_COUNT];
+            std::lock_guard<std::mutex> sLock(sMutex);
+            sLockedTree.erase(sItem);
+            sLockedTree.insert(sItem);
+        });
+    }
+
+    sTree.reclaim(sDisposer);
+    simpleReset();
+}
+
+// Mixed find/insert/erase from several threads vs a tree under a mutex
+struct ConcurrentTest
+{
+    size_t m_Value;
+    bool m_InTree;
+    std::atomic<bool> m_Free;
+    Avl::ConcurrentNode m_Node;
+    bool operator<(const ConcurrentTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const ConcurrentTest& b) { return a < b.m_Value; }
+};
+
+using ConcurrentTree_t = Avl::ConcurrentTree<ConcurrentTest, &ConcurrentTest::m_Node>;
+
+static const size_t CONCURRENT_OPS = 1024 * 1024;
+// Every CONCURRENT_WRITE_RATE-th operation is an insert or an erase.
+static const size_t CONCURRENT_WRITE_RATE = 8;
+
+template <class Fn>
+static void threads_test(const char* aText, const char* aWorkload, size_t aThreads, size_t aOpCount, Fn aFn)
+{
+    std::atomic<size_t> sSideEffect(0);
+    std::vector<std::thread> sThreads;
+    checkpoint("", 0);
+    for (size_t i = 0; i < aThreads; i++)
+        sThreads.emplace_back([&sSideEffect, &aFn, i]() { sSideEffect ^= aFn(i); });
+    for (std::thread& sThread : sThreads)
+        sThread.join();
+    std::string sText = std::string(aText) + " " + std::to_string(aThreads) + " threads " + aWorkload;
+    checkpoint(sText.c_str(), aOpCount);
+    SideEffect ^= sSideEffect.load();
+}
+
+static void concurrent_test()
+{
+    // Thread i modifies only the items with index % threads == i, searches all the keys.
+    ConcurrentTree_t sTree;
+    ConcurrentTest* sItems = static_cast<ConcurrentTest*>(simpleAlloc(SYNC_COUNT * sizeof(ConcurrentTest)));
+    auto sDisposer = [](ConcurrentTest& aItem) { aItem.m_Free.store(true, std::memory_order_relaxed); };
+    {
+        ConcurrentTree_t::Session sSession(sTree);
+        sSession.lock();
+        for (size_t i = 0; i < SYNC_COUNT; i++)
+        {
+            new (&sItems[i]) ConcurrentTest();
+            sItems[i].m_Value = i;
+            sItems[i].m_InTree = true;
+            sItems[i].m_Free.store(false, std::memory_order_relaxed);
+            sSession.insert(sItems[i]);
+        }
+        sSession.unlock();
+    }
+
+    Tree_t sLockedTree;
+    std::mutex sMutex;
+    Test* sLockedItems = static_cast<Test*>(simpleAlloc(SYNC_COUNT * sizeof(Test)));
+    std::vector<bool> sLockedInTree(SYNC_COUNT, true);
+    for (size_t i = 0; i < SYNC_COUNT; i++)
+    {
+        sLockedItems[i].m_Value = i;
+        sLockedTree.insert(sLockedItems[i]);
+    }
+
+    for (size_t sThreads = 1; sThreads <= 8; sThreads *= 2)
+    {
+        threads_test("Concurrent AVL", "mixed", sThreads, sThreads * CONCURRENT_OPS, [&](size_t aThread)
+        {
+            ConcurrentTree_t::Session sSession(sTree);
+            size_t sSeed = aThread;
+            size_t sRes = 0;
+            for (size_t i = 0; i < CONCURRENT_OPS; i++)
+            {
+                size_t sKey = nextRand(sSeed) % SYNC_COUNT;
+                sSession.lock();
+                if (i % CONCURRENT_WRITE_RATE != 0)
+                {
+                    const ConcurrentTest* sFound = sSession.find(sKey);
+                    if (nullptr != sFound)
+                        sRes ^= sFound->m_Value;
+                }
+                else
+                {
+                    ConcurrentTest& sItem = sItems[sKey - sKey % sThreads + aThread];
+                    if (sItem.m_InTree)
+                        sItem.m_InTree = !sSession.erase(sItem);
+                    else if (sItem.m_Free.load(std::memory_order_relaxed))
+                    {
+                        sItem.m_Free.store(false, std::memory_order_relaxed);
+                        sItem.m_InTree = sSession.insert(sItem);
+                        sItem.m_Free.store(!sItem.m_InTree, std::memory_order_relaxed);
+                    }
+                }
+                sSession.unlock();
+                if (i % 1024 == 0)
+                    sTree.reclaim(sDisposer);
+            }
+            return sRes;
+        });
+
+        threads_test("Mutex AVL", "mixed", sThreads, sThreads * CONCURRENT_OPS, [&](size_t aThread)
+        {
+            size_t sSeed = aThread;
+            size_t sRes = 0;
+            for (size_t i = 0; i < CONCURRENT_OPS; i++)
+            {
+                size_t sKey = nextRand(sSeed) % SYNC_COUNT;
+                std::lock_guard<std::mutex> sLock(sMutex);
+                if (i % CONCURRENT_WRITE_RATE != 0)
+                {
+                    Tree_t::iterator sFound = sLockedTree.find(sKey);
+                    if (sFound != sLockedTree.end())
+                        sRes ^= sFound->m_Value;
+                }
+                else
+                {
+                    if (sLockedInTree[sKey])
+                        sLockedTree.erase(sLockedItems[sKey]);
+                    else
+                        sLockedTree.insert(sLockedItems[sKey]);
+                    sLockedInTree[sKey] = !sLockedInTree[sKey];
+                }
+            }
+            return sRes;
+        });
+    }
+
+    sTree.reclaim(sDisposer);
+    simpleReset();
+}
+
+// Range partitioned shards vs a tree under a mutex
+using ShardedTree_t = Avl::ShardedTree<Test, &Test::m_Node>;
+
+static const size_t SHARDS = 64;
+
+static void sharded_test()
+{
+    std::vector<Test> sBounds(SHARDS - 1);
+    for (size_t i = 0; i < SHARDS - 1; i++)
+        sBounds[i].m_Value = (i + 1) * (SYNC_COUNT / SHARDS);
+    ShardedTree_t sTree(sBounds.begin(), sBounds.end());
+    Test* sItems = static_cast<Test*>(simpleAlloc(SYNC_COUNT * sizeof(Test)));
+    Tree_t sLockedTree;
+    std::mutex sMutex;
+    Test* sLockedItems = static_cast<Test*>(simpleAlloc(SYNC_COUNT * sizeof(Test)));
+    // Keys of the items are scattered over the whole range, all of them are different.
+    for (size_t i = 0; i < SYNC_COUNT; i++)
+        sItems[i].m_Value = sLockedItems[i].m_Value = (i * 2654435761u) % SYNC_COUNT;
+
+    for (size_t sThreads = 1; sThreads <= 8; sThreads *= 2)
+    {
+        // Thread i inserts the items with index % threads == i.
+        sTree.clear();
+        threads_test("Sharded AVL", "ingest", sThreads, SYNC_COUNT, [&](size_t aThread)
+        {
+            for (size_t i = aThread; i < SYNC_COUNT; i += sThreads)
+                sTree.insert(sItems[i]);
+            return static_cast<size_t>(0);
+        });
+
+        sLockedTree.clear();
+        threads_test("Mutex AVL", "ingest", sThreads, SYNC_COUNT, [&](size_t aThread)
+        {
+            for (size_t i = aThread; i < SYNC_COUNT; i += sThreads)
+            {
+                std::lock_guard<std::mutex> sLock(sMutex);
+                sLockedTree.insert(sLockedItems[i]);
+            }
+            return static_cast<size_t>(0);
+        });
+
+        // Every CONCURRENT_WRITE_RATE-th operation erases and inserts back an own item.
+        threads_test("Sharded AVL", "mixed", sThreads, sThreads * CONCURRENT_OPS, [&](size_t aThread)
+        {
+            size_t sSeed = aThread;
+            size_t sRes = 0;
+            for (size_t i = 0; i < CONCURRENT_OPS; i++)
+            {
+                size_t sKey = nextRand(sSeed) % SYNC_COUNT;
+                if (i % CONCURRENT_WRITE_RATE != 0)
+                {
+                    const Test* sFound = sTree.find(sKey);
+                    if (nullptr != sFound)
+                        sRes ^= sFound->m_Value;
+                }
+                else
+                {
+                    Test& sItem = sItems[sKey - sKey % sThreads + aThread];
+                    sTree.erase(sItem);
+                    sTree.insert(sItem);
+                }
+            }
+            return sRes;
+        });
+
+        threads_test("Mutex AVL", "mixed", sThreads, sThreads * CONCURRENT_OPS, [&](size_t aThread)
+        {
+            size_t sSeed = aThread;
+            size_t sRes = 0;
+            for (size_t i = 0; i < CONCURRENT_OPS; i++)
+            {
+                size_t sKey = nextRand(sSeed) % SYNC_COUNT;
+                std::lock_guard<std::mutex> sLock(sMutex);
+                if (i % CONCURRENT_WRITE_RATE != 0)
+                {
+                    Tree_t::iterator sFound = sLockedTree.find(sKey);
+                    if (sFound != sLockedTree.end())
+                        sRes ^= sFound->m_Value;
+                }
+                else
+                {
+                    Test& sItem = sLockedItems[sKey - sKey % sThreads + aThread];
+                    sLockedTree.erase(sItem);
+                    sLockedTree.insert(sItem);
+                }
+            }
+            return sRes;
+        });
+    }
+
+    simpleReset();
+}
+
+// Read-only snapshot vs the tree and std::set
+struct TestKey
+{
+    size_t operator()(const Test& aItem) const { return aItem.m_Value; }
+};
+
+static void frozen_test()
+{
+    for (size_t sCount = 1024 * 1024; sCount <= COUNT; sCount *= 4)
+    {
+        Tree_t sTree;
+        std::set<size_t> sSet;
+        Test* sItems = static_cast<Test*>(simpleAlloc(sCount * sizeof(Test)));
+        size_t sSeed = 0;
+        for (size_t i = 0; i < sCount; i++)
+        {
+            sItems[i].m_Value = nextRand(sSeed);
+            if (sTree.insert(sItems[i]).second)
+                sSet.insert(sItems[i].m_Value);
+        }
+        Avl::FrozenTree<Test, TestKey, false> sFrozen(sTree.begin(), sTree.size());
+        Avl::FrozenTree<Test, TestKey, true> sBlocks(sTree.begin(), sTree.size());
+        // Existing keys in random order.
+        std::vector<size_t> sKeys(sCount);
+        for (size_t& sKey : sKeys)
+            sKey = sItems[nextRand(sSeed) % sCount].m_Value;
+        std::string sSuffix = " " + std::to_string(sCount / 1024 / 1024) + "M find";
+
+        checkpoint("", 0);
+        for (size_t sKey : sKeys)
+            SideEffect ^= sTree.find(sKey)->m_Value;
+        checkpoint(("AVL" + sSuffix).c_str(), sCount);
+
+        for (size_t sKey : sKeys)
+            SideEffect ^= sFrozen.find(sKey)->m_Value;
+        checkpoint(("Frozen AVL" + sSuffix).c_str(), sCount);
+
+        for (size_t sKey : sKeys)
+            SideEffect ^= sBlocks.find(sKey)->m_Value;
+        checkpoint(("Frozen blocks AVL" + sSuffix).c_str(), sCount);
+
+        for (size_t sKey : sKeys)
+            SideEffect ^= *sSet.find(sKey);
+        checkpoint(("std::set" + sSuffix).c_str(), sCount);
+
+        simpleReset();
+    }
 }
 
 // Set size_t
@@ -179,7 +1202,7 @@ static void set_test()
     }
     checkpoint("Set erase", COUNT);
 
-    std::cout << "Set memory: " << simpleReset() / 1024 << "kB" << std::endl;
+    memory("Set", COUNT);
 
     srand(0);
     for (size_t i = 0; i < COUNT; i++)
@@ -196,6 +1219,16 @@ static void set_test()
     }
     checkpoint("Set rand find", COUNT);
 
+    srand(1);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        Set_t::iterator itr = sSet.lower_bound(val);
+        if (itr != sSet.end())
+            SideEffect ^= *itr;
+    }
+    checkpoint("Set rand lower_bound", COUNT);
+
     for (size_t i : sSet)
     {
         SideEffect ^= i;
@@ -210,12 +1243,75 @@ static void set_test()
     }
     checkpoint("Set rand erase", COUNT);
 
-    std::cout << "Set memory: " << simpleReset() / 1024 << "kB" << std::endl;
+    memory("Set", COUNT);
+}
+
+// Owning map with pooled nodes against std::map with the default allocator
+template <class Map>
+static void owning_map_test(const char* aName)
+{
+    Map sMap;
+    std::string sName(aName);
+    checkpoint("", 0);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        size_t val = rand();
+        sMap.emplace(val, val);
+    }
+    checkpoint((sName + " rand insert").c_str(), COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        SideEffect ^= sMap.find(rand())->second;
+    }
+    checkpoint((sName + " rand find").c_str(), COUNT);
+
+    srand(0);
+    for (size_t i = 0; i < COUNT / 2; i++)
+    {
+        sMap.erase(rand());
+    }
+    checkpoint((sName + " rand erase").c_str(), COUNT / 2);
+
+    srand(1);
+    for (size_t i = 0; i < COUNT / 2; i++)
+    {
+        size_t val = rand();
+        sMap.emplace(val, val);
+    }
+    checkpoint((sName + " rand reinsert").c_str(), COUNT / 2);
+
+    size_t sSize = sMap.size();
+    sMap.clear();
+    checkpoint((sName + " clear").c_str(), sSize);
+}
+
+static void owning_test()
+{
+    owning_map_test<Avl::Map<size_t, size_t>>("Pooled map");
+    owning_map_test<std::map<size_t, size_t>>("std::map");
 }
 
 int main()
 {
     alv_test();
+    range_erase_test();
+    relayout_test();
+    stats_test();
+    counted_test();
+    augmented_test();
+    compact_test();
+    offset_test();
+    key_test();
+    comparator_test();
+    single_writer_test();
+    concurrent_test();
+    sharded_test();
+    frozen_test();
     set_test();
+    owning_test();
     std::cout << "Side effect (ignore it): " << SideEffect << std::endl;
 }
@@ -1,9 +1,20 @@
 #include <AvlTree.hpp>
+#include <AvlSingleWriterTree.hpp>
+#include <AvlConcurrentTree.hpp>
+#include <AvlShardedTree.hpp>
+#include <AvlFrozenTree.hpp>
+#include <AvlMap.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 int rc = 0;
 
@@ -335,6 +346,127 @@ static void simple()
     }
 }
 
+static void bounds()
+{
+    ANNOUNCE();
+
+    // Even values only, so every odd key falls between two items.
+    Test sTest[SIMPLE_SIZE];
+    size_t sValues[SIMPLE_SIZE];
+    Tree_t sTree;
+    for (size_t i = 0; i < SIMPLE_SIZE; i++)
+    {
+        size_t j = (i * 7) % SIMPLE_SIZE;
+        sTest[i].m_Value = 2 * j + 2;
+        sValues[j] = 2 * j + 2;
+        sTree.insert(sTest[i]);
+    }
+    CHECK(sTree.selfCheck(), 0);
+
+    const Tree_t& sConstTree = sTree;
+    for (size_t k = 0; k <= 2 * SIMPLE_SIZE + 2; k++)
+    {
+        const size_t* sLower = std::lower_bound(sValues, sValues + SIMPLE_SIZE, k);
+        const size_t* sUpper = std::upper_bound(sValues, sValues + SIMPLE_SIZE, k);
+
+        Tree_t::iterator sLowerItr = sTree.lower_bound(k);
+        Tree_t::iterator sUpperItr = sTree.upper_bound(k);
+        CHECK(sLowerItr == sTree.end(), sLower == sValues + SIMPLE_SIZE);
+        CHECK(sUpperItr == sTree.end(), sUpper == sValues + SIMPLE_SIZE);
+        if (sLowerItr != sTree.end() && sLower != sValues + SIMPLE_SIZE)
+            CHECK(sLowerItr->m_Value, *sLower);
+        if (sUpperItr != sTree.end() && sUpper != sValues + SIMPLE_SIZE)
+            CHECK(sUpperItr->m_Value, *sUpper);
+        CHECK(sConstTree.lower_bound(k) == Tree_t::const_iterator(sConstTree.lower_bound(k)));
+
+        std::pair<Tree_t::iterator, Tree_t::iterator> sRange = sTree.equal_range(k);
+        CHECK(sRange.first == sLowerItr);
+        CHECK(sRange.second == sUpperItr);
+        size_t sCount = 0;
+        for (Tree_t::iterator sItr = sRange.first; sItr != sRange.second; ++sItr)
+            sCount++;
+        CHECK(sCount, static_cast<size_t>(sUpper - sLower));
+
+        std::pair<Tree_t::const_iterator, Tree_t::const_iterator> sConstRange = sConstTree.equal_range(k);
+        CHECK(sConstRange.first == sConstTree.lower_bound(k));
+        CHECK(sConstRange.second == sConstTree.upper_bound(k));
+    }
+
+    Tree_t sEmpty;
+    CHECK(sEmpty.lower_bound(0) == sEmpty.end());
+    CHECK(sEmpty.upper_bound(0) == sEmpty.end());
+    CHECK(sEmpty.equal_range(0).first == sEmpty.end());
+}
+
+struct CountedTest
+{
+    explicit CountedTest(size_t aValue) : m_Value(aValue) {}
+
+    size_t m_Value;
+    Avl::CountedNode m_Node;
+    bool operator<(const CountedTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const CountedTest& b) { return a < b.m_Value; }
+};
+
+using CountedTree_t = Avl::CountedTree<CountedTest, &CountedTest::m_Node>;
+
+static void build()
+{
+    ANNOUNCE();
+
+    const size_t MAX_SIZE = 100;
+    for (size_t sSize = 0; sSize <= MAX_SIZE; sSize++)
+    {
+        std::vector<Test> sItems(sSize);
+        for (size_t i = 0; i < sSize; i++)
+            sItems[i].m_Value = 2 * i + 1;
+
+        Tree_t sTree;
+        sTree.buildSorted(sItems.begin(), sItems.end());
+        CHECK(sTree.selfCheck(), 0);
+        if (sSize <= SIMPLE_SIZE)
+            checkSimple(sTree, sItems.data(), sItems.data() + sSize);
+        else
+        {
+            size_t i = 0;
+            for (Test& sTest : sTree)
+                CHECK(&sTest == &sItems[i++]);
+            CHECK(i, sSize);
+        }
+
+        // The built tree must be a regular one.
+        std::vector<Test> sExtra(sSize + 1);
+        for (size_t i = 0; i <= sSize; i++)
+        {
+            sExtra[i].m_Value = 2 * i;
+            CHECK(sTree.insert(sExtra[i]).second);
+        }
+        CHECK(sTree.selfCheck(), 0);
+        for (size_t i = 0; i < sSize; i++)
+            sTree.erase(sItems[i]);
+        CHECK(sTree.selfCheck(), 0);
+        CHECK(sTree.size(), sSize + 1);
+
+        // Rebuild from pointers, dropping the previous content.
+        std::vector<Test*> sPointers;
+        for (size_t i = 0; i < sSize; i++)
+            sPointers.push_back(&sItems[i]);
+        sTree.buildSorted(sPointers.begin(), sPointers.end());
+        CHECK(sTree.selfCheck(), 0);
+        CHECK(sTree.size(), sSize);
+    }
+
+    std::vector<CountedTest> sCounted;
+    for (size_t i = 0; i < MAX_SIZE; i++)
+        sCounted.emplace_back(i);
+    CountedTree_t sCountedTree;
+    sCountedTree.buildSorted(sCounted.begin(), sCounted.end());
+    CHECK(sCountedTree.selfCheck(), 0);
+    for (size_t i = 0; i < MAX_SIZE; i++)
+        CHECK(sCountedTree.select(i)->m_Value, i);
+}
+
 static void massive()
 {
     ANNOUNCE();
@@ -354,6 +486,12 @@ static void massive()
         std::set<size_t>::iterator sRefItr = sRef.find(r);
         CHECK(sTreeItr == sTree.end(), sRefItr == sRef.end());
 
+        Tree_t::iterator sLowerItr = sTree.lower_bound(r);
+        std::set<size_t>::iterator sRefLowerItr = sRef.lower_bound(r);
+        CHECK(sLowerItr == sTree.end(), sRefLowerItr == sRef.end());
+        if (sLowerItr != sTree.end() && sRefLowerItr != sRef.end())
+            CHECK(sLowerItr->m_Value, *sRefLowerItr);
+
         bool sFound = sTreeItr != sTree.end();
         if (sFound)
         {
@@ -412,10 +550,1841 @@ static void massive()
     }
 }
 
+static void counted()
+{
+    ANNOUNCE();
+
+    const size_t SIZE_LIMIT = 128;
+    const size_t ITERATIONS = 64 * 1024;
+
+    CountedTree_t sTree;
+    std::set<size_t> sRef;
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        size_t r = rand() % SIZE_LIMIT;
+        CountedTree_t::iterator sTreeItr = sTree.find(r);
+        if (sTreeItr != sTree.end())
+        {
+            if (rand() % 4 == 0)
+            {
+                CountedTest* sNew = new CountedTest(r);
+                sTree.replace(*sTreeItr, *sNew);
+            }
+            else
+            {
+                sTree.erase(*sTreeItr);
+                sRef.erase(r);
+            }
+            delete &*sTreeItr;
+        }
+        else
+        {
+            sTree.insert(*new CountedTest(r));
+            sRef.insert(r);
+        }
+
+        CHECK(sTree.selfCheck(), 0);
+        CHECK(sTree.size(), sRef.size());
+
+        size_t k = 0;
+        for (std::set<size_t>::iterator sRefItr = sRef.begin(); sRefItr != sRef.end(); ++sRefItr, ++k)
+        {
+            CountedTree_t::iterator sSelected = sTree.select(k);
+            CHECK(sSelected != sTree.end());
+            if (sSelected == sTree.end())
+                break;
+            CHECK(sSelected->m_Value, *sRefItr);
+            CHECK(sTree.rank(*sSelected), k);
+            CHECK(sTree.rank(sSelected), k);
+        }
+        CHECK(sTree.select(sRef.size()) == sTree.end());
+        CHECK(sTree.rank(sTree.end()), sRef.size());
+        CHECK(sTree.distance(sTree.begin(), sTree.end()), sRef.size());
+        if (!sRef.empty())
+        {
+            const CountedTree_t& sConstTree = sTree;
+            CHECK(sConstTree.distance(sConstTree.lower_bound(r), sConstTree.end()),
+                  static_cast<size_t>(std::distance(sRef.lower_bound(r), sRef.end())));
+        }
+    }
+
+    while (sTree.size() != 0)
+    {
+        CountedTest* sItem = &*sTree.begin();
+        sTree.erase(*sItem);
+        delete sItem;
+    }
+}
+
+template <class NodeT>
+struct LayoutTest
+{
+    explicit LayoutTest(size_t aValue) : m_Value(aValue) {}
+
+    size_t m_Value;
+    NodeT m_Node;
+    bool operator<(const LayoutTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const LayoutTest& b) { return a < b.m_Value; }
+};
+
+// A prefix with many ties, to check the fallback to the comparator.
+struct CoarseKeyPrefix
+{
+    using Type = uint32_t;
+    static const bool FULL = false;
+    static uint32_t of(size_t aKey) { return static_cast<uint32_t>(aKey >> 4); }
+    template <class Item>
+    static uint32_t of(const Item& aItem) { return of(aItem.m_Value); }
+};
+
+struct FullKeyTest
+{
+    explicit FullKeyTest(size_t aValue) : m_Value(aValue) {}
+
+    size_t m_Value;
+    Avl::KeyNode<Avl::MemberKeyPrefix<FullKeyTest, size_t, &FullKeyTest::m_Value>> m_Node;
+    bool operator<(const FullKeyTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const FullKeyTest& b) { return a < b.m_Value; }
+};
+
+template <class NodeT, class Item_t = LayoutTest<NodeT>, class Comparator = Avl::Default<Item_t>>
+static void layout()
+{
+    using LayoutTree_t = Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node, Comparator>;
+
+    const size_t SIZE_LIMIT = 128;
+    const size_t ITERATIONS = 64 * 1024;
+
+    LayoutTree_t sTree;
+    std::set<size_t> sRef;
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        size_t r = rand() % SIZE_LIMIT;
+        typename LayoutTree_t::iterator sTreeItr = sTree.find(r);
+        if (sTreeItr != sTree.end())
+        {
+            if (rand() % 4 == 0)
+                sTree.replace(*sTreeItr, *new Item_t(r));
+            else
+            {
+                sTree.erase(*sTreeItr);
+                sRef.erase(r);
+            }
+            delete &*sTreeItr;
+        }
+        else
+        {
+            sTree.insert(*new Item_t(r));
+            sRef.insert(r);
+        }
+
+        CHECK(sTree.selfCheck(), 0);
+        CHECK(sTree.size(), sRef.size());
+        typename LayoutTree_t::const_iterator sItr = sTree.begin();
+        for (std::set<size_t>::iterator sRefItr = sRef.begin(); sRefItr != sRef.end(); ++sRefItr, ++sItr)
+        {
+            CHECK(sItr != sTree.end());
+            if (sItr == sTree.end())
+                break;
+            CHECK(sItr->m_Value, *sRefItr);
+        }
+        CHECK(sItr == sTree.end());
+        if (!sRef.empty())
+            CHECK(sTree.max()->m_Value, *sRef.rbegin());
+
+        r = rand() % SIZE_LIMIT;
+        std::set<size_t>::iterator sRefBound = sRef.lower_bound(r);
+        CHECK(sTree.lower_bound(r) == sTree.end(), sRefBound == sRef.end());
+        if (sRefBound != sRef.end())
+            CHECK(sTree.lower_bound(r)->m_Value, *sRefBound);
+        sRefBound = sRef.upper_bound(r);
+        CHECK(sTree.upper_bound(r) == sTree.end(), sRefBound == sRef.end());
+        if (sRefBound != sRef.end())
+            CHECK(sTree.upper_bound(r)->m_Value, *sRefBound);
+    }
+
+    while (sTree.size() != 0)
+    {
+        Item_t* sItem = &*sTree.begin();
+        sTree.erase(*sItem);
+        delete sItem;
+    }
+}
+
+static void layouts()
+{
+    ANNOUNCE();
+
+    CHECK(sizeof(Avl::CompactNode), 3 * sizeof(void*));
+    CHECK(sizeof(Avl::OffsetNode), static_cast<size_t>(12));
+    layout<Avl::Node>();
+    layout<Avl::CompactNode>();
+    layout<Avl::OffsetNode>();
+
+    layout<Avl::KeyNode<CoarseKeyPrefix>>();
+    layout<decltype(FullKeyTest::m_Node), FullKeyTest>();
+}
+
+// Projection to the integral key, see Avl::Comparison.
+template <class Item>
+struct ValueComparator
+{
+    static size_t KeyOf(const Item& aItem) { return aItem.m_Value; }
+};
+
+static void comparators()
+{
+    ANNOUNCE();
+
+    using Item_t = LayoutTest<Avl::Node>;
+    CHECK(Avl::Comparison<Item_t, Avl::Default<Item_t>>::KIND == Avl::Comparison<Item_t, Avl::Default<Item_t>>::THREE_WAY);
+    CHECK(Avl::Comparison<Item_t, Avl::LessOnly<Item_t>>::KIND == Avl::Comparison<Item_t, Avl::LessOnly<Item_t>>::LESS);
+    CHECK(Avl::Comparison<Item_t, ValueComparator<Item_t>>::KIND == Avl::Comparison<Item_t, ValueComparator<Item_t>>::PROJECTION);
+    layout<Avl::Node, Item_t, Avl::LessOnly<Item_t>>();
+    layout<Avl::Node, Item_t, ValueComparator<Item_t>>();
+    layout<Avl::CountedNode, LayoutTest<Avl::CountedNode>, Avl::LessOnly<LayoutTest<Avl::CountedNode>>>();
+}
+
+static void relocation()
+{
+    ANNOUNCE();
+
+    using Item_t = LayoutTest<Avl::OffsetNode>;
+    using OffsetTree_t = Avl::OffsetTree<Item_t, &Item_t::m_Node>;
+
+    const size_t SIZE = 1000;
+    std::vector<Item_t> sArena;
+    sArena.reserve(SIZE);
+    OffsetTree_t sTree;
+    for (size_t i = 0; i < SIZE; i++)
+    {
+        sArena.emplace_back((i * 7919) % SIZE);
+        sTree.insert(sArena.back());
+    }
+    CHECK(sTree.selfCheck(), 0);
+
+    // Move the whole arena; the links inside it stay valid.
+    std::vector<Item_t> sMoved(sArena);
+    sTree.rebase(reinterpret_cast<char*>(sMoved.data()) - reinterpret_cast<char*>(sArena.data()));
+    for (Item_t& sItem : sArena)
+        sItem.m_Value = SIZE_MAX;
+
+    CHECK(sTree.selfCheck(), 0);
+    CHECK(sTree.size(), SIZE);
+    size_t i = 0;
+    for (OffsetTree_t::iterator sItr = sTree.begin(); sItr != sTree.end(); ++sItr, ++i)
+    {
+        CHECK(sItr->m_Value, i);
+        CHECK(&*sItr >= sMoved.data() && &*sItr < sMoved.data() + SIZE);
+    }
+    CHECK(i, SIZE);
+    CHECK(sTree.find(SIZE / 2)->m_Value, SIZE / 2);
+
+    for (size_t j = 0; j < SIZE; j += 2)
+        sTree.erase(sMoved[j]);
+    CHECK(sTree.selfCheck(), 0);
+    CHECK(sTree.size(), SIZE / 2);
+}
+
+template <class NodeT>
+static void relayouts(Avl::Placement aPlacement)
+{
+    using Item_t = LayoutTest<NodeT>;
+    using Tree_t = Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node>;
+
+    // Both places are in one arena, so that offset nodes reach each other.
+    const size_t SIZE = 1000;
+    std::vector<Item_t> sArena;
+    sArena.reserve(2 * SIZE);
+    Tree_t sTree;
+    for (size_t i = 0; i < SIZE; i++)
+    {
+        sArena.emplace_back((i * 7919) % SIZE);
+        sTree.insert(sArena.back());
+    }
+    for (size_t i = 0; i < SIZE; i += 3)
+        sTree.erase(*sTree.find(i));
+    Avl::TreeShape sShape = sTree.shape();
+
+    size_t sDisposed = 0;
+    sTree.relayout(aPlacement, [&sArena](Item_t& aItem) -> Item_t& { sArena.push_back(aItem); return sArena.back(); },
+                   [&sDisposed](Item_t& aItem) { aItem.m_Value = SIZE_MAX; sDisposed++; });
+    CHECK(sTree.selfCheck(), 0);
+    CHECK(sDisposed, sTree.size());
+    CHECK(sArena.size(), SIZE + sTree.size());
+    CHECK(sTree.getRoot() == &sArena[SIZE]);
+    CHECK(sTree.shape().m_Levels == sShape.m_Levels);
+    CHECK(sTree.shape().m_TotalDepth, sShape.m_TotalDepth);
+
+    size_t sValue = 0;
+    for (const Item_t& sItem : sTree)
+    {
+        if (sValue % 3 == 0)
+            sValue++;
+        CHECK(sItem.m_Value, sValue++);
+        CHECK(&sItem >= &sArena[SIZE]);
+    }
+    CHECK(sValue, SIZE - 1);
+    CHECK(sTree.find(SIZE - 2) == sTree.max());
+
+    // Breadth-first: parents before children. Van Emde Boas: the top half of the levels goes first.
+    if (Avl::BREADTH_FIRST == aPlacement)
+    {
+        for (size_t i = SIZE; i < sArena.size(); i++)
+        {
+            const Item_t* sLeft = Tree_t::getLeft(&sArena[i]);
+            const Item_t* sRight = Tree_t::getRight(&sArena[i]);
+            CHECK((nullptr == sLeft || sLeft > &sArena[i]) && (nullptr == sRight || sRight > &sArena[i]));
+        }
+    }
+    else
+    {
+        size_t sTopHeight = sShape.m_Height / 2;
+        size_t sTop = 0;
+        for (size_t i = 0; i < sTopHeight; i++)
+            sTop += sShape.m_Levels[i];
+        std::vector<const Item_t*> sLevel(1, sTree.getRoot()), sNext;
+        for (size_t i = 0; i < sTopHeight; sLevel.swap(sNext), sNext.clear(), i++)
+        {
+            for (const Item_t* sItem : sLevel)
+            {
+                CHECK(sItem < &sArena[SIZE + sTop]);
+                for (const Item_t* sChild : {Tree_t::getLeft(sItem), Tree_t::getRight(sItem)})
+                {
+                    if (nullptr != sChild)
+                        sNext.push_back(sChild);
+                }
+            }
+        }
+    }
+
+    for (size_t i = SIZE; i < sArena.size(); i += 2)
+        sTree.erase(sArena[i]);
+    CHECK(sTree.selfCheck(), 0);
+}
+
+static void relayout()
+{
+    ANNOUNCE();
+
+    for (Avl::Placement sPlacement : {Avl::BREADTH_FIRST, Avl::VAN_EMDE_BOAS})
+    {
+        relayouts<Avl::Node>(sPlacement);
+        relayouts<Avl::CountedNode>(sPlacement);
+        relayouts<Avl::CompactNode>(sPlacement);
+        relayouts<Avl::OffsetNode>(sPlacement);
+        relayouts<Avl::KeyNode<CoarseKeyPrefix>>(sPlacement);
+    }
+}
+
+template <class Tree, class Set>
+static void checkEqual(const Tree& aTree, const Set& aRef)
+{
+    CHECK(aTree.selfCheck(), 0);
+    CHECK(aTree.size(), aRef.size());
+    typename Set::const_iterator sRefItr = aRef.begin();
+    for (typename Tree::const_iterator sItr = aTree.begin(); sItr != aTree.end() && sRefItr != aRef.end(); ++sItr, ++sRefItr)
+        CHECK(sItr->m_Value, *sRefItr);
+}
+
+template <class NodeT>
+static void algebra()
+{
+    using Item_t = LayoutTest<NodeT>;
+    using Tree_t = Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node>;
+
+    const size_t SIZE_LIMIT = 256;
+    const size_t ITERATIONS = 1024;
+
+    std::vector<Item_t*> sDisposed;
+    auto sDisposer = [&sDisposed](Item_t& aItem) { sDisposed.push_back(&aItem); };
+    auto sFill = [](Tree_t& aTree, std::set<size_t>& aRef, size_t aFrom, size_t aTo, size_t aSize)
+    {
+        for (size_t i = 0; i < aSize && aFrom < aTo; i++)
+        {
+            size_t r = aFrom + rand() % (aTo - aFrom);
+            if (aRef.insert(r).second)
+                aTree.insert(*new Item_t(r));
+        }
+    };
+    auto sFree = [](Tree_t& aTree)
+    {
+        while (aTree.size() != 0)
+        {
+            Item_t* sItem = &*aTree.begin();
+            aTree.erase(*sItem);
+            delete sItem;
+        }
+    };
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        // Join of trees of arbitrary and very different sizes.
+        Tree_t sLeft, sRight;
+        std::set<size_t> sRef;
+        size_t sPivot = 1 + rand() % (SIZE_LIMIT - 2);
+        sFill(sLeft, sRef, 0, sPivot, rand() % SIZE_LIMIT >> (rand() % 8));
+        sFill(sRight, sRef, sPivot + 1, SIZE_LIMIT, rand() % SIZE_LIMIT >> (rand() % 8));
+        if (rand() % 2 == 0)
+        {
+            sRef.insert(sPivot);
+            sLeft.join(*new Item_t(sPivot), sRight);
+        }
+        else
+        {
+            sLeft.join(sRight);
+        }
+        CHECK(sRight.size(), static_cast<size_t>(0));
+        checkEqual(sLeft, sRef);
+
+        // Split by present and missing keys.
+        size_t sKey = rand() % SIZE_LIMIT;
+        sLeft.split(sKey, sRight);
+        std::set<size_t> sRefLeft(sRef.begin(), sRef.lower_bound(sKey));
+        std::set<size_t> sRefRight(sRef.lower_bound(sKey), sRef.end());
+        checkEqual(sLeft, sRefLeft);
+        checkEqual(sRight, sRefRight);
+
+        // Set algebra on overlapping trees.
+        Tree_t sA, sB;
+        std::set<size_t> sRefA, sRefB;
+        sFill(sA, sRefA, 0, SIZE_LIMIT, rand() % SIZE_LIMIT);
+        sFill(sB, sRefB, 0, SIZE_LIMIT, rand() % SIZE_LIMIT);
+        std::set<size_t> sRefRes;
+        switch (rand() % 3)
+        {
+        case 0:
+            sA.merge(sB);
+            for (size_t v : sRefB)
+                if (!sRefA.insert(v).second)
+                    sRefRes.insert(v);
+            checkEqual(sA, sRefA);
+            checkEqual(sB, sRefRes);
+            break;
+        case 1:
+            sA.intersect(sB, sDisposer);
+            for (size_t v : sRefA)
+                if (sRefB.count(v) != 0)
+                    sRefRes.insert(v);
+            checkEqual(sA, sRefRes);
+            CHECK(sDisposed.size(), sRefA.size() - sRefRes.size());
+            checkEqual(sB, sRefB);
+            break;
+        default:
+            sA.subtract(sB, sDisposer);
+            for (size_t v : sRefA)
+                if (sRefB.count(v) == 0)
+                    sRefRes.insert(v);
+            checkEqual(sA, sRefRes);
+            CHECK(sDisposed.size(), sRefA.size() - sRefRes.size());
+            checkEqual(sB, sRefB);
+            break;
+        }
+
+        for (Item_t* sItem : sDisposed)
+            delete sItem;
+        sDisposed.clear();
+        sFree(sLeft);
+        sFree(sRight);
+        sFree(sA);
+        sFree(sB);
+    }
+}
+
+static void joinSplit()
+{
+    ANNOUNCE();
+
+    algebra<Avl::Node>();
+    algebra<Avl::CountedNode>();
+    algebra<Avl::CompactNode>();
+    algebra<Avl::KeyNode<CoarseKeyPrefix>>();
+}
+
+template <class NodeT, bool Multi>
+static void ranges()
+{
+    using Item_t = LayoutTest<NodeT>;
+    using Tree_t = Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node, Avl::Default<Item_t>, Multi>;
+
+    const size_t SIZE_LIMIT = 512;
+    const size_t ITERATIONS = 512;
+
+    std::vector<Item_t*> sDisposed;
+    auto sDisposer = [&sDisposed](Item_t& aItem) { sDisposed.push_back(&aItem); };
+    auto sLess = [](const Item_t* a, const Item_t* b) { return *a < *b; };
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        // Equal keys of a multi tree are in the order of insertion, as after upper_bound().
+        Tree_t sTree;
+        std::vector<Item_t*> sRef;
+        for (size_t j = rand() % SIZE_LIMIT; j > 0; j--)
+        {
+            Item_t* sItem = new Item_t(rand() % (Multi ? SIZE_LIMIT / 8 : SIZE_LIMIT));
+            if (sTree.insert(*sItem).second)
+                sRef.insert(std::upper_bound(sRef.begin(), sRef.end(), sItem, sLess), sItem);
+            else
+                delete sItem;
+        }
+
+        size_t sFrom = rand() % (sRef.size() + 1);
+        size_t sTo = sFrom + rand() % (sRef.size() - sFrom + 1);
+        typename Tree_t::iterator sFirst = sTree.begin();
+        for (size_t j = 0; j < sFrom; j++)
+            ++sFirst;
+        typename Tree_t::iterator sLast = sFirst;
+        for (size_t j = sFrom; j < sTo; j++)
+            ++sLast;
+        if (rand() % 2 == 0)
+        {
+            CHECK(sTree.erase(sFirst, sLast, sDisposer) == sLast);
+        }
+        else
+        {
+            for (typename Tree_t::iterator sItr = sFirst; sItr != sLast; ++sItr)
+                sDisposed.push_back(&*sItr);
+            CHECK(sTree.erase(sFirst, sLast) == sLast);
+        }
+        std::sort(sDisposed.begin(), sDisposed.end());
+        std::vector<Item_t*> sErased(sRef.begin() + sFrom, sRef.begin() + sTo);
+        std::sort(sErased.begin(), sErased.end());
+        CHECK(sDisposed == sErased);
+        sRef.erase(sRef.begin() + sFrom, sRef.begin() + sTo);
+
+        CHECK(sTree.selfCheck(), 0);
+        CHECK(sTree.size(), sRef.size());
+        typename std::vector<Item_t*>::iterator sRefItr = sRef.begin();
+        for (typename Tree_t::iterator sItr = sTree.begin(); sItr != sTree.end() && sRefItr != sRef.end(); ++sItr, ++sRefItr)
+            CHECK(&*sItr == *sRefItr);
+        if (!sRef.empty())
+        {
+            CHECK(&*sTree.min() == sRef.front());
+            CHECK(&*sTree.max() == sRef.back());
+        }
+
+        for (Item_t* sItem : sDisposed)
+            delete sItem;
+        sDisposed.clear();
+        sTree.clearAndDispose(sDisposer);
+        CHECK(sTree.size(), static_cast<size_t>(0));
+        CHECK(sTree.begin() == sTree.end());
+        CHECK(sDisposed.size(), sRef.size());
+        for (Item_t* sItem : sDisposed)
+            delete sItem;
+        sDisposed.clear();
+    }
+}
+
+static void rangeErase()
+{
+    ANNOUNCE();
+
+    ranges<Avl::Node, false>();
+    ranges<Avl::CountedNode, false>();
+    ranges<Avl::Node, true>();
+    ranges<Avl::CountedNode, true>();
+    ranges<Avl::KeyNode<CoarseKeyPrefix>, true>();
+}
+
+template <class NodeT>
+static void orders()
+{
+    using Item_t = LayoutTest<NodeT>;
+    using Tree_t = Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node>;
+
+    const size_t SIZE_LIMIT = 512;
+    const size_t ITERATIONS = 256;
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        Tree_t sTree;
+        const Tree_t& sConstTree = sTree;
+        std::vector<Item_t*> sRef;
+        for (size_t j = rand() % SIZE_LIMIT; j > 0; j--)
+        {
+            Item_t* sItem = new Item_t(rand() % SIZE_LIMIT);
+            if (sTree.insert(*sItem).second)
+                sRef.push_back(sItem);
+            else
+                delete sItem;
+        }
+        std::sort(sRef.begin(), sRef.end(), [](const Item_t* a, const Item_t* b) { return *a < *b; });
+
+        // Standard algorithms over bidirectional iterators.
+        CHECK(static_cast<size_t>(std::distance(sTree.begin(), sTree.end())), sRef.size());
+        CHECK(static_cast<size_t>(std::distance(sConstTree.rbegin(), sConstTree.rend())), sRef.size());
+        CHECK(sTree.rbegin().base() == sTree.end());
+        CHECK(sTree.rend().base() == sTree.begin());
+        std::vector<Item_t*> sSeq;
+        for (typename Tree_t::reverse_iterator sItr = sTree.rbegin(); sItr != sTree.rend(); ++sItr)
+            sSeq.push_back(&*sItr);
+        CHECK(std::equal(sSeq.rbegin(), sSeq.rend(), sRef.begin()) && sSeq.size() == sRef.size());
+        sSeq.clear();
+        for (typename Tree_t::const_iterator sItr = sConstTree.end(); sItr != sConstTree.begin();)
+            sSeq.push_back(const_cast<Item_t*>(&*--sItr));
+        CHECK(std::equal(sSeq.rbegin(), sSeq.rend(), sRef.begin()) && sSeq.size() == sRef.size());
+        if (!sRef.empty())
+        {
+            CHECK(&*std::prev(sTree.end()) == sRef.back());
+            CHECK(&*std::prev(sTree.rend()) == sRef.front());
+            size_t sIndex = rand() % sRef.size();
+            typename Tree_t::iterator sItr = sTree.iterator_to(*sRef[sIndex]);
+            CHECK(&*std::next(sTree.begin(), sIndex) == sRef[sIndex]);
+            CHECK(&*typename Tree_t::reverse_iterator(sItr).base() == sRef[sIndex]);
+            CHECK(&*typename Tree_t::reverse_iterator(std::next(sItr)) == sRef[sIndex]);
+            size_t sValue = sRef[sIndex]->m_Value;
+            CHECK(std::find_if(sTree.rbegin(), sTree.rend(), [sValue](const Item_t& a) { return a.m_Value <= sValue; })->m_Value, sValue);
+        }
+
+        sSeq.clear();
+        for (typename Tree_t::const_stack_iterator sItr = sConstTree.stack_begin(); sItr != sConstTree.stack_end(); sItr++)
+            sSeq.push_back(const_cast<Item_t*>(&*sItr));
+        CHECK(sSeq == sRef);
+
+        // Children before parents, the root is the last.
+        std::set<const Item_t*> sVisited;
+        bool sChildrenFirst = true;
+        for (typename Tree_t::const_postorder_iterator sItr = sConstTree.postorder_begin(); sItr != sConstTree.postorder_end(); ++sItr)
+        {
+            const Item_t* sLeft = Tree_t::getLeft(&*sItr);
+            const Item_t* sRight = Tree_t::getRight(&*sItr);
+            sChildrenFirst = sChildrenFirst && (nullptr == sLeft || sVisited.count(sLeft)) && (nullptr == sRight || sVisited.count(sRight));
+            CHECK(sVisited.insert(&*sItr).second);
+            if (sVisited.size() == sRef.size())
+                CHECK(&*sItr == sTree.getRoot());
+        }
+        CHECK(sChildrenFirst);
+        CHECK(sVisited.size(), sRef.size());
+
+        // Teardown: every item is deleted after it is passed.
+        for (typename Tree_t::postorder_iterator sItr = sTree.postorder_begin(); sItr != sTree.postorder_end();)
+            delete &*sItr++;
+        sTree.clear();
+        CHECK(sTree.rbegin() == sTree.rend());
+        CHECK(sTree.stack_begin() == sTree.stack_end());
+        CHECK(sTree.postorder_begin() == sTree.postorder_end());
+    }
+}
+
+static void iterators()
+{
+    ANNOUNCE();
+
+    orders<Avl::Node>();
+    orders<Avl::CompactNode>();
+    orders<Avl::CountedNode>();
+}
+
+struct StatsTag {};
+using StatsTree_t = Avl::BasicTree<Test, Avl::Node, &Test::m_Node, Avl::Default<Test>, false, Avl::CountingStats<StatsTag>>;
+
+static void statistics()
+{
+    ANNOUNCE();
+
+    using Stats_t = Avl::CountingStats<StatsTag>;
+    static_assert(std::is_empty<Avl::NoStats>::value, "no statistics must cost nothing");
+
+    const size_t SIZE = 1023;
+    std::vector<Test> sItems(SIZE);
+    StatsTree_t sTree;
+    Stats_t::reset();
+
+    // Ascending inserts make single rotations only.
+    for (size_t i = 0; i < SIZE; i++)
+    {
+        sItems[i].m_Value = i;
+        sTree.insert(sItems[i]);
+    }
+    Avl::TreeStats sStats = Stats_t::snapshot();
+    CHECK(sStats.m_SingleRotations > 0);
+    CHECK(sStats.m_DoubleRotations, static_cast<size_t>(0));
+    CHECK(sStats.m_Rebalances, SIZE);
+    CHECK(sStats.m_RebalanceSteps >= sStats.m_SingleRotations);
+    CHECK(sStats.m_Comparisons > 0);
+    CHECK(sStats.m_Lookups, static_cast<size_t>(0));
+
+    // Every lookup compares once per visited node.
+    Stats_t::reset();
+    for (size_t i = 0; i < SIZE; i++)
+        CHECK(sTree.find(i) != sTree.end());
+    CHECK(sTree.find(SIZE) == sTree.end());
+    sStats = Stats_t::snapshot();
+    CHECK(sStats.m_Lookups, SIZE + 1);
+    size_t sLookups = 0, sVisited = 0;
+    for (size_t i = 0; i < Avl::TreeStats::DEPTH_LIMIT; i++)
+    {
+        sLookups += sStats.m_LookupDepth[i];
+        sVisited += i * sStats.m_LookupDepth[i];
+    }
+    CHECK(sLookups, SIZE + 1);
+    CHECK(sVisited, sStats.m_Comparisons);
+    CHECK(sStats.m_LookupDepth[0], static_cast<size_t>(0));
+    CHECK(sStats.m_LookupDepth[1], static_cast<size_t>(1));
+    CHECK(sStats.averageLookupDepth() > 1 && sStats.averageLookupDepth() < 11);
+    CHECK(sStats.m_SingleRotations + sStats.m_DoubleRotations + sStats.m_Rebalances, static_cast<size_t>(0));
+
+    // Interleaved lookups see the same depths.
+    std::vector<size_t> sKeys(SIZE + 1);
+    for (size_t i = 0; i <= SIZE; i++)
+        sKeys[i] = i;
+    std::vector<StatsTree_t::iterator> sFound(sKeys.size(), sTree.end());
+    Stats_t::reset();
+    sTree.findBatch(sKeys.begin(), sKeys.size(), sFound.begin());
+    Avl::TreeStats sBatchStats = Stats_t::snapshot();
+    CHECK(sBatchStats.m_Lookups, SIZE + 1);
+    CHECK(sBatchStats.m_Comparisons, sStats.m_Comparisons);
+    for (size_t i = 0; i < Avl::TreeStats::DEPTH_LIMIT; i++)
+        CHECK(sBatchStats.m_LookupDepth[i], sStats.m_LookupDepth[i]);
+
+    // Other threads count apart.
+    std::thread([]() { CHECK(Stats_t::snapshot().m_Comparisons, static_cast<size_t>(0)); }).join();
+
+    // A right-left zigzag makes a double rotation.
+    sTree.clear();
+    Stats_t::reset();
+    sTree.insert(sItems[0]);
+    sTree.insert(sItems[2]);
+    sTree.insert(sItems[1]);
+    sStats = Stats_t::snapshot();
+    CHECK(sStats.m_SingleRotations, static_cast<size_t>(0));
+    CHECK(sStats.m_DoubleRotations, static_cast<size_t>(1));
+    CHECK(sTree.selfCheck(), 0);
+
+    Stats_t::reset();
+    sTree.erase(sItems[0]);
+    sTree.erase(sItems[1]);
+    sStats = Stats_t::snapshot();
+    CHECK(sStats.m_Rebalances, static_cast<size_t>(2));
+    CHECK(sTree.selfCheck(), 0);
+    sTree.clear();
+}
+
+static void shapes()
+{
+    ANNOUNCE();
+
+    using Stats_t = Avl::CountingStats<StatsTag>;
+    const size_t SIZE = 1023;
+    std::vector<Test> sItems(SIZE);
+    for (size_t i = 0; i < SIZE; i++)
+        sItems[i].m_Value = i;
+
+    StatsTree_t sTree;
+    Avl::TreeShape sShape = sTree.shape();
+    CHECK(sShape.m_Height, static_cast<size_t>(0));
+    CHECK(sShape.m_MaxHeight, static_cast<size_t>(0));
+    CHECK(sShape.averageDepth() == 0 && sShape.lineCrossingRate() == 0);
+
+    // A perfect tree.
+    sTree.buildSorted(sItems.begin(), sItems.end());
+    sShape = sTree.shape();
+    CHECK(sShape.m_Size, SIZE);
+    CHECK(sShape.m_Height, static_cast<size_t>(10));
+    CHECK(sShape.m_MinHeight, static_cast<size_t>(10));
+    CHECK(sShape.m_MaxHeight, static_cast<size_t>(14));
+    for (size_t i = 0; i < sShape.m_Levels.size(); i++)
+        CHECK(sShape.m_Levels[i], static_cast<size_t>(1) << i);
+    CHECK(sShape.m_Balanced, SIZE);
+    CHECK(sShape.m_TotalDepth, static_cast<size_t>(9 * 1024 + 1));
+    CHECK(sShape.m_PageCrossings <= sShape.m_LineCrossings && sShape.m_LineCrossings < SIZE);
+
+    // Random inserts; the depths are what lookups of the items see.
+    sTree.clear();
+    std::vector<Test*> sShuffled;
+    for (Test& sItem : sItems)
+        sShuffled.push_back(&sItem);
+    for (size_t i = 1; i < SIZE; i++)
+        std::swap(sShuffled[i], sShuffled[rand() % (i + 1)]);
+    for (size_t i = 0; i < SIZE / 2; i++)
+        sTree.insert(*sShuffled[i]);
+    sShape = sTree.shape();
+    CHECK(sShape.m_Size, SIZE / 2);
+    CHECK(sShape.m_Height >= sShape.m_MinHeight && sShape.m_Height <= sShape.m_MaxHeight);
+    size_t sLevels = 0;
+    for (size_t sCount : sShape.m_Levels)
+        sLevels += sCount;
+    CHECK(sLevels, SIZE / 2);
+    CHECK(sShape.m_Balanced + sShape.m_LeftHeavy + sShape.m_RightHeavy, SIZE / 2);
+    Stats_t::reset();
+    for (size_t i = 0; i < SIZE / 2; i++)
+        sTree.find(*sShuffled[i]);
+    CHECK(sShape.m_TotalDepth, Stats_t::snapshot().m_Comparisons);
+    CHECK(sShape.m_PageCrossings <= sShape.m_LineCrossings && sShape.m_LineCrossings < SIZE / 2);
+    sTree.clear();
+}
+
+template <class NodeT>
+static void batch()
+{
+    using Item_t = LayoutTest<NodeT>;
+    using Tree_t = Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node>;
+
+    const size_t SIZE_LIMIT = 1024;
+    const size_t ITERATIONS = 512;
+
+    Tree_t sTree;
+    std::set<size_t> sRef;
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        // Batches from a few items up to bigger than the tree, with duplicates.
+        size_t sBatchSize = 1 + rand() % (rand() % 8 == 0 ? SIZE_LIMIT : 16);
+        std::vector<Item_t*> sBatch;
+        size_t sExpected = 0;
+        std::set<size_t> sBatchKeys;
+        if (rand() % 2 == 0 || sRef.empty())
+        {
+            for (size_t j = 0; j < sBatchSize; j++)
+            {
+                size_t r = rand() % SIZE_LIMIT;
+                sBatch.push_back(new Item_t(r));
+                if (sRef.count(r) != 0 || !sBatchKeys.insert(r).second)
+                    sExpected++;
+            }
+            std::vector<Item_t*> sAll(sBatch);
+            CHECK(sTree.insertBatch(sBatch.begin(), sBatch.end()), sExpected);
+            sRef.insert(sBatchKeys.begin(), sBatchKeys.end());
+            for (Item_t* sItem : sAll)
+                if (sTree.find(sItem->m_Value) == sTree.end() || &*sTree.find(sItem->m_Value) != sItem)
+                    delete sItem;
+        }
+        else
+        {
+            for (size_t j = 0; j < sBatchSize; j++)
+            {
+                typename Tree_t::iterator sItr = sTree.lower_bound(rand() % SIZE_LIMIT);
+                if (sItr == sTree.end())
+                    sItr = sTree.min();
+                sBatch.push_back(&*sItr);
+                if (!sBatchKeys.insert(sItr->m_Value).second)
+                    sExpected++;
+            }
+            CHECK(sTree.eraseBatch(sBatch.begin(), sBatch.end()), sExpected);
+            for (size_t sKey : sBatchKeys)
+                sRef.erase(sKey);
+            for (size_t j = 0; j < sBatch.size(); j++)
+                if (j == 0 || sBatch[j] != sBatch[j - 1])
+                    delete sBatch[j];
+        }
+        checkEqual(sTree, sRef);
+        if (!sRef.empty())
+        {
+            CHECK(sTree.min()->m_Value, *sRef.begin());
+            CHECK(sTree.max()->m_Value, *sRef.rbegin());
+        }
+
+        // More keys than interleaved lanes, present and missing.
+        std::vector<size_t> sKeys(rand() % 64);
+        for (size_t& sKey : sKeys)
+            sKey = rand() % SIZE_LIMIT;
+        std::vector<typename Tree_t::iterator> sFound(sKeys.size(), sTree.end());
+        sTree.findBatch(sKeys.begin(), sKeys.size(), sFound.begin());
+        const Tree_t& sConstTree = sTree;
+        std::vector<typename Tree_t::const_iterator> sConstFound(sKeys.size(), sTree.end());
+        sConstTree.findBatch(sKeys.data(), sKeys.size(), sConstFound.data());
+        for (size_t j = 0; j < sKeys.size(); j++)
+        {
+            CHECK(sFound[j] == sTree.find(sKeys[j]));
+            CHECK(sConstFound[j] == sFound[j]);
+        }
+    }
+
+    while (sTree.size() != 0)
+    {
+        Item_t* sItem = &*sTree.begin();
+        sTree.erase(*sItem);
+        delete sItem;
+    }
+}
+
+static void batches()
+{
+    ANNOUNCE();
+
+    batch<Avl::Node>();
+    batch<Avl::CountedNode>();
+    batch<Avl::KeyNode<CoarseKeyPrefix>>();
+}
+
+template <class Tree, class Map>
+static void checkSequence(const Tree& aTree, const Map& aRef)
+{
+    CHECK(aTree.selfCheck(), 0);
+    CHECK(aTree.size(), aRef.size());
+    typename Map::const_iterator sRefItr = aRef.begin();
+    for (typename Tree::const_iterator sItr = aTree.begin(); sItr != aTree.end() && sRefItr != aRef.end(); ++sItr, ++sRefItr)
+        CHECK(&*sItr == sRefItr->second);
+}
+
+template <class NodeT>
+static void multiset()
+{
+    using Item_t = LayoutTest<NodeT>;
+    using Tree_t = Avl::BasicTree<Item_t, NodeT, &Item_t::m_Node, Avl::Default<Item_t>, true>;
+    // std::multimap also inserts after the equal keys.
+    using Ref_t = std::multimap<size_t, Item_t*>;
+
+    const size_t SIZE_LIMIT = 64;
+    const size_t ITERATIONS = 4 * 1024;
+
+    Tree_t sTree;
+    Ref_t sRef;
+    auto sRefErase = [&sRef](Item_t* aItem)
+    {
+        typename Ref_t::iterator sItr = sRef.lower_bound(aItem->m_Value);
+        while (sItr->second != aItem)
+            ++sItr;
+        sRef.erase(sItr);
+    };
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        size_t r = rand() % (SIZE_LIMIT / 4);
+        switch (rand() % 6)
+        {
+        case 0:
+        case 1:
+        {
+            Item_t* sNew = new Item_t(r);
+            std::pair<typename Tree_t::iterator, bool> sRes = rand() % 2 == 0 ? sTree.insert(*sNew) :
+                sTree.insert(sTree.lower_bound(rand() % (SIZE_LIMIT / 4)), *sNew);
+            CHECK(sRes.second);
+            CHECK(&*sRes.first == sNew);
+            sRef.insert(std::make_pair(r, sNew));
+            break;
+        }
+        case 2:
+        {
+            // Batches from a few items up to bigger than the tree.
+            std::vector<Item_t*> sBatch(1 + rand() % (rand() % 4 == 0 ? SIZE_LIMIT : 8));
+            for (Item_t*& sItem : sBatch)
+            {
+                sItem = new Item_t(rand() % (SIZE_LIMIT / 4));
+                sRef.insert(std::make_pair(sItem->m_Value, sItem));
+            }
+            CHECK(sTree.insertBatch(sBatch.begin(), sBatch.end()), static_cast<size_t>(0));
+            break;
+        }
+        case 3:
+        {
+            typename Tree_t::iterator sItr = sTree.lower_bound(r);
+            if (sItr == sTree.end())
+                break;
+            sRefErase(&*sItr);
+            sTree.erase(*sItr);
+            delete &*sItr;
+            break;
+        }
+        case 4:
+        {
+            // The same item may be taken twice.
+            std::vector<Item_t*> sBatch;
+            std::set<Item_t*> sUnique;
+            for (size_t j = rand() % (rand() % 4 == 0 ? SIZE_LIMIT : 8); j > 0 && sTree.size() != 0; j--)
+            {
+                typename Tree_t::iterator sItr = sTree.lower_bound(rand() % (SIZE_LIMIT / 4));
+                if (sItr == sTree.end())
+                    sItr = sTree.min();
+                sBatch.push_back(&*sItr);
+                sUnique.insert(&*sItr);
+            }
+            CHECK(sTree.eraseBatch(sBatch.begin(), sBatch.end()), sBatch.size() - sUnique.size());
+            for (Item_t* sItem : sUnique)
+            {
+                sRefErase(sItem);
+                delete sItem;
+            }
+            break;
+        }
+        default:
+        {
+            // Split and merge back with the items of another tree.
+            Tree_t sRight, sOther;
+            sTree.split(r, sRight);
+            checkSequence(sTree, Ref_t(sRef.begin(), sRef.lower_bound(r)));
+            checkSequence(sRight, Ref_t(sRef.lower_bound(r), sRef.end()));
+            sTree.join(sRight);
+            for (size_t j = rand() % 8; j > 0; j--)
+            {
+                Item_t* sNew = new Item_t(rand() % (SIZE_LIMIT / 4));
+                sOther.insert(*sNew);
+                sRef.insert(std::make_pair(sNew->m_Value, sNew));
+            }
+            sTree.merge(sOther);
+            CHECK(sOther.size(), static_cast<size_t>(0));
+            break;
+        }
+        }
+        checkSequence(sTree, sRef);
+
+        const Tree_t& sConstTree = sTree;
+        CHECK(sConstTree.count(r), sRef.count(r));
+        std::pair<typename Tree_t::const_iterator, typename Tree_t::const_iterator> sRange = sConstTree.equal_range(r);
+        CHECK(sRange.first == sConstTree.lower_bound(r));
+        CHECK(sRange.second == sConstTree.upper_bound(r));
+        if (sRef.count(r) != 0)
+        {
+            CHECK(sTree.find(r) != sTree.end());
+            CHECK(sTree.find(r)->m_Value, r);
+            CHECK(&*sRange.first == sRef.lower_bound(r)->second);
+        }
+        else
+        {
+            CHECK(sTree.find(r) == sTree.end());
+        }
+    }
+
+    while (sTree.size() != 0)
+    {
+        Item_t* sItem = &*sTree.begin();
+        sTree.erase(*sItem);
+        delete sItem;
+    }
+}
+
+static void multi()
+{
+    ANNOUNCE();
+
+    multiset<Avl::Node>();
+    multiset<Avl::CountedNode>();
+    multiset<Avl::KeyNode<CoarseKeyPrefix>>();
+}
+
+// Intervals [m_Value, m_End) in an interval tree and in a tree of sums of their ends.
+struct IntervalTest
+{
+    IntervalTest(size_t aValue, size_t aEnd) : m_Value(aValue), m_End(aEnd) {}
+
+    size_t m_Value;
+    size_t m_End;
+    Avl::AugmentedNode<Avl::MaxOf<IntervalTest, size_t, &IntervalTest::m_End>> m_MaxNode;
+    Avl::AugmentedNode<Avl::SumOf<IntervalTest, size_t, &IntervalTest::m_End>> m_SumNode;
+    bool operator<(const IntervalTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const IntervalTest& b) { return a < b.m_Value; }
+};
+
+static void augmented()
+{
+    ANNOUNCE();
+
+    using MaxTree_t = Avl::BasicTree<IntervalTest, decltype(IntervalTest::m_MaxNode), &IntervalTest::m_MaxNode,
+                                     Avl::Default<IntervalTest>, true>;
+    using SumTree_t = Avl::BasicTree<IntervalTest, decltype(IntervalTest::m_SumNode), &IntervalTest::m_SumNode>;
+
+    const size_t SIZE_LIMIT = 256;
+    const size_t ITERATIONS = 4 * 1024;
+
+    MaxTree_t sMaxTree;
+    SumTree_t sSumTree;
+    std::vector<IntervalTest*> sItems;
+    auto sNew = [](size_t aValue) { return new IntervalTest(aValue, aValue + 1 + rand() % (SIZE_LIMIT / 8)); };
+
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        size_t r = rand() % SIZE_LIMIT;
+        size_t sIndex = sItems.empty() ? 0 : rand() % sItems.size();
+        switch (sItems.empty() ? 0 : rand() % 6)
+        {
+        case 0:
+        {
+            // The sum tree has unique keys, the interval tree takes them as well.
+            if (sSumTree.find(r) != sSumTree.end())
+                break;
+            IntervalTest* sItem = sNew(r);
+            CHECK(sSumTree.insert(*sItem).second);
+            CHECK(sMaxTree.insert(*sItem).second);
+            sItems.push_back(sItem);
+            break;
+        }
+        case 1:
+            sMaxTree.erase(*sItems[sIndex]);
+            sSumTree.erase(*sItems[sIndex]);
+            delete sItems[sIndex];
+            sItems.erase(sItems.begin() + sIndex);
+            break;
+        case 2:
+            sItems[sIndex]->m_End = sItems[sIndex]->m_Value + 1 + rand() % SIZE_LIMIT;
+            sMaxTree.refresh(*sItems[sIndex]);
+            sSumTree.refresh(*sItems[sIndex]);
+            break;
+        case 3:
+        {
+            IntervalTest* sItem = sNew(sItems[sIndex]->m_Value);
+            sMaxTree.replace(*sItems[sIndex], *sItem);
+            sSumTree.replace(*sItems[sIndex], *sItem);
+            delete sItems[sIndex];
+            sItems[sIndex] = sItem;
+            break;
+        }
+        case 4:
+        {
+            MaxTree_t sMaxRight;
+            SumTree_t sSumRight;
+            sMaxTree.split(r, sMaxRight);
+            sSumTree.split(r, sSumRight);
+            CHECK(sMaxTree.selfCheck(), 0);
+            CHECK(sMaxRight.selfCheck(), 0);
+            CHECK(sSumTree.selfCheck(), 0);
+            CHECK(sSumRight.selfCheck(), 0);
+            sMaxTree.join(sMaxRight);
+            sSumTree.join(sSumRight);
+            break;
+        }
+        default:
+        {
+            // Keys missing in the tree, so that both trees take all of them.
+            std::set<size_t> sKeys;
+            for (size_t j = 1 + rand() % (rand() % 4 == 0 ? SIZE_LIMIT : 8); j > 0; j--)
+                if (sSumTree.find(r = rand() % SIZE_LIMIT) == sSumTree.end())
+                    sKeys.insert(r);
+            std::vector<IntervalTest*> sBatch;
+            for (size_t sKey : sKeys)
+                sBatch.push_back(sNew(sKey));
+            std::vector<IntervalTest*> sCopy(sBatch);
+            CHECK(sMaxTree.insertBatch(sCopy.begin(), sCopy.end()), static_cast<size_t>(0));
+            CHECK(sSumTree.insertBatch(sBatch.begin(), sBatch.end()), static_cast<size_t>(0));
+            sItems.insert(sItems.end(), sBatch.begin(), sBatch.end());
+            break;
+        }
+        }
+        CHECK(sMaxTree.selfCheck(), 0);
+        CHECK(sSumTree.selfCheck(), 0);
+        CHECK(sMaxTree.size(), sItems.size());
+        CHECK(sSumTree.size(), sItems.size());
+
+        size_t sLow = rand() % SIZE_LIMIT;
+        size_t sHigh = sLow + rand() % (SIZE_LIMIT / 4);
+        size_t sSum = 0;
+        size_t sMax = sLow;
+        std::vector<const IntervalTest*> sOverlaps;
+        for (const IntervalTest* sItem : sItems)
+        {
+            if (sItem->m_Value >= sLow && sItem->m_Value < sHigh)
+            {
+                sSum += sItem->m_End;
+                sMax = std::max(sMax, sItem->m_End);
+            }
+            if (sItem->m_Value < sHigh && sItem->m_End > sLow)
+                sOverlaps.push_back(sItem);
+        }
+        CHECK(sSumTree.aggregate(sLow, sHigh, static_cast<size_t>(1)), 1 + sSum);
+        CHECK(sMaxTree.aggregate(sLow, sHigh, sLow), sMax);
+
+        std::vector<const IntervalTest*> sFound;
+        const MaxTree_t& sConstTree = sMaxTree;
+        sConstTree.forEachOverlap(sLow, sHigh, [&sFound](const IntervalTest& aItem) { sFound.push_back(&aItem); });
+        CHECK(std::is_sorted(sFound.begin(), sFound.end(), [](const IntervalTest* a, const IntervalTest* b) { return *a < *b; }));
+        std::sort(sFound.begin(), sFound.end());
+        std::sort(sOverlaps.begin(), sOverlaps.end());
+        CHECK(sFound == sOverlaps);
+        size_t sVisited = 0;
+        sMaxTree.forEachOverlap(sLow, sHigh, [&sVisited](IntervalTest&) { sVisited++; });
+        CHECK(sVisited, sOverlaps.size());
+    }
+
+    for (IntervalTest* sItem : sItems)
+    {
+        sMaxTree.erase(*sItem);
+        sSumTree.erase(*sItem);
+        delete sItem;
+    }
+    CHECK(sMaxTree.size(), static_cast<size_t>(0));
+    CHECK(sSumTree.size(), static_cast<size_t>(0));
+}
+
+static void hints()
+{
+    ANNOUNCE();
+
+    const size_t SIZE_LIMIT = 512;
+    const size_t ITERATIONS = 16 * 1024;
+
+    CountedTree_t sTree;
+    std::set<size_t> sRef;
+
+    // Appends at both ends.
+    for (size_t i = 0; i < SIZE_LIMIT / 4; i++)
+    {
+        size_t sValue = SIZE_LIMIT / 2 + (i % 2 == 0 ? i / 2 : -1 - i / 2);
+        CHECK(sTree.insert(sTree.end(), *new CountedTest(sValue)).second);
+        sRef.insert(sValue);
+        CHECK(sTree.min()->m_Value, *sRef.begin());
+        CHECK(sTree.max()->m_Value, *sRef.rbegin());
+    }
+    checkEqual(sTree, sRef);
+
+    // Random keys near and far from random hints.
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        CountedTree_t::const_iterator sHint = sTree.end();
+        if (sTree.size() != 0 && rand() % 8 != 0)
+            sHint = sTree.select(rand() % sTree.size());
+        size_t r = rand() % SIZE_LIMIT;
+        if (sHint != sTree.end() && rand() % 2 == 0)
+            r = (sHint->m_Value + rand() % 8) % SIZE_LIMIT;
+
+        CountedTree_t::iterator sFound = sTree.find(sHint, r);
+        CHECK(sFound == sTree.find(r));
+        if (sFound != sTree.end())
+        {
+            CHECK(!sTree.insert(sHint, *sFound).second);
+            if (rand() % 2 == 0)
+            {
+                sTree.erase(*sFound);
+                sRef.erase(r);
+                delete &*sFound;
+            }
+        }
+        else
+        {
+            CountedTest* sNew = new CountedTest(r);
+            std::pair<CountedTree_t::iterator, bool> sRes = sTree.insert(sHint, *sNew);
+            CHECK(sRes.second);
+            CHECK(&*sRes.first == sNew);
+            sRef.insert(r);
+        }
+        CHECK(sTree.selfCheck(), 0);
+        if (!sRef.empty())
+        {
+            CHECK(sTree.min()->m_Value, *sRef.begin());
+            CHECK(sTree.max()->m_Value, *sRef.rbegin());
+        }
+    }
+    checkEqual(sTree, sRef);
+
+    while (sTree.size() != 0)
+    {
+        CountedTest* sItem = &*sTree.begin();
+        sTree.erase(*sItem);
+        delete sItem;
+    }
+}
+
+static void owning()
+{
+    ANNOUNCE();
+
+    const size_t SIZE_LIMIT = 512;
+    const size_t ITERATIONS = 16 * 1024;
+
+    // Move-only values.
+    Avl::Map<size_t, std::unique_ptr<size_t>> sMap;
+    std::map<size_t, size_t> sRef;
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        size_t r = rand() % SIZE_LIMIT;
+        switch (rand() % 4)
+        {
+        case 0:
+            CHECK(sMap.emplace(r, std::unique_ptr<size_t>(new size_t(i))).second, sRef.emplace(r, i).second);
+            break;
+        case 1:
+            sMap[r] = std::unique_ptr<size_t>(new size_t(i));
+            sRef[r] = i;
+            break;
+        case 2:
+            CHECK(sMap.erase(r), sRef.erase(r));
+            break;
+        default:
+        {
+            Avl::Map<size_t, std::unique_ptr<size_t>>::const_iterator sItr = sMap.lower_bound(r);
+            if (sItr == sMap.end())
+                break;
+            std::map<size_t, size_t>::iterator sNext = sRef.erase(sRef.lower_bound(r));
+            Avl::Map<size_t, std::unique_ptr<size_t>>::iterator sMapNext = sMap.erase(sItr);
+            CHECK((sMapNext == sMap.end()) == (sNext == sRef.end()));
+            if (sMapNext != sMap.end() && sNext != sRef.end())
+                CHECK(sMapNext->first, sNext->first);
+            break;
+        }
+        }
+        if (i % (ITERATIONS / 4) == 0)
+        {
+            sMap.clear();
+            sRef.clear();
+        }
+        else if (i % (ITERATIONS / 16) == 0)
+        {
+            Avl::Map<size_t, std::unique_ptr<size_t>>::iterator sLast = sMap.lower_bound(r + SIZE_LIMIT / 8);
+            CHECK(sMap.erase(sMap.lower_bound(r), sLast) == sLast);
+            sRef.erase(sRef.lower_bound(r), sRef.lower_bound(r + SIZE_LIMIT / 8));
+        }
+
+        CHECK(sMap.selfCheck(), 0);
+        CHECK(sMap.size(), sRef.size());
+        std::map<size_t, size_t>::iterator sRefItr = sRef.begin();
+        for (const std::pair<const size_t, std::unique_ptr<size_t>>& sValue : sMap)
+        {
+            CHECK(sValue.first, sRefItr->first);
+            CHECK(*sValue.second, sRefItr->second);
+            ++sRefItr;
+        }
+        CHECK(sMap.count(r), sRef.count(r));
+        CHECK(sMap.find(r) == sMap.end(), sRef.find(r) == sRef.end());
+    }
+
+    // Erased nodes are reused before new slabs are taken.
+    for (size_t i = 0; i < SIZE_LIMIT; i++)
+        sMap.try_emplace(i);
+    size_t sCapacity = sMap.capacity();
+    CHECK(sCapacity >= SIZE_LIMIT);
+    while (!sMap.empty())
+        sMap.erase(sMap.begin());
+    for (size_t i = 0; i < SIZE_LIMIT; i++)
+        CHECK(sMap.try_emplace(i, new size_t(i)).second);
+    CHECK(!sMap.try_emplace(0).second);
+    CHECK(*sMap[0], static_cast<size_t>(0));
+    CHECK(sMap.capacity(), sCapacity);
+    sMap.clear();
+    CHECK(sMap.capacity(), static_cast<size_t>(0));
+
+    // Keys that are compared by less only.
+    Avl::Set<std::string> sSet;
+    std::set<std::string> sSetRef;
+    for (size_t i = 0; i < ITERATIONS / 4; i++)
+    {
+        std::string sKey = std::to_string(rand() % SIZE_LIMIT);
+        if (rand() % 4 == 0)
+            CHECK(sSet.erase(sKey), sSetRef.erase(sKey));
+        else
+            CHECK(sSet.insert(sKey).second, sSetRef.insert(sKey).second);
+    }
+    CHECK(sSet.selfCheck(), 0);
+    CHECK(sSet.size(), sSetRef.size());
+    CHECK(std::equal(sSet.begin(), sSet.end(), sSetRef.begin()));
+    Avl::Set<std::string> sMoved(std::move(sSet));
+    CHECK(sSet.empty());
+    CHECK(sMoved.size(), sSetRef.size());
+    CHECK(sMoved.find(*sSetRef.begin()) == sMoved.begin());
+    sSet.insert("x");
+    sSet = std::move(sMoved);
+    CHECK(sMoved.empty());
+    CHECK(sSet.selfCheck(), 0);
+    CHECK(std::equal(sSet.begin(), sSet.end(), sSetRef.begin()) && sSet.size() == sSetRef.size());
+    sMoved.insert("y");
+    CHECK(sMoved.size(), static_cast<size_t>(1));
+    static_assert(!std::is_convertible<Avl::Set<std::string>::const_iterator, Avl::Set<std::string>::iterator>::value,
+                  "const iterators must not convert to mutable ones");
+}
+
+static void parallel()
+{
+    ANNOUNCE();
+
+    const size_t SIZE_LIMIT = 2048;
+
+    std::vector<Test> sItems(SIZE_LIMIT);
+    for (size_t sSize : {0, 1, 2, 3, 17, 100, 1000, 2048})
+    {
+        // Random keys, so that the tree is not perfectly balanced.
+        Tree_t sTree;
+        std::set<size_t> sRef;
+        for (size_t i = 0; i < sSize; i++)
+        {
+            sItems[i].m_Value = rand();
+            if (sTree.insert(sItems[i]).second)
+                sRef.insert(sItems[i].m_Value);
+        }
+        std::vector<size_t> sExpected(sRef.begin(), sRef.end());
+
+        for (size_t sThreads : {1, 3, 8})
+        {
+            std::atomic<size_t> sCount(0);
+            std::atomic<size_t> sSum(0);
+            sTree.parallelForEach(sThreads, [&](Test& aItem) { sCount++; sSum += aItem.m_Value; });
+            CHECK(sCount.load(), sRef.size());
+            size_t sRefSum = 0;
+            for (size_t sValue : sRef)
+                sRefSum += sValue;
+            CHECK(sSum.load(), sRefSum);
+
+            // Concatenation is not commutative: the order of pieces must be kept.
+            using Values = std::vector<size_t>;
+            const Tree_t& sConstTree = sTree;
+            Values sValues = sConstTree.parallelReduce(sThreads, Values(),
+                [](Values aValues, const Test& aItem) { aValues.push_back(aItem.m_Value); return aValues; },
+                [](Values aLeft, const Values& aRight) { aLeft.insert(aLeft.end(), aRight.begin(), aRight.end()); return aLeft; });
+            CHECK(sValues == sExpected);
+        }
+    }
+}
+
+struct TestKey
+{
+    size_t operator()(const Test& aItem) const { return aItem.m_Value; }
+};
+
+struct TestKey32
+{
+    uint32_t operator()(const Test& aItem) const { return static_cast<uint32_t>(aItem.m_Value); }
+};
+
+struct TestSignedKey
+{
+    int64_t operator()(const Test& aItem) const { return static_cast<int64_t>(aItem.m_Value) - 1024; }
+};
+
+template <class KeyOf, bool IntegralKey>
+static void frozenLayout()
+{
+    using Frozen_t = Avl::FrozenTree<Test, KeyOf, IntegralKey>;
+    const size_t SIZE_LIMIT = 1024;
+    KeyOf sKeyOf;
+
+    std::vector<Test> sItems(SIZE_LIMIT);
+    for (size_t sSize : {0, 1, 2, 3, 7, 8, 9, 16, 17, 100, 1000})
+    {
+        Tree_t sTree;
+        std::set<size_t> sRef;
+        for (size_t i = 0; i < sSize; i++)
+        {
+            sItems[i].m_Value = 1 + rand() % (SIZE_LIMIT * 2);
+            if (sTree.insert(sItems[i]).second)
+                sRef.insert(sItems[i].m_Value);
+        }
+        Frozen_t sFrozen(sTree.begin(), sTree.size());
+        CHECK(sFrozen.size(), sRef.size());
+        checkEqual(sFrozen, sRef);
+        for (const Test& sItem : sFrozen)
+            CHECK(&sItem == &*sTree.find(sItem.m_Value));
+
+        for (size_t sKey = 0; sKey <= SIZE_LIMIT * 2 + 1; sKey++)
+        {
+            typename Frozen_t::const_iterator sFound = sFrozen.find(sKeyOf(Test(sKey)));
+            CHECK((sFound != sFrozen.end()), (sRef.count(sKey) != 0));
+            if (sFound != sFrozen.end())
+                CHECK(&*sFound == &*sTree.find(sKey));
+            typename Frozen_t::const_iterator sBound = sFrozen.lower_bound(sKeyOf(Test(sKey)));
+            std::set<size_t>::iterator sRefBound = sRef.lower_bound(sKey);
+            CHECK((sBound != sFrozen.end()), (sRefBound != sRef.end()));
+            if (sBound != sFrozen.end() && sRefBound != sRef.end())
+                CHECK(sBound->m_Value, *sRefBound);
+        }
+    }
+
+    // From a sorted range of pointers.
+    std::vector<const Test*> sSorted;
+    for (size_t i = 0; i < 10; i++)
+    {
+        sItems[i].m_Value = i * 10;
+        sSorted.push_back(&sItems[i]);
+    }
+    Frozen_t sFrozen(sSorted.begin(), sSorted.size());
+    CHECK(sFrozen.lower_bound(sKeyOf(Test(15)))->m_Value, static_cast<size_t>(20));
+    CHECK(sFrozen.find(sKeyOf(Test(15))) == sFrozen.end());
+    CHECK(&*sFrozen.find(sKeyOf(Test(90))) == &sItems[9]);
+    CHECK(&*sFrozen.begin() == &sItems[0]);
+}
+
+static void frozen()
+{
+    ANNOUNCE();
+
+    frozenLayout<TestKey, false>();
+    frozenLayout<TestKey, true>();
+    frozenLayout<TestKey32, true>();
+    frozenLayout<TestSignedKey, true>();
+
+    Tree_t sTree;
+    Test sItem(7);
+    sTree.insert(sItem);
+    Avl::FrozenTree<Test, TestKey> sFrozen = Avl::freeze(sTree, TestKey());
+    CHECK(&*sFrozen.find(7) == &sItem);
+}
+
+struct SyncTest
+{
+    explicit SyncTest(size_t aValue) : m_Value(aValue) {}
+
+    size_t m_Value;
+    Avl::AtomicNode m_Node;
+    bool operator<(const SyncTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const SyncTest& b) { return a < b.m_Value; }
+};
+
+using SyncTree_t = Avl::SingleWriterTree<SyncTest, &SyncTest::m_Node>;
+
+static void singleWriter()
+{
+    ANNOUNCE();
+
+    const size_t SIZE = 1024;
+    const size_t WRITES = 64 * 1024;
+    const size_t READERS = 3;
+    const size_t POISON = SIZE_MAX;
+
+    // Even keys are always in the tree, odd keys come and go.
+    SyncTree_t sTree;
+    for (size_t i = 0; i < SIZE; i += 2)
+        sTree.insert(*new SyncTest(i));
+
+    std::atomic<bool> sDone(false);
+    std::atomic<size_t> sErrors(0);
+    auto sRead = [&](size_t aSeed)
+    {
+        SyncTree_t::Reader sReader(sTree);
+        size_t sErrorCount = 0;
+        while (!sDone.load())
+        {
+            aSeed = aSeed * 6364136223846793005ull + 1442695040888963407ull;
+            size_t sKey = (aSeed >> 33) % SIZE;
+            sReader.lock();
+            const SyncTest* sFound = sReader.find(sKey);
+            if ((sKey % 2 == 0 && nullptr == sFound) || (nullptr != sFound && sFound->m_Value != sKey))
+                sErrorCount++;
+            const SyncTest* sBound = sReader.lower_bound(sKey);
+            if (sKey + 1 < SIZE && (nullptr == sBound || sBound->m_Value < sKey || sBound->m_Value > sKey + 1))
+                sErrorCount++;
+            size_t sPrev = sKey;
+            size_t sScanned = 0;
+            sReader.scan(sKey, [&](const SyncTest& aItem)
+            {
+                if (aItem.m_Value < sKey || aItem.m_Value > sPrev + 2 || (0 != sScanned && aItem.m_Value <= sPrev))
+                    sErrorCount++;
+                sPrev = aItem.m_Value;
+                return ++sScanned < 16;
+            });
+            // Erased items must not be reclaimed until unlock.
+            std::this_thread::yield();
+            if (nullptr != sFound && sFound->m_Value != sKey)
+                sErrorCount++;
+            sReader.unlock();
+        }
+        sErrors += sErrorCount;
+    };
+    std::vector<std::thread> sReaders;
+    for (size_t i = 0; i < READERS; i++)
+        sReaders.emplace_back(sRead, i);
+
+    std::vector<SyncTest*> sFree;
+    auto sDisposer = [&sFree, POISON](SyncTest& aItem)
+    {
+        aItem.m_Value = POISON;
+        sFree.push_back(&aItem);
+    };
+    for (size_t i = 0; i < WRITES; i++)
+    {
+        size_t sKey = (rand() % (SIZE / 2)) * 2 + 1;
+        SyncTree_t::BaseTree::const_iterator sItr = sTree.tree().find(sKey);
+        if (sItr != sTree.tree().end())
+        {
+            sTree.erase(const_cast<SyncTest&>(*sItr));
+        }
+        else
+        {
+            SyncTest* sItem;
+            if (sFree.empty())
+            {
+                sItem = new SyncTest(sKey);
+            }
+            else
+            {
+                sItem = sFree.back();
+                sFree.pop_back();
+                sItem->m_Value = sKey;
+            }
+            sTree.insert(*sItem);
+        }
+        if (i % 64 == 0)
+            sTree.reclaim(sDisposer);
+    }
+    sDone = true;
+    for (std::thread& sThread : sReaders)
+        sThread.join();
+
+    CHECK(sErrors.load(), static_cast<size_t>(0));
+    CHECK(sTree.tree().selfCheck(), 0);
+    sTree.reclaim(sDisposer);
+    CHECK(sTree.retired(), static_cast<size_t>(0));
+    while (sTree.size() != 0)
+        sTree.erase(const_cast<SyncTest&>(*sTree.tree().begin()));
+    sTree.reclaim(sDisposer);
+    for (SyncTest* sItem : sFree)
+        delete sItem;
+}
+
+struct ConcurrentTest
+{
+    explicit ConcurrentTest(size_t aValue) : m_Value(aValue) {}
+
+    size_t m_Value;
+    std::atomic<bool> m_Free{true};
+    Avl::ConcurrentNode m_Node;
+    bool operator<(const ConcurrentTest& a) const { return m_Value < a.m_Value; }
+    bool operator<(size_t a) const { return m_Value < a; }
+    friend bool operator<(size_t a, const ConcurrentTest& b) { return a < b.m_Value; }
+};
+
+using ConcurrentTree_t = Avl::ConcurrentTree<ConcurrentTest, &ConcurrentTest::m_Node>;
+
+static void concurrent()
+{
+    ANNOUNCE();
+
+    const size_t SIZE_LIMIT = 512;
+    auto sDisposer = [](ConcurrentTest& aItem) { aItem.m_Free = true; };
+
+    // Single thread against std::set.
+    {
+        const size_t ITERATIONS = 32 * 1024;
+        ConcurrentTree_t sTree;
+        ConcurrentTree_t::Session sSession(sTree);
+        std::vector<ConcurrentTest*> sItems;
+        for (size_t i = 0; i < SIZE_LIMIT * 2; i++)
+            sItems.push_back(new ConcurrentTest(0));
+        std::set<size_t> sRef;
+        sSession.lock();
+        for (size_t i = 0; i < ITERATIONS; i++)
+        {
+            size_t r = rand() % SIZE_LIMIT;
+            ConcurrentTest* sFound = sSession.find(r);
+            CHECK((nullptr != sFound), (sRef.count(r) != 0));
+            if (nullptr != sFound)
+            {
+                CHECK(sFound->m_Value, r);
+                CHECK(sSession.erase(*sFound));
+                CHECK(!sSession.erase(*sFound));
+                sRef.erase(r);
+            }
+            else
+            {
+                ConcurrentTest* sItem = nullptr;
+                for (ConcurrentTest* sCandidate : sItems)
+                    if (sCandidate->m_Free)
+                        sItem = sCandidate;
+                if (nullptr == sItem)
+                {
+                    sSession.unlock();
+                    sTree.reclaim(sDisposer);
+                    sSession.lock();
+                    continue;
+                }
+                sItem->m_Free = false;
+                sItem->m_Value = r;
+                CHECK(sSession.insert(*sItem));
+                ConcurrentTest sSame(r);
+                CHECK(!sSession.insert(sSame));
+                sRef.insert(r);
+            }
+            CHECK(sTree.selfCheck(), 0);
+            CHECK(sTree.size(), sRef.size());
+        }
+        sSession.unlock();
+        for (ConcurrentTest* sItem : sItems)
+            if (!sItem->m_Free)
+                sSession.erase(*sItem);
+        CHECK(sTree.size(), static_cast<size_t>(0));
+        for (ConcurrentTest* sItem : sItems)
+            delete sItem;
+    }
+
+    // Threads insert and erase their own items with random keys, and look up all the keys.
+    {
+        const size_t THREADS = 4;
+        const size_t ITEMS_PER_THREAD = SIZE_LIMIT / 2;
+        const size_t ITERATIONS = 32 * 1024;
+        ConcurrentTree_t sTree;
+        std::vector<std::vector<ConcurrentTest*>> sItems(THREADS);
+        std::atomic<size_t> sErrors(0);
+        auto sWork = [&](size_t aThread)
+        {
+            ConcurrentTree_t::Session sSession(sTree);
+            std::vector<ConcurrentTest*>& sOwn = sItems[aThread];
+            for (size_t i = 0; i < ITEMS_PER_THREAD; i++)
+                sOwn.push_back(new ConcurrentTest(0));
+            std::vector<bool> sInTree(ITEMS_PER_THREAD, false);
+            size_t sSeed = aThread;
+            size_t sErrorCount = 0;
+            for (size_t i = 0; i < ITERATIONS; i++)
+            {
+                sSeed = sSeed * 6364136223846793005ull + 1442695040888963407ull;
+                size_t r = (sSeed >> 33) % SIZE_LIMIT;
+                size_t sIndex = (sSeed >> 20) % ITEMS_PER_THREAD;
+                ConcurrentTest* sItem = sOwn[sIndex];
+                sSession.lock();
+                ConcurrentTest* sFound = sSession.find(r);
+                if (nullptr != sFound && sFound->m_Value != r)
+                    sErrorCount++;
+                if (sInTree[sIndex])
+                {
+                    // Nobody else erases our items.
+                    if (!sSession.erase(*sItem))
+                        sErrorCount++;
+                    sInTree[sIndex] = false;
+                }
+                else if (sItem->m_Free)
+                {
+                    sItem->m_Free = false;
+                    sItem->m_Value = r;
+                    sInTree[sIndex] = sSession.insert(*sItem);
+                    if (!sInTree[sIndex])
+                        sItem->m_Free = true;
+                }
+                std::this_thread::yield();
+                if (nullptr != sFound && sFound->m_Value != r)
+                    sErrorCount++;
+                sSession.unlock();
+                if (i % 64 == 0)
+                    sTree.reclaim(sDisposer);
+            }
+            sErrors += sErrorCount;
+        };
+        std::vector<std::thread> sThreads;
+        for (size_t i = 0; i < THREADS; i++)
+            sThreads.emplace_back(sWork, i);
+        for (std::thread& sThread : sThreads)
+            sThread.join();
+
+        CHECK(sErrors.load(), static_cast<size_t>(0));
+        CHECK(sTree.selfCheck(), 0);
+        std::set<size_t> sRef;
+        size_t sInTree = 0;
+        {
+            ConcurrentTree_t::Session sSession(sTree);
+            sSession.lock();
+            for (std::vector<ConcurrentTest*>& sOwn : sItems)
+            {
+                for (ConcurrentTest* sItem : sOwn)
+                {
+                    if (sItem->m_Free || sSession.find(sItem->m_Value) != sItem)
+                        continue;
+                    sInTree++;
+                    CHECK(sRef.insert(sItem->m_Value).second);
+                }
+            }
+            sSession.unlock();
+            CHECK(sInTree, sTree.size());
+            for (std::vector<ConcurrentTest*>& sOwn : sItems)
+                for (ConcurrentTest* sItem : sOwn)
+                    if (sSession.find(sItem->m_Value) == sItem)
+                        sSession.erase(*sItem);
+        }
+        CHECK(sTree.size(), static_cast<size_t>(0));
+        sTree.reclaim(sDisposer);
+        for (std::vector<ConcurrentTest*>& sOwn : sItems)
+            for (ConcurrentTest* sItem : sOwn)
+                delete sItem;
+    }
+}
+
+using ShardedTree_t = Avl::ShardedTree<Test, &Test::m_Node>;
+
+static void sharded()
+{
+    ANNOUNCE();
+
+    const size_t SIZE_LIMIT = 1024;
+    const size_t ITERATIONS = 16 * 1024;
+
+    // Shards [0, 100), [100, 200), [200, 300) stay empty, [300, 600), [600, ...).
+    std::vector<Test> sBounds{Test(100), Test(200), Test(300), Test(600)};
+    ShardedTree_t sTree(sBounds.begin(), sBounds.end());
+    CHECK(sTree.shardCount(), static_cast<size_t>(5));
+    CHECK(sTree.shardOf(99), static_cast<size_t>(0));
+    CHECK(sTree.shardOf(100), static_cast<size_t>(1));
+    CHECK(sTree.shardOf(599), static_cast<size_t>(3));
+    CHECK(sTree.shardOf(SIZE_LIMIT), static_cast<size_t>(4));
+    CHECK(sTree.begin() == sTree.end());
+    CHECK(nullptr == sTree.lower_bound(0));
+
+    std::vector<Test> sItems(SIZE_LIMIT);
+    std::set<size_t> sRef;
+    for (size_t i = 0; i < ITERATIONS; i++)
+    {
+        size_t r = 300 + rand() % (SIZE_LIMIT - 300);
+        Test* sFound = sTree.find(r);
+        CHECK((nullptr != sFound), (sRef.count(r) != 0));
+        if (nullptr != sFound)
+        {
+            CHECK(sFound == &sItems[r]);
+            sTree.erase(*sFound);
+            sRef.erase(r);
+        }
+        else
+        {
+            sItems[r].m_Value = r;
+            CHECK(sTree.insert(sItems[r]));
+            CHECK(!sTree.insert(sItems[r]));
+            sRef.insert(r);
+        }
+        size_t sKey = rand() % SIZE_LIMIT;
+        Test* sBound = sTree.lower_bound(sKey);
+        std::set<size_t>::iterator sRefBound = sRef.lower_bound(sKey);
+        CHECK((nullptr != sBound), (sRefBound != sRef.end()));
+        if (nullptr != sBound && sRefBound != sRef.end())
+            CHECK(sBound->m_Value, *sRefBound);
+    }
+    CHECK(sTree.selfCheck(), 0);
+    CHECK(sTree.size(), sRef.size());
+    checkEqual(sTree, sRef);
+    size_t sCount = 0;
+    for (ShardedTree_t::iterator sItr = sTree.begin(); sItr != sTree.end(); sItr++, sCount++)
+        CHECK(&*sItr == &sItems[sItr->m_Value]);
+    CHECK(sCount, sRef.size());
+    CHECK(sTree.shard(0).size(), static_cast<size_t>(0));
+    CHECK(sTree.shard(3).size(), static_cast<size_t>(std::distance(sRef.begin(), sRef.lower_bound(600))));
+    sTree.clear();
+    CHECK(sTree.size(), static_cast<size_t>(0));
+
+    // Threads fill their own ranges of keys through all the shards.
+    const size_t THREADS = 4;
+    std::vector<std::thread> sThreads;
+    for (size_t t = 0; t < THREADS; t++)
+    {
+        sThreads.emplace_back([&sTree, &sItems, t]()
+        {
+            for (size_t i = t; i < SIZE_LIMIT; i += THREADS)
+            {
+                sItems[i].m_Value = i;
+                sTree.insert(sItems[i]);
+            }
+            for (size_t i = t; i < SIZE_LIMIT; i += 2 * THREADS)
+                sTree.erase(sItems[i]);
+        });
+    }
+    for (std::thread& sThread : sThreads)
+        sThread.join();
+    sRef.clear();
+    for (size_t i = 0; i < SIZE_LIMIT; i++)
+        if (i % (2 * THREADS) >= THREADS)
+            sRef.insert(i);
+    CHECK(sTree.selfCheck(), 0);
+    checkEqual(sTree, sRef);
+}
+
 int main()
 {
     simple();
+    bounds();
+    build();
     massive();
+    counted();
+    layouts();
+    comparators();
+    relocation();
+    relayout();
+    joinSplit();
+    rangeErase();
+    iterators();
+    statistics();
+    shapes();
+    batches();
+    multi();
+    augmented();
+    hints();
+    owning();
+    parallel();
+    frozen();
+    singleWriter();
+    concurrent();
+    sharded();
 
     std::cout << (0 == rc ? "Success" : "Finished with errors") << std::endl;
     return rc;